@@ -1,16 +1,29 @@
 #version 450 core
 
-uniform vec3 CameraPosition;
-uniform mat4 MVPMat;
-uniform mat4 ModelMat;
-uniform mat3 NormalMat;
-uniform sampler2D DiffuseMap;
-uniform sampler2D SpecularMap;
-uniform sampler2D NormalMap;
-uniform sampler2D BumpMap;
-uniform sampler2D TranslucencyMap;
-uniform float ParallaxDepth;
-uniform float Gamma;
+layout (binding=0) uniform sampler2D DiffuseMap;
+layout (binding=1) uniform sampler2D SpecularMap;
+layout (binding=2) uniform sampler2D NormalMap;
+layout (binding=3) uniform sampler2D BumpMap;
+layout (binding=4) uniform sampler2D TranslucencyMap;
+
+#include "FrameUniforms.glsl"
+
+// Material textures either come bound one by one (DrawMaterialID < 0), or
+// from the texture arrays of a MaterialTable
+#define MAX_TEXTURE_ARRAYS 11
+const int DiffuseSlot = 0;
+const int SpecularSlot = 1;
+const int NormalSlot = 2;
+const int BumpSlot = 3;
+const int TranslucencySlot = 4;
+struct MaterialLayers {
+    ivec2 Maps[5]; // (array, layer) per slot
+};
+layout (std430, binding=0) readonly buffer MaterialBuffer {
+    MaterialLayers Materials[];
+};
+layout (binding=5) uniform sampler2DArray MaterialArrays[MAX_TEXTURE_ARRAYS];
+flat in int DrawMaterialID; // See DrawParameters.glsl
 
 in VertexData {
     vec2 TexCoords;
@@ -27,8 +40,20 @@ out vec3 SpecularBuf;
 out vec3 NormalBuf;
 out vec3 TranslucencyBuf;
 
+vec4 SampleMap(sampler2D map, int slot, vec2 st) {
+    if (DrawMaterialID < 0)
+        return texture(map, st);
+    ivec2 m = Materials[DrawMaterialID].Maps[slot];
+    return texture(MaterialArrays[m.x], vec3(st, m.y));
+}
+float QueryMapLod(sampler2D map, int slot, vec2 st) {
+    if (DrawMaterialID < 0)
+        return textureQueryLod(map, st).y;
+    return textureQueryLod(MaterialArrays[Materials[DrawMaterialID].Maps[slot].x], st).y;
+}
+
 float ParallaxMappingQuality(vec3 tsToCamera, vec2 st) {
-    float mipLevel = (textureQueryLod(BumpMap, st).y);
+    float mipLevel = QueryMapLod(BumpMap, BumpSlot, st);
     float align = 1-max(0, dot(tsToCamera, vec3(0,0,1)));
     if (mipLevel < 0.1) {
         return 1;
@@ -56,7 +81,7 @@ void ReliefParallaxMapping(
     float currLayerDepth = 0;
     while (currLayerDepth < ParallaxDepth) {
         // check if under surface
-        if (currLayerDepth > ParallaxDepth * texture(BumpMap, st).r)
+        if (currLayerDepth > ParallaxDepth * SampleMap(BumpMap, BumpSlot, st).r)
             break;
 
         currLayerDepth += depthStep;
@@ -71,7 +96,7 @@ void ReliefParallaxMapping(
         depthStep /= 2;
         stStep /= 2;
         // check if under surface
-        if (currLayerDepth > ParallaxDepth * texture(BumpMap, st).r) {
+        if (currLayerDepth > ParallaxDepth * SampleMap(BumpMap, BumpSlot, st).r) {
             currLayerDepth-=depthStep;
             st-=stStep;
         } else {
@@ -86,16 +111,24 @@ vec3 RGB2Normal(vec3 c){ return c*2-1;}
 vec3 Gamma_ToLinear(vec3 c) {return pow(c,vec3(Gamma));}
 vec3 Gamma_FromLinear(vec3 c) {return pow(c,vec3(1/Gamma));}
 
+// Cooked normal maps are BC5 and only store x and y, so z is always rebuilt
+vec3 SampleNormalMap(vec2 st) {
+    vec3 n;
+    n.xy = SampleMap(NormalMap, NormalSlot, st).rg*2-1;
+    n.z = sqrt(max(0, 1-dot(n.xy, n.xy)));
+    return n;
+}
+
 void main() {
     vec2 texCoords = vertexData.TexCoords;
-    if (texture(DiffuseMap, texCoords).a < 0.5) {
+    if (SampleMap(DiffuseMap, DiffuseSlot, texCoords).a < 0.5) {
         discard;
     }
     vec3 tsToCamera = normalize( vertexData.TSToCamera );
     ReliefParallaxMapping(tsToCamera, texCoords);
     PositionBuf = vertexData.WSPosition;
-    DiffuseBuf = Gamma_ToLinear( texture(DiffuseMap, texCoords).rgb );
-    SpecularBuf = texture(SpecularMap, texCoords).rgb;
-    NormalBuf = vertexData.Tangent2World * RGB2Normal(texture(NormalMap, texCoords).rgb);
-    TranslucencyBuf = texture(TranslucencyMap, texCoords).rgb;
+    DiffuseBuf = Gamma_ToLinear( SampleMap(DiffuseMap, DiffuseSlot, texCoords).rgb );
+    SpecularBuf = SampleMap(SpecularMap, SpecularSlot, texCoords).rgb;
+    NormalBuf = vertexData.Tangent2World * SampleNormalMap(texCoords);
+    TranslucencyBuf = SampleMap(TranslucencyMap, TranslucencySlot, texCoords).rgb;
 }
\ No newline at end of file
@@ -1,15 +1,16 @@
 #version 450 core
+#ifdef MULTI_DRAW_INDIRECT
+#extension GL_ARB_shader_draw_parameters : require
+#endif
 
-uniform vec3 CameraPosition;
-uniform mat4 MVPMat;
-uniform mat4 ModelMat;
-uniform mat3 NormalMat;
-uniform sampler2D DiffuseMap;
-uniform sampler2D SpecularMap;
-uniform sampler2D NormalMap;
-uniform sampler2D BumpMap;
-uniform sampler2D TranslucencyMap;
-uniform float ParallaxDepth;
+layout (binding=0) uniform sampler2D DiffuseMap;
+layout (binding=1) uniform sampler2D SpecularMap;
+layout (binding=2) uniform sampler2D NormalMap;
+layout (binding=3) uniform sampler2D BumpMap;
+layout (binding=4) uniform sampler2D TranslucencyMap;
+
+#include "FrameUniforms.glsl"
+#include "DrawParameters.glsl"
 
 out VertexData {
     vec2 TexCoords;
@@ -18,23 +19,49 @@ out VertexData {
     vec3 TSToCamera;
     mat3 Tangent2World;
 } vertexData;
+// For DRGeometry.frag, which can't see the draw parameters
+flat out int DrawMaterialID;
+
+#ifdef COMPACT_VERTICES
+layout (location=0) in vec4 PackedPosition;
+layout (location=2) in vec2 TexCoords;
+layout (location=6) in vec4 QTangent;
 
+// Tangent frame quaternion to its rotation matrix columns,
+// a negative w mirrors the bitangent
+void DecodeQTangent(vec4 q, out vec3 tangent, out vec3 bitangent, out vec3 normal) {
+    q = normalize(q);
+    tangent = vec3(1 - 2*(q.y*q.y + q.z*q.z), 2*(q.x*q.y + q.w*q.z), 2*(q.x*q.z - q.w*q.y));
+    bitangent = vec3(2*(q.x*q.y - q.w*q.z), 1 - 2*(q.x*q.x + q.z*q.z), 2*(q.y*q.z + q.w*q.x));
+    normal = vec3(2*(q.x*q.z + q.w*q.y), 2*(q.y*q.z - q.w*q.x), 1 - 2*(q.x*q.x + q.y*q.y));
+    if (q.w < 0)
+        bitangent = -bitangent;
+}
+#else
 layout (location=0) in vec3 Position;
 layout (location=1) in vec3 Color;
 layout (location=2) in vec2 TexCoords;
 layout (location=3) in vec3 Normal;
 layout (location=4) in vec3 Tangent;
 layout (location=5) in vec3 Bitangent;
+#endif
 
 void main() {
+    DrawParameters draw = GetDrawParameters(ProjectionMat * ViewMat);
+#ifdef COMPACT_VERTICES
+    vec3 Position = draw.PositionOffset + PackedPosition.xyz * draw.PositionScale;
+    vec3 Tangent, Bitangent, Normal;
+    DecodeQTangent(QTangent, Tangent, Bitangent, Normal);
+#endif
+    DrawMaterialID = draw.MaterialID;
     gl_Position.xyz = Position;
     gl_Position.w = 1.0f;
-    gl_Position = MVPMat * gl_Position;
-    vertexData.WSPosition = (ModelMat * vec4(Position,1)).xyz;
+    gl_Position = draw.MVPMat * gl_Position;
+    vertexData.WSPosition = (draw.ModelMat * vec4(Position,1)).xyz;
     vertexData.TexCoords = TexCoords;
-    vertexData.WSNormal = normalize( NormalMat * Normal );
-    vec3 wsTangent = normalize( NormalMat * Tangent );
-    vec3 wsBitangent = normalize( NormalMat * Bitangent );
+    vertexData.WSNormal = normalize( draw.NormalMat * Normal );
+    vec3 wsTangent = normalize( draw.NormalMat * Tangent );
+    vec3 wsBitangent = normalize( draw.NormalMat * Bitangent );
     vertexData.Tangent2World = mat3(
         wsTangent, 
         wsBitangent, 
@@ -16,39 +16,34 @@
 
 #define RSMBufferCount 4
 
-#define MAX_LIGHTS 100
+// Written by LightCulling.comp, keep in sync with it
+#define TILE_SIZE 16
+#define MAX_LIGHTS_PER_TILE 1023
+#define TILE_LIGHTS_OVERFLOW 0xFFFFFFFFu
+layout (std430, binding=2) readonly buffer TileLightBuffer {
+    uint TileLights[]; // Per tile: the light count, then the light indices
+};
 
-struct Light {
-    vec3 Position;
-    vec3 Color;
+// Built by Clustering::ClusterBuilder on the CPU, keep the grid in sync
+// with Clustering::Grid and the projection in main.cpp
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 9
+#define CLUSTER_SLICES 24
+#define CLUSTER_NEAR 0.1
+#define CLUSTER_FAR 250.0
+layout (std430, binding=3) readonly buffer ClusterOffsetCountBuffer {
+    uvec2 ClusterOffsetCounts[]; // Per cluster: offset into ClusterIndices, count
+};
+layout (std430, binding=4) readonly buffer ClusterIndexBuffer {
+    uint ClusterIndices[];
 };
+layout (binding=0) uniform sampler2D GBuffer[BufferCount];
+layout (binding=BufferCount) uniform sampler2D RSM[RSMBufferCount];
+// The point lights, summed up by LightVolume.frag
+layout (binding=BufferCount+RSMBufferCount) uniform sampler2D LightAccumMap;
 
-uniform Light Lights[MAX_LIGHTS];
-uniform int LightCount;
-uniform vec3 AmbientLight;
-uniform vec3 FlashlightPosition;
-uniform vec3 FlashlightDirection;
-uniform vec3 FlashlightColor;
-uniform float FlashlightCutoffAng;
-uniform mat4 ShadowmapVPMat;
-uniform sampler2D GBuffer[BufferCount];
-uniform sampler2D RSM[RSMBufferCount];
-uniform int VisualizeBuffer;
-uniform int VisualizeRSMBuffer;
-uniform bool VisualizeShadowmap;
-uniform bool Tonemap;
-uniform vec3 CameraPosition;
-uniform float Gamma;
-uniform float FogDensity;
-uniform int RaymarchSteps;
-uniform float AttenConst;
-uniform float AttenLin;
-uniform float AttenQuad;
-uniform float RSMSamplingRadius;
-uniform float RSMReflectionFact;
-uniform int RSMVPLCount;
-uniform bool VisualizeIndirectLighting;
-uniform bool EnableIndirectLighting;
+#include "FrameUniforms.glsl"
+#include "PointLight.glsl"
 
 in VertexData {
     vec2 TexCoords;
@@ -56,10 +51,6 @@ in VertexData {
 
 out vec4 Color;
 
-float AttenuateLight(float distanceToLight) {
-    return 1/(AttenConst + AttenLin*distanceToLight + AttenQuad*distanceToLight*distanceToLight);
-}
-
 vec3 Gamma_ToLinear(vec3 c) {return pow(c,vec3(Gamma));}
 vec3 Gamma_FromLinear(vec3 c) {return pow(c,vec3(1/Gamma));}
 
@@ -334,35 +325,6 @@ vec3 RaymarchVolumetric(vec3 wsPosition) {
     return accum / RaymarchSteps;
 }
 
-void PointLightStrength(
-    in vec3 wsLightPosition,
-    in vec3 wsPosition,
-    in vec3 wsCameraPosition,
-    in vec3 wsNormal,
-    out float diffuseStrength,
-    out float diffuseBackStrength,
-    out float specularStrength
-) {
-    vec3 wsToCamera = normalize(wsCameraPosition-wsPosition);
-    vec3 wsToLight = (wsLightPosition - wsPosition);
-    float distanceToLight = length(wsToLight);
-    wsToLight = normalize(wsToLight);
-
-    float attenuation = AttenuateLight(distanceToLight);
-
-    // Diffuse
-    float lambert = max(0, dot(wsToLight, wsNormal));
-    diffuseStrength= lambert * attenuation;
-    float lambertBack = max(0, dot(wsToLight, -wsNormal));
-    diffuseBackStrength= lambertBack * attenuation;
-
-    // Specular
-    vec3 halfway = normalize(wsToLight + wsToCamera);
-    float align = max(0, dot(halfway, wsNormal));
-    float shininess = pow(align, 32);
-    specularStrength= shininess * attenuation;   
-}
-
 void main() {
     Color.rgb = vec3(0);
     Color.a = 1;
@@ -388,15 +350,46 @@ void main() {
     // (A global ambient light)
     Color.rgb += AmbientLight.rgb * diffuse;
 
-    for (int i=0; i<LightCount; ++i) {
-        float d, db, s;
-        PointLightStrength(Lights[i].Position, wsPosition,
-            CameraPosition,
-            wsNormal,
-            d, db, s);
-        Color.rgb += d * diffuse * Lights[i].Color;
-        Color.rgb += db * diffuse * Lights[i].Color * translucency;
-        Color.rgb += s * specular * Lights[i].Color;            
+    if (LightCulling == LightVolumeCulling) {
+        Color.rgb += texelFetch(LightAccumMap, ivec2(gl_FragCoord.xy), 0).rgb;
+    } else if (LightCulling == ClusteredLightCulling) {
+        // Only the lights that reach this pixel's froxel: screen tile, then
+        // exponential depth slice
+        vec2 screenPos = gl_FragCoord.xy / vec2(textureSize(GBuffer[PositionBuf], 0));
+        uvec2 tile = min(uvec2(screenPos * vec2(CLUSTER_TILES_X, CLUSTER_TILES_Y)),
+            uvec2(CLUSTER_TILES_X-1, CLUSTER_TILES_Y-1));
+        float depth = -(ViewMat * vec4(wsPosition, 1)).z;
+        float slice = log(max(depth, CLUSTER_NEAR) / CLUSTER_NEAR)
+            / log(CLUSTER_FAR / CLUSTER_NEAR) * CLUSTER_SLICES;
+        uint sliceIndex = min(uint(slice), uint(CLUSTER_SLICES-1));
+        uint cluster = (sliceIndex * uint(CLUSTER_TILES_Y) + tile.y) * uint(CLUSTER_TILES_X) + tile.x;
+        uvec2 offsetCount = ClusterOffsetCounts[cluster];
+        for (uint k=0; k<offsetCount.y; ++k) {
+            Color.rgb += PointLightContribution(Lights[ClusterIndices[offsetCount.x + k]],
+                wsPosition, wsNormal, diffuse, specular, translucency);
+        }
+    } else if (LightCulling == TiledLightCulling) {
+        // Only the lights that reach this pixel's tile
+        uvec2 tile = uvec2(gl_FragCoord.xy) / TILE_SIZE;
+        uint base = (tile.y * TileCountX + tile.x) * (MAX_LIGHTS_PER_TILE + 1);
+        uint count = TileLights[base];
+        // The tile's list overflowed, every light is a candidate
+        if (count == TILE_LIGHTS_OVERFLOW) {
+            for (int i=0; i<LightCount; ++i) {
+                Color.rgb += PointLightContribution(Lights[i],
+                    wsPosition, wsNormal, diffuse, specular, translucency);
+            }
+            count = 0;
+        }
+        for (uint k=0; k<count; ++k) {
+            Color.rgb += PointLightContribution(Lights[TileLights[base + 1 + k]],
+                wsPosition, wsNormal, diffuse, specular, translucency);
+        }
+    } else {
+        for (int i=0; i<LightCount; ++i) {
+            Color.rgb += PointLightContribution(Lights[i],
+                wsPosition, wsNormal, diffuse, specular, translucency);
+        }
     }
 
     // // The flashlight 
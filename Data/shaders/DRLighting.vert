@@ -8,8 +8,7 @@
 
 #define BufferCount 5
 
-uniform sampler2D GBuffer[BufferCount];
-uniform int VisualizeBuffer;
+layout (binding=0) uniform sampler2D GBuffer[BufferCount];
 
 out VertexData {
     vec2 TexCoords;
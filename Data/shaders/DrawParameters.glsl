@@ -0,0 +1,64 @@
+// What a mesh is drawn with, for DRGeometry.vert and RSM.vert.
+// Drawing mesh by mesh these are uniforms. With MULTI_DRAW_INDIRECT and
+// MultiDraw set, a whole pass is one glMultiDrawElementsIndirect and each
+// of its commands has a DrawData, found through gl_DrawIDARB (needs
+// GL_ARB_shader_draw_parameters enabled by the including shader).
+// Include after FrameUniforms.glsl.
+
+uniform mat4 MVPMat;
+uniform mat4 ModelMat;
+uniform mat3 NormalMat;
+// Mesh bounds, CompactVertices positions are unorm16 within them
+uniform vec3 PositionOffset;
+uniform vec3 PositionScale;
+uniform int MaterialID = -1; // < 0 = textures bound one by one
+uniform bool MultiDraw = false;
+
+#ifdef MULTI_DRAW_INDIRECT
+// std430, keep in sync with DrawData in main.cpp!
+struct DrawData {
+    mat4 ModelMat;
+    mat4 NormalMat; // Upper left 3x3
+    vec3 PositionOffset;
+    int MaterialID;
+    vec3 PositionScale;
+    int Padding;
+};
+layout (std430, binding=5) readonly buffer DrawBuffer {
+    DrawData Draws[];
+};
+uniform int FirstDraw = 0; // Of this call in Draws, gl_DrawIDARB starts at 0 in every one
+#endif
+
+struct DrawParameters {
+    mat4 MVPMat;
+    mat4 ModelMat;
+    mat3 NormalMat;
+    vec3 PositionOffset;
+    vec3 PositionScale;
+    int MaterialID;
+};
+
+// viewProjection only matters for multi-draws, otherwise MVPMat has it
+DrawParameters GetDrawParameters(mat4 viewProjection) {
+    DrawParameters p;
+#ifdef MULTI_DRAW_INDIRECT
+    if (MultiDraw) {
+        DrawData d = Draws[FirstDraw + gl_DrawIDARB];
+        p.MVPMat = viewProjection * d.ModelMat;
+        p.ModelMat = d.ModelMat;
+        p.NormalMat = mat3(d.NormalMat);
+        p.PositionOffset = d.PositionOffset;
+        p.PositionScale = d.PositionScale;
+        p.MaterialID = d.MaterialID;
+        return p;
+    }
+#endif
+    p.MVPMat = MVPMat;
+    p.ModelMat = ModelMat;
+    p.NormalMat = NormalMat;
+    p.PositionOffset = PositionOffset;
+    p.PositionScale = PositionScale;
+    p.MaterialID = MaterialID;
+    return p;
+}
@@ -0,0 +1,40 @@
+// Renderer state shared by all stages, uploaded once per frame.
+// std140, keep in sync with FrameUniforms in main.cpp!
+
+// LightCulling, DeferredRenderer::LightCullingMode
+#define NoLightCulling 0
+#define TiledLightCulling 1
+#define ClusteredLightCulling 2
+#define LightVolumeCulling 3
+
+layout (std140, binding=0) uniform FrameUniforms {
+    mat4 ShadowmapVPMat;
+    mat4 ViewMat;
+    mat4 ProjectionMat;
+    vec3 CameraPosition;
+    float Gamma;
+    vec3 FlashlightPosition;
+    float FlashlightCutoffAng;
+    vec3 FlashlightDirection;
+    float FogDensity;
+    vec3 FlashlightColor;
+    float ParallaxDepth;
+    vec3 AmbientLight;
+    float AttenConst;
+    float AttenLin;
+    float AttenQuad;
+    float RSMSamplingRadius;
+    float RSMReflectionFact;
+    int RSMVPLCount;
+    int RaymarchSteps;
+    int LightCount;
+    int VisualizeBuffer;
+    int VisualizeRSMBuffer;
+    bool Tonemap;
+    bool VisualizeShadowmap;
+    bool VisualizeIndirectLighting;
+    bool EnableIndirectLighting;
+    int LightCulling;
+    int TileCountX;
+    float LightCutoff; // Point lights are treated as 0 below this
+};
@@ -0,0 +1,44 @@
+#version 450 core
+
+// Shades the G-buffer pixels a light volume covers with that one light,
+// blended additively into the light accumulation buffer. The depth test
+// already dropped the pixels behind the volume, the radius check drops
+// the ones in front of it. The sky passes the depth test (GEQUAL against
+// the far plane), it's dropped by its G-buffer clear values. The depth
+// buffer itself can't be sampled, it's attached.
+
+#define PositionBuf 0
+#define DiffuseBuf 1
+#define SpecularBuf 2
+#define NormalBuf 3
+#define TranslucencyBuf 4
+
+#define BufferCount 5
+
+layout (binding=0) uniform sampler2D GBuffer[BufferCount];
+
+#include "FrameUniforms.glsl"
+#include "PointLight.glsl"
+
+flat in int LightIndex;
+
+out vec4 Color;
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec3 wsPosition = texelFetch(GBuffer[PositionBuf], pixel, 0).xyz;
+    vec3 wsNormal = texelFetch(GBuffer[NormalBuf], pixel, 0).xyz;
+    // Nothing drawn here, geometry never has a zero normal
+    if (wsPosition == vec3(0) && wsNormal == vec3(0))
+        discard;
+    Light light = Lights[LightIndex];
+    vec3 toLight = light.Position - wsPosition;
+    float radius = InfluenceRadius(light.Color);
+    if (dot(toLight, toLight) > radius*radius)
+        discard;
+
+    vec3 specular = texelFetch(GBuffer[SpecularBuf], pixel, 0).rgb;
+    vec3 diffuse = texelFetch(GBuffer[DiffuseBuf], pixel, 0).rgb;
+    vec3 translucency = texelFetch(GBuffer[TranslucencyBuf], pixel, 0).rgb;
+    Color = vec4(PointLightContribution(light, wsPosition, wsNormal, diffuse, specular, translucency), 0);
+}
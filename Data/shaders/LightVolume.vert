@@ -0,0 +1,21 @@
+#version 450 core
+
+// One instance per point light: the unit sphere mesh, scaled to the
+// light's InfluenceRadius and moved to its position
+
+#include "FrameUniforms.glsl"
+#include "PointLight.glsl"
+
+// Keeps lights that don't fall off within reach of the depth range
+#define MAX_VOLUME_RADIUS 1000.0
+
+layout (location=0) in vec3 Position;
+
+flat out int LightIndex;
+
+void main() {
+    Light light = Lights[gl_InstanceID];
+    float radius = min(InfluenceRadius(light.Color), MAX_VOLUME_RADIUS);
+    gl_Position = ProjectionMat * ViewMat * vec4(light.Position + Position*radius, 1);
+    LightIndex = gl_InstanceID;
+}
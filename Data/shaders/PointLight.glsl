@@ -0,0 +1,77 @@
+// Point lights, shared by the stages that shade with or cull them.
+// Include after FrameUniforms.glsl.
+
+struct Light {
+    vec3 Position;
+    vec3 Color;
+};
+
+// LightCount of them, std430 pads both vec3s to 16 bytes
+layout (std430, binding=1) readonly buffer LightBuffer {
+    Light Lights[];
+};
+
+float AttenuateLight(float distanceToLight) {
+    return 1/(AttenConst + AttenLin*distanceToLight + AttenQuad*distanceToLight*distanceToLight);
+}
+
+// Distance past which AttenuateLight() brings the light under LightCutoff
+float InfluenceRadius(vec3 color) {
+    float intensity = max(color.r, max(color.g, color.b));
+    // Solve AttenConst + AttenLin*d + AttenQuad*d*d = intensity / LightCutoff
+    float k = intensity / LightCutoff - AttenConst;
+    if (k <= 0)
+        return 0;
+    if (AttenQuad > 0)
+        return (-AttenLin + sqrt(AttenLin*AttenLin + 4*AttenQuad*k)) / (2*AttenQuad);
+    if (AttenLin > 0)
+        return k / AttenLin;
+    return 1e30; // Doesn't fall off
+}
+
+void PointLightStrength(
+    in vec3 wsLightPosition,
+    in vec3 wsPosition,
+    in vec3 wsCameraPosition,
+    in vec3 wsNormal,
+    out float diffuseStrength,
+    out float diffuseBackStrength,
+    out float specularStrength
+) {
+    vec3 wsToCamera = normalize(wsCameraPosition-wsPosition);
+    vec3 wsToLight = (wsLightPosition - wsPosition);
+    float distanceToLight = length(wsToLight);
+    wsToLight = normalize(wsToLight);
+
+    float attenuation = AttenuateLight(distanceToLight);
+
+    // Diffuse
+    float lambert = max(0, dot(wsToLight, wsNormal));
+    diffuseStrength= lambert * attenuation;
+    float lambertBack = max(0, dot(wsToLight, -wsNormal));
+    diffuseBackStrength= lambertBack * attenuation;
+
+    // Specular
+    vec3 halfway = normalize(wsToLight + wsToCamera);
+    float align = max(0, dot(halfway, wsNormal));
+    float shininess = pow(align, 32);
+    specularStrength= shininess * attenuation;   
+}
+
+vec3 PointLightContribution(
+    in Light light,
+    in vec3 wsPosition,
+    in vec3 wsNormal,
+    in vec3 diffuse,
+    in vec3 specular,
+    in vec3 translucency
+) {
+    float d, db, s;
+    PointLightStrength(light.Position, wsPosition,
+        CameraPosition,
+        wsNormal,
+        d, db, s);
+    return d * diffuse * light.Color
+        + db * diffuse * light.Color * translucency
+        + s * specular * light.Color;
+}
@@ -4,11 +4,27 @@ in vec2 texCoords;
 in vec3 wsPosition;
 in vec3 wsNormal;
 
-uniform sampler2D DiffuseMap;
-uniform vec3 FlashlightPosition;
-uniform vec3 FlashlightDirection;
-uniform vec3 FlashlightColor;
-uniform float FlashlightCutoffAng;
+layout (binding=0) uniform sampler2D DiffuseMap;
+
+// Like in DRGeometry.frag, only the diffuse map is needed here
+#define MAX_TEXTURE_ARRAYS 11
+struct MaterialLayers {
+    ivec2 Maps[5]; // (array, layer) per slot, diffuse first
+};
+layout (std430, binding=0) readonly buffer MaterialBuffer {
+    MaterialLayers Materials[];
+};
+layout (binding=5) uniform sampler2DArray MaterialArrays[MAX_TEXTURE_ARRAYS];
+flat in int DrawMaterialID; // See DrawParameters.glsl
+
+vec4 SampleDiffuseMap(vec2 st) {
+    if (DrawMaterialID < 0)
+        return texture(DiffuseMap, st);
+    ivec2 m = Materials[DrawMaterialID].Maps[0];
+    return texture(MaterialArrays[m.x], vec3(st, m.y));
+}
+
+#include "FrameUniforms.glsl"
 
 out vec4 RSMPositionBuf;
 out vec4 RSMNormalBuf;
@@ -26,7 +42,7 @@ float CutoffFactor(vec3 wsToLight) {
 }
 
 void main() {
-    if (texture(DiffuseMap, texCoords).a < 0.5)
+    if (SampleDiffuseMap(texCoords).a < 0.5)
         discard;
 
     RSMPositionBuf.rgb = wsPosition.xyz;
@@ -34,5 +50,5 @@ void main() {
     
     
     float cutoffFactor = CutoffFactor(normalize(FlashlightPosition-wsPosition));
-    RSMFluxBuf.rgb = cutoffFactor * texture(DiffuseMap,texCoords).rgb;
+    RSMFluxBuf.rgb = cutoffFactor * SampleDiffuseMap(texCoords).rgb;
 }
\ No newline at end of file
@@ -1,20 +1,42 @@
 #version 450 core
+#ifdef MULTI_DRAW_INDIRECT
+#extension GL_ARB_shader_draw_parameters : require
+#endif
 
-uniform mat4 MVPMat;
-uniform mat4 ModelMat;
-uniform mat3 NormalMat;
+#include "FrameUniforms.glsl"
+#include "DrawParameters.glsl"
 
+#ifdef COMPACT_VERTICES
+layout (location=0) in vec4 PackedPosition;
+layout (location=2) in vec2 TexCoords;
+layout (location=6) in vec4 QTangent;
+
+// Third column of the tangent frame quaternion's rotation matrix
+vec3 DecodeQTangentNormal(vec4 q) {
+    q = normalize(q);
+    return vec3(2*(q.x*q.z + q.w*q.y), 2*(q.y*q.z - q.w*q.x), 1 - 2*(q.x*q.x + q.y*q.y));
+}
+#else
 layout (location=0) in vec3 Position;
 layout (location=2) in vec2 TexCoords;
 layout (location=3) in vec3 Normal;
+#endif
 
 out vec2 texCoords;
 out vec3 wsPosition;
 out vec3 wsNormal;
+// For RSM.frag, which can't see the draw parameters
+flat out int DrawMaterialID;
 
 void main() {
-    gl_Position = MVPMat * vec4(Position, 1);
+    DrawParameters draw = GetDrawParameters(ShadowmapVPMat);
+#ifdef COMPACT_VERTICES
+    vec3 Position = draw.PositionOffset + PackedPosition.xyz * draw.PositionScale;
+    vec3 Normal = DecodeQTangentNormal(QTangent);
+#endif
+    DrawMaterialID = draw.MaterialID;
+    gl_Position = draw.MVPMat * vec4(Position, 1);
     texCoords = TexCoords;
-    wsPosition = vec3(ModelMat * vec4(Position,1));
-    wsNormal = NormalMat * Normal;
+    wsPosition = vec3(draw.ModelMat * vec4(Position,1));
+    wsNormal = draw.NormalMat * Normal;
 }
\ No newline at end of file
@@ -0,0 +1,504 @@
+#pragma once
+#include "threadpool.hpp"
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CLUSTERING_SSE2 1
+#endif
+
+// Clustered light assignment on the CPU
+// * The view frustum is cut into TilesX x TilesY screen tiles and Slices
+//   depth slices, exponentially spaced between Near and Far (froxels)
+// * A light touches a froxel when its sphere of influence reaches the
+//   froxel's view space bounding box. The boxes of a slice share their
+//   depth range, those of a tile row their y range and those of a tile
+//   column their x range, so per slice and row a light covers one run
+//   of columns. The runs are found with SSE2, four box edges at a time.
+// * Every cluster keeps at most MAX_LIGHTS_PER_CLUSTER lights, the
+//   brightest ones: lights are sorted by intensity and each slice takes
+//   them in that order until all its clusters are full. The work and
+//   Indices stay bounded however many lights there are.
+// * The lights are bounded in chunks and the slices filled in parallel
+//   across a ThreadPool (or on the calling thread without one)
+// * Pure CPU, doesn't touch GL
+// ---
+namespace Clustering {
+
+// Distance at which a light of the given intensity, attenuated by
+// 1/(constant + linear*d + quadratic*d^2), falls below cutoff.
+// Same as InfluenceRadius in LightCulling.comp.
+inline float InfluenceRadius(float intensity, float constant, float linear, float quadratic,
+    float cutoff
+) {
+    float k = intensity / cutoff - constant;
+    if (!(k > 0))
+        return 0;
+    if (quadratic > 0)
+        return (-linear + std::sqrt(linear*linear + 4*quadratic*k)) / (2*quadratic);
+    if (linear > 0)
+        return k / linear;
+    return INFINITY;
+}
+
+const uint32_t MAX_LIGHTS_PER_CLUSTER = 256;
+
+struct Grid {
+    int TilesX = 16;
+    int TilesY = 9;
+    int Slices = 24;
+    float Near = 0.1f;
+    float Far = 250.0f;
+    float TanHalfFovY = 0.57735f; // 60 degrees
+    float Aspect = 16.0f / 9.0f;
+
+    bool operator==(const Grid& o) const {
+        return TilesX == o.TilesX && TilesY == o.TilesY && Slices == o.Slices && Near == o.Near
+            && Far == o.Far && TanHalfFovY == o.TanHalfFovY && Aspect == o.Aspect;
+    }
+    bool operator!=(const Grid& o) const { return !(*this == o); }
+
+    int ClusterCount() const { return TilesX * TilesY * Slices; }
+    int ClusterIndex(int x, int y, int slice) const { return (slice*TilesY + y)*TilesX + x; }
+
+    // Slice of a (positive) view depth, can be out of [0, Slices)
+    float SliceOf(float depth) const {
+        return std::log(depth / Near) / std::log(Far / Near) * Slices;
+    }
+    float SliceDepth(int slice) const {
+        return Near * std::pow(Far / Near, (float)slice / Slices);
+    }
+};
+
+// The light lists of all clusters
+struct ClusterLights {
+    std::vector<uint32_t> OffsetCounts; // Per cluster: offset into Indices, count
+    std::vector<uint32_t> Indices; // Into the light array given to Build
+    int FullClusters = 0; // At MAX_LIGHTS_PER_CLUSTER, dimmer lights may be left out
+};
+
+class ClusterBuilder {
+    Grid TheGrid;
+    bool HaveGrid = false;
+
+    // View space (depth positive) extents of the froxels' bounding boxes,
+    // per slice. Columns and rows are padded to a multiple of 4 with
+    // INFINITY, which no light reaches.
+    int PaddedX = 0, PaddedY = 0;
+    std::vector<float> ColumnMin, ColumnMax; // Slices x PaddedX
+    std::vector<float> RowMin, RowMax; // Slices x PaddedY
+    std::vector<float> SliceDepths; // Slices+1 boundaries
+
+    // A light in view space, depth positive
+    struct LightBounds {
+        float Center[3];
+        float Radius;
+        uint32_t Key; // Sorts brightest first
+        uint32_t Index; // Into the light array given to Build
+        int FirstSlice, LastSlice;
+    };
+    std::vector<LightBounds> Bounds, Sorted;
+    std::vector<uint8_t> Visible;
+    std::vector<uint64_t> SortKeys, SortScratch;
+    // First and last slice of each Sorted light, every slice scans these
+    std::vector<uint16_t> SortedSlices;
+
+    // Per slice, filled by FillSlice: up to MAX_LIGHTS_PER_CLUSTER
+    // indices per cluster, and their counts. The indices are interleaved,
+    // n-th lights of all the slice's clusters next to each other, so a
+    // light writes its run of clusters to neighbouring memory.
+    std::vector<uint32_t> SliceIndices;
+    std::vector<uint32_t> SliceCounts;
+
+    static constexpr size_t LIGHTS_PER_CHUNK = 1024;
+    static constexpr size_t MAX_CHUNKS = 64;
+
+    void BuildBoxes() {
+        const Grid& g = TheGrid;
+        PaddedX = (g.TilesX + 3) / 4 * 4;
+        PaddedY = (g.TilesY + 3) / 4 * 4;
+        ColumnMin.assign(size_t(PaddedX) * g.Slices, INFINITY);
+        ColumnMax.assign(size_t(PaddedX) * g.Slices, INFINITY);
+        RowMin.assign(size_t(PaddedY) * g.Slices, INFINITY);
+        RowMax.assign(size_t(PaddedY) * g.Slices, INFINITY);
+        SliceDepths.resize(g.Slices + 1);
+        for (int s=0; s<=g.Slices; ++s)
+            SliceDepths[s] = g.SliceDepth(s);
+        const float tanX = g.TanHalfFovY * g.Aspect, tanY = g.TanHalfFovY;
+        for (int s=0; s<g.Slices; ++s) {
+            const float d0 = SliceDepths[s], d1 = SliceDepths[s+1];
+            for (int x=0; x<g.TilesX; ++x) {
+                const float l = (2.0f*x/g.TilesX - 1) * tanX, r = (2.0f*(x+1)/g.TilesX - 1) * tanX;
+                ColumnMin[size_t(s)*PaddedX + x] = std::min(l*d0, l*d1);
+                ColumnMax[size_t(s)*PaddedX + x] = std::max(r*d0, r*d1);
+            }
+            for (int y=0; y<g.TilesY; ++y) {
+                const float b = (2.0f*y/g.TilesY - 1) * tanY, t = (2.0f*(y+1)/g.TilesY - 1) * tanY;
+                RowMin[size_t(s)*PaddedY + y] = std::min(b*d0, b*d1);
+                RowMax[size_t(s)*PaddedY + y] = std::max(t*d0, t*d1);
+            }
+        }
+        const size_t slots = size_t(g.ClusterCount()) * MAX_LIGHTS_PER_CLUSTER;
+        SliceIndices.resize(slots);
+        SliceCounts.resize(g.ClusterCount());
+    }
+
+    // Both edges of the boxes grow with the column (row), so the boxes
+    // a coordinate range [lo, hi] overlaps are [first, last]: those whose
+    // max isn't below lo and whose min isn't above hi. There are count
+    // boxes, padded to a multiple of 4. False if none.
+    static bool Overlapped(const float *min, const float *max, int count, float lo, float hi,
+        int& first, int& last
+    ) {
+        const int padded = (count + 3) / 4 * 4;
+#ifdef CLUSTERING_SSE2
+        static const int BITS[16] = {0,1,1,2, 1,2,2,3, 1,2,2,3, 2,3,3,4};
+        const __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+        int below = 0, notAbove = 0;
+        for (int i=0; i<padded; i+=4) {
+            below += BITS[_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(max + i), vlo))];
+            notAbove += BITS[_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(min + i), vhi))];
+        }
+#else
+        int below = 0, notAbove = 0;
+        for (int i=0; i<count; ++i) {
+            below += max[i] < lo;
+            notAbove += min[i] <= hi;
+        }
+#endif
+        first = below;
+        last = std::min(notAbove, count) - 1; // The padding is in reach of an infinite radius
+        return first <= last;
+    }
+
+    // Slice of view depth in [Near, Far], a binary search instead of
+    // Grid::SliceOf's logarithms
+    int SliceOf(float depth) const {
+        return int(std::upper_bound(SliceDepths.begin() + 1, SliceDepths.end() - 1, depth)
+            - SliceDepths.begin()) - 1;
+    }
+
+    // Distance from x to the range [min, max]
+    static float Outside(float x, float min, float max) {
+        return std::max(std::max(min - x, x - max), 0.0f);
+    }
+
+    // Bit n of the result is set if the point (x, y) is within reach of
+    // the rectangle i+n (reach2 = squared reach)
+    static int ReachFour(const float *const min[2], const float *const max[2], size_t i,
+        float x, float y, float reach2
+    ) {
+#ifdef CLUSTERING_SSE2
+        __m128 dist2 = _mm_setzero_ps();
+        const float p[2] = {x, y};
+        for (int axis=0; axis<2; ++axis) {
+            __m128 c = _mm_set1_ps(p[axis]);
+            __m128 below = _mm_sub_ps(_mm_loadu_ps(min[axis] + i), c);
+            __m128 above = _mm_sub_ps(c, _mm_loadu_ps(max[axis] + i));
+            __m128 d = _mm_max_ps(_mm_max_ps(below, above), _mm_setzero_ps());
+            dist2 = _mm_add_ps(dist2, _mm_mul_ps(d, d));
+        }
+        return _mm_movemask_ps(_mm_cmple_ps(dist2, _mm_set1_ps(reach2)));
+#else
+        int mask = 0;
+        for (int n=0; n<4; ++n) {
+            float dx = Outside(x, min[0][i+n], max[0][i+n]), dy = Outside(y, min[1][i+n], max[1][i+n]);
+            if (dx*dx + dy*dy <= reach2)
+                mask |= 1 << n;
+        }
+        return mask;
+#endif
+    }
+
+
+    void BoundChunk(const float *lights, size_t stride, size_t begin, size_t end,
+        const float view[16], float constant, float linear, float quadratic, float cutoff
+    ) {
+        const Grid& g = TheGrid;
+        const float tanX = g.TanHalfFovY * g.Aspect, tanY = g.TanHalfFovY;
+        const float invLenX = 1 / std::sqrt(1 + tanX*tanX), invLenY = 1 / std::sqrt(1 + tanY*tanY);
+        for (size_t light=begin; light<end; ++light) {
+            const float *p = lights + light*stride;
+            LightBounds& b = Bounds[light];
+            Visible[light] = false;
+            const float intensity = std::max(p[3], std::max(p[4], p[5]));
+            const float radius = InfluenceRadius(intensity, constant, linear, quadratic, cutoff);
+            // To view space, depth positive (column major view matrix)
+            float *c = b.Center;
+            for (int row=0; row<3; ++row)
+                c[row] = view[row] * p[0] + view[4+row] * p[1] + view[8+row] * p[2] + view[12+row];
+            c[2] = -c[2];
+
+            const float dmin = std::max(c[2] - radius, g.Near), dmax = std::min(c[2] + radius, g.Far);
+            if (dmin > dmax)
+                continue;
+            // Outside a side plane of the frustum, most lights of a big
+            // scene are. The planes go through the eye, normals (±1, 0, -tan)
+            // and (0, ±1, -tan) scaled to unit length.
+            if ((std::abs(c[0]) - tanX*c[2]) * invLenX > radius
+                || (std::abs(c[1]) - tanY*c[2]) * invLenY > radius)
+                continue;
+            b.Radius = radius;
+            // Positive floats order like their bits, flipped for brightest first
+            float key = std::max(intensity, 0.0f);
+            uint32_t bits;
+            std::memcpy(&bits, &key, sizeof(bits));
+            b.Key = ~bits;
+            b.Index = light;
+            b.FirstSlice = SliceOf(dmin);
+            b.LastSlice = SliceOf(dmax);
+            Visible[light] = true;
+        }
+    }
+
+    // The visible lights into Sorted by Key, stable. Radix sorts (key,
+    // light) pairs 11 bits per pass, then gathers the bounds once.
+    void SortVisible() {
+        const int BITS = 11, BUCKETS = 1 << BITS;
+        std::vector<uint64_t>& order = SortKeys;
+        order.clear();
+        for (size_t i=0; i<Bounds.size(); ++i)
+            if (Visible[i])
+                order.push_back(uint64_t(Bounds[i].Key) << 32 | i);
+        SortScratch.resize(order.size());
+        std::vector<size_t> offsets(BUCKETS + 1);
+        for (int shift=32; shift<64; shift+=BITS) {
+            std::fill(offsets.begin(), offsets.end(), 0);
+            for (uint64_t k: order)
+                ++offsets[(k >> shift & (BUCKETS-1)) + 1];
+            for (int i=0; i<BUCKETS; ++i)
+                offsets[i+1] += offsets[i];
+            for (uint64_t k: order)
+                SortScratch[offsets[k >> shift & (BUCKETS-1)]++] = k;
+            order.swap(SortScratch);
+        }
+        Sorted.resize(order.size());
+        SortedSlices.resize(order.size() * 2);
+        for (size_t i=0; i<order.size(); ++i) {
+            Sorted[i] = Bounds[uint32_t(order[i])];
+            SortedSlices[i*2] = Sorted[i].FirstSlice;
+            SortedSlices[i*2 + 1] = Sorted[i].LastSlice;
+        }
+    }
+
+    // Index of the lowest set bit, bits != 0
+    static int LowestBit(uint64_t bits) {
+#ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward64(&i, bits);
+        return (int)i;
+#else
+        return __builtin_ctzll(bits);
+#endif
+    }
+
+    // Gives the clusters of slice s their lights, brightest first, until
+    // they're all full or the lights run out
+    void FillSlice(int s) {
+        const Grid& g = TheGrid;
+        const int clusters = g.TilesX * g.TilesY;
+        uint32_t *counts = &SliceCounts[size_t(s) * clusters];
+        uint32_t *indices = &SliceIndices[size_t(s) * clusters * MAX_LIGHTS_PER_CLUSTER];
+        std::fill(counts, counts + clusters, 0);
+        const float *columnMin = &ColumnMin[size_t(s) * PaddedX], *columnMax = &ColumnMax[size_t(s) * PaddedX];
+        const float *rowMin = &RowMin[size_t(s) * PaddedY], *rowMax = &RowMax[size_t(s) * PaddedY];
+        // Clusters not full yet: how many, a bit per column of each row,
+        // and the x and y extents of their boxes. Once most are full the
+        // lights that can't reach the rest are skipped with one box test,
+        // and the rest only visit the open clusters of their runs.
+        const int words = (g.TilesX + 63) / 64;
+        int open = clusters;
+        std::vector<uint64_t> openBits(size_t(g.TilesY) * words, 0);
+        for (int y=0; y<g.TilesY; ++y)
+            for (int x=0; x<g.TilesX; ++x)
+                openBits[y*words + x/64] |= uint64_t(1) << x%64;
+        float openMin[2] = {columnMin[0], rowMin[0]};
+        float openMax[2] = {columnMax[g.TilesX-1], rowMax[g.TilesY-1]};
+        std::vector<float> rowOpenMin(g.TilesY, columnMin[0]), rowOpenMax(g.TilesY, columnMax[g.TilesX-1]);
+        // Once half or fewer are open, their rectangles (padded to a
+        // multiple of 4 with INFINITY, cluster -1) are tested directly
+        // instead of runs
+        std::vector<int> openList;
+        std::vector<float> listMin[2], listMax[2];
+        bool filled = false;
+        for (size_t light=0; light<Sorted.size(); ++light) {
+            if (s < SortedSlices[light*2] || s > SortedSlices[light*2 + 1])
+                continue;
+            const LightBounds& b = Sorted[light];
+            const float *c = b.Center;
+            const float dz = Outside(c[2], SliceDepths[s], SliceDepths[s+1]);
+            const float dx = Outside(c[0], openMin[0], openMax[0]), dy = Outside(c[1], openMin[1], openMax[1]);
+            if (dx*dx + dy*dy + dz*dz > b.Radius*b.Radius)
+                continue;
+            const float reachYZ = b.Radius*b.Radius - dz*dz;
+            if (!openList.empty()) {
+                const float *const min[2] = {listMin[0].data(), listMin[1].data()};
+                const float *const max[2] = {listMax[0].data(), listMax[1].data()};
+                for (size_t i=0; i<openList.size(); i+=4) {
+                    for (int mask = ReachFour(min, max, i, c[0], c[1], reachYZ); mask; mask &= mask - 1) {
+                        const int cluster = openList[i + LowestBit(mask)];
+                        if (cluster < 0) // Padding, in reach of an infinite radius
+                            continue;
+                        indices[size_t(counts[cluster]) * clusters + cluster] = b.Index;
+                        if (++counts[cluster] == MAX_LIGHTS_PER_CLUSTER) {
+                            --open;
+                            filled = true;
+                        }
+                    }
+                }
+            } else {
+                int y0, y1;
+                if (!Overlapped(rowMin, rowMax, g.TilesY, c[1] - std::sqrt(reachYZ), c[1] + std::sqrt(reachYZ),
+                        y0, y1))
+                    continue;
+                for (int y=y0; y<=y1; ++y) {
+                    const float dy = Outside(c[1], rowMin[y], rowMax[y]);
+                    const float dx = Outside(c[0], rowOpenMin[y], rowOpenMax[y]);
+                    const float reachX = reachYZ - dy*dy;
+                    int x0, x1;
+                    if (dx*dx > reachX || !Overlapped(columnMin, columnMax, g.TilesX, c[0] - std::sqrt(reachX),
+                            c[0] + std::sqrt(reachX), x0, x1))
+                        continue;
+                    for (int w=x0/64; w<=x1/64; ++w) {
+                        uint64_t& rowBits = openBits[y*words + w];
+                        // Columns x0..x1 of this word
+                        const int lo = std::max(x0 - w*64, 0), hi = std::min(x1 - w*64, 63);
+                        uint64_t bits = rowBits & (~uint64_t(0) << lo) & (~uint64_t(0) >> (63 - hi));
+                        for (; bits; bits &= bits - 1) {
+                            const int cluster = y*g.TilesX + w*64 + LowestBit(bits);
+                            indices[size_t(counts[cluster]) * clusters + cluster] = b.Index;
+                            if (++counts[cluster] == MAX_LIGHTS_PER_CLUSTER) {
+                                rowBits &= ~(uint64_t(1) << LowestBit(bits));
+                                --open;
+                                filled = true;
+                            }
+                        }
+                    }
+                }
+            }
+            if (!open)
+                break;
+            if (filled) {
+                filled = false;
+                openMin[0] = openMin[1] = INFINITY;
+                openMax[0] = openMax[1] = -INFINITY;
+                for (int y=0; y<g.TilesY; ++y) {
+                    rowOpenMin[y] = INFINITY;
+                    rowOpenMax[y] = -INFINITY;
+                    for (int x=0; x<g.TilesX; ++x) {
+                        if (counts[y*g.TilesX + x] == MAX_LIGHTS_PER_CLUSTER)
+                            continue;
+                        rowOpenMin[y] = std::min(rowOpenMin[y], columnMin[x]);
+                        rowOpenMax[y] = std::max(rowOpenMax[y], columnMax[x]);
+                        openMin[1] = std::min(openMin[1], rowMin[y]);
+                        openMax[1] = std::max(openMax[1], rowMax[y]);
+                    }
+                    openMin[0] = std::min(openMin[0], rowOpenMin[y]);
+                    openMax[0] = std::max(openMax[0], rowOpenMax[y]);
+                }
+                if (open <= clusters / 2) {
+                    openList.clear();
+                    for (int axis=0; axis<2; ++axis) {
+                        listMin[axis].clear();
+                        listMax[axis].clear();
+                    }
+                    for (int y=0; y<g.TilesY; ++y) {
+                        for (int x=0; x<g.TilesX; ++x) {
+                            if (counts[y*g.TilesX + x] == MAX_LIGHTS_PER_CLUSTER)
+                                continue;
+                            openList.push_back(y*g.TilesX + x);
+                            listMin[0].push_back(columnMin[x]);
+                            listMax[0].push_back(columnMax[x]);
+                            listMin[1].push_back(rowMin[y]);
+                            listMax[1].push_back(rowMax[y]);
+                        }
+                    }
+                    while (openList.size() % 4) {
+                        openList.push_back(-1);
+                        for (int axis=0; axis<2; ++axis) {
+                            listMin[axis].push_back(INFINITY);
+                            listMax[axis].push_back(INFINITY);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    ClusterLights Result;
+
+    const Grid& GetGrid() const { return TheGrid; }
+    void SetGrid(const Grid& grid) {
+        if (HaveGrid && grid == TheGrid)
+            return;
+        TheGrid = grid;
+        HaveGrid = true;
+        BuildBoxes();
+    }
+
+    // Assigns lightCount lights to clusters, into Result. Light i has its
+    // world position at lights[i*stride + 0..2] and color at [3..5].
+    // view is the column major world to view matrix, the attenuation
+    // parameters and cutoff give each light's radius (InfluenceRadius).
+    void Build(const float *lights, size_t lightCount, size_t stride, const float view[16],
+        float constant, float linear, float quadratic, float cutoff, ThreadPool *pool = nullptr
+    ) {
+        if (!HaveGrid)
+            SetGrid(Grid());
+        const Grid& g = TheGrid;
+        const size_t chunkCount = std::max<size_t>(1,
+            std::min(MAX_CHUNKS, (lightCount + LIGHTS_PER_CHUNK-1) / LIGHTS_PER_CHUNK));
+        Bounds.resize(lightCount);
+        Visible.resize(lightCount);
+        auto bound = [&](size_t c) {
+            BoundChunk(lights, stride, lightCount * c / chunkCount, lightCount * (c+1) / chunkCount,
+                view, constant, linear, quadratic, cutoff);
+        };
+        if (pool && chunkCount > 1)
+            pool->ParallelFor(chunkCount, bound);
+        else
+            for (size_t c=0; c<chunkCount; ++c)
+                bound(c);
+        SortVisible();
+
+        auto fill = [&](size_t s) { FillSlice(s); };
+        if (pool && !Sorted.empty())
+            pool->ParallelFor(g.Slices, fill);
+        else
+            for (int s=0; s<g.Slices; ++s)
+                fill(s);
+
+        // Compact the lists, slice by slice in parallel
+        const size_t clusterCount = g.ClusterCount(), sliceClusters = g.TilesX * g.TilesY;
+        Result.OffsetCounts.resize(clusterCount * 2);
+        Result.FullClusters = 0;
+        uint32_t total = 0;
+        for (size_t cluster=0; cluster<clusterCount; ++cluster) {
+            Result.OffsetCounts[cluster*2] = total;
+            Result.OffsetCounts[cluster*2 + 1] = SliceCounts[cluster];
+            total += SliceCounts[cluster];
+            Result.FullClusters += SliceCounts[cluster] == MAX_LIGHTS_PER_CLUSTER;
+        }
+        Result.Indices.resize(total);
+        auto gather = [&](size_t s) {
+            const uint32_t *indices = &SliceIndices[s * sliceClusters * MAX_LIGHTS_PER_CLUSTER];
+            for (size_t i=0; i<sliceClusters; ++i) {
+                const size_t cluster = s*sliceClusters + i;
+                uint32_t *out = &Result.Indices[Result.OffsetCounts[cluster*2]];
+                for (uint32_t n=0; n<SliceCounts[cluster]; ++n)
+                    out[n] = indices[n * sliceClusters + i];
+            }
+        };
+        if (pool && total > 0)
+            pool->ParallelFor(g.Slices, gather);
+        else
+            for (int s=0; s<g.Slices; ++s)
+                gather(s);
+    }
+};
+
+} // namespace Clustering
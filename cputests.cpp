@@ -0,0 +1,244 @@
+// Tests for the GL-free parts (mesh processing, light clustering, culling)
+// * Plain checks, no framework. Exits with the number of failures.
+//
+// Usage: ./CPUTests   (or ctest)
+
+#include "meshprocessing.hpp"
+#include "clustering.hpp"
+#include "culling.hpp"
+#include <array>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+static int Failures = 0;
+
+static void Check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAILED: " << what << endl;
+        ++Failures;
+    }
+}
+
+// OptimizeOverdraw only reorders, whatever the first triangle is
+static void TestOverdrawKeepsTriangles() {
+    using namespace MeshProcessing;
+    const float positions[] = {0,0,0, 1,0,0, 0,1,0, 1,1,0, 2,1,0};
+    // Degenerate first triangle, it misses the cache on two vertices only
+    vector<uint32_t> indices = {0,0,1, 0,1,2, 1,2,3, 2,3,4};
+    vector<uint32_t> sorted = indices;
+    OptimizeOverdraw(indices, positions, 5);
+    Check(indices.size() == sorted.size(), "OptimizeOverdraw keeps the triangle count");
+    // Same triangles, in any order
+    auto triangles = [](const vector<uint32_t>& i) {
+        vector<vector<uint32_t>> t;
+        for (size_t k=0; k+2<i.size(); k+=3)
+            t.push_back({i[k], i[k+1], i[k+2]});
+        sort(t.begin(), t.end());
+        return t;
+    };
+    Check(triangles(indices) == triangles(sorted), "OptimizeOverdraw keeps the triangles");
+
+    vector<uint32_t> welded = {0,0,1, 0,1,2, 2,2,2};
+    Check(RemoveDegenerateTriangles(welded) == 2 && welded == vector<uint32_t>{0,1,2},
+        "RemoveDegenerateTriangles drops triangles using a vertex twice");
+}
+
+// ClusterBuilder::Build against testing every light with every froxel.
+// Each cluster has only lights whose sphere touches the froxel's bounding
+// box, and all those whose sphere reaches a point sampled inside the
+// froxel (none may be missed), except in a full cluster: there the lights
+// left out can't be brighter than the ones kept.
+static void TestClustersMatchBruteForce(size_t lightCount, float cutoff, bool expectFull,
+    ThreadPool *pool
+) {
+    using namespace Clustering;
+    mt19937 rng(lightCount);
+    uniform_real_distribution<float> unit(0, 1);
+    vector<float> lights(lightCount * 6);
+    for (size_t i=0; i<lightCount; ++i) {
+        float *l = &lights[i*6];
+        l[0] = unit(rng)*40 - 20;
+        l[1] = unit(rng)*20 - 5;
+        l[2] = unit(rng)*60 - 50;
+        for (int k=3; k<6; ++k)
+            l[k] = unit(rng);
+    }
+    // Looking down -z from (0, 3, 8), turned a bit
+    const float a = 0.3f, ca = std::cos(a), sa = std::sin(a);
+    const float view[16] = {ca,0,sa,0, 0,1,0,0, -sa,0,ca,0, 8*sa,-3,-8*ca,1};
+    const float constant = 0, linear = 0.2f, quadratic = 1;
+
+    ClusterBuilder builder;
+    Grid g;
+    builder.SetGrid(g);
+    builder.Build(lights.data(), lightCount, 6, view, constant, linear, quadratic, cutoff, pool);
+    const ClusterLights& result = builder.Result;
+    const string name = "Build with " + to_string(lightCount) + " lights, cutoff " + to_string(cutoff);
+    Check(result.OffsetCounts.size() == size_t(g.ClusterCount()) * 2, name + " has every cluster");
+    Check(result.Indices.size() <= size_t(g.ClusterCount()) * MAX_LIGHTS_PER_CLUSTER,
+        name + " stays within MAX_LIGHTS_PER_CLUSTER");
+
+    // View space (depth positive) centers and radii
+    vector<array<float, 4>> spheres(lightCount);
+    for (size_t i=0; i<lightCount; ++i) {
+        const float *l = &lights[i*6];
+        for (int row=0; row<3; ++row)
+            spheres[i][row] = view[row]*l[0] + view[4+row]*l[1] + view[8+row]*l[2] + view[12+row];
+        spheres[i][2] = -spheres[i][2];
+        spheres[i][3] = InfluenceRadius(std::max(l[3], std::max(l[4], l[5])),
+            constant, linear, quadratic, cutoff);
+    }
+    auto intensity = [&](uint32_t i) {
+        return std::max(lights[i*6 + 3], std::max(lights[i*6 + 4], lights[i*6 + 5]));
+    };
+    auto reaches = [](const array<float, 4>& sphere, const float p[3]) {
+        float dist2 = 0;
+        for (int axis=0; axis<3; ++axis)
+            dist2 += (p[axis] - sphere[axis]) * (p[axis] - sphere[axis]);
+        return dist2 <= sphere[3]*sphere[3];
+    };
+
+    const float tanX = g.TanHalfFovY * g.Aspect, tanY = g.TanHalfFovY;
+    const int SAMPLES = 6; // Per axis, faces and corners included
+    int full = 0, missed = 0, extra = 0;
+    for (int s=0; s<g.Slices; ++s) {
+        const float d0 = g.SliceDepth(s), d1 = g.SliceDepth(s+1);
+        for (int y=0; y<g.TilesY; ++y) {
+            for (int x=0; x<g.TilesX; ++x) {
+                // Point of the froxel at fractions u, v, w of its tile and depth range
+                auto point = [&](float u, float v, float w, float p[3]) {
+                    p[2] = d0 + (d1 - d0) * w;
+                    p[0] = (2*(x + u)/g.TilesX - 1) * tanX * p[2];
+                    p[1] = (2*(y + v)/g.TilesY - 1) * tanY * p[2];
+                };
+                float boxMin[3] = {INFINITY, INFINITY, INFINITY}, boxMax[3] = {-INFINITY, -INFINITY, -INFINITY};
+                for (int corner=0; corner<8; ++corner) {
+                    float p[3];
+                    point(corner & 1, corner >> 1 & 1, corner >> 2 & 1, p);
+                    for (int axis=0; axis<3; ++axis) {
+                        boxMin[axis] = std::min(boxMin[axis], p[axis]);
+                        boxMax[axis] = std::max(boxMax[axis], p[axis]);
+                    }
+                }
+                const int cluster = g.ClusterIndex(x, y, s);
+                const uint32_t offset = result.OffsetCounts[cluster*2];
+                const uint32_t count = result.OffsetCounts[cluster*2 + 1];
+                set<uint32_t> touchBox, reachInside;
+                for (size_t i=0; i<lightCount; ++i) {
+                    float closest[3];
+                    for (int axis=0; axis<3; ++axis)
+                        closest[axis] = std::clamp(spheres[i][axis], boxMin[axis], boxMax[axis]);
+                    if (!reaches(spheres[i], closest))
+                        continue;
+                    touchBox.insert(i);
+                    bool inside = false;
+                    for (int k=0; k<SAMPLES*SAMPLES*SAMPLES && !inside; ++k) {
+                        float p[3];
+                        point(float(k % SAMPLES) / (SAMPLES-1), float(k / SAMPLES % SAMPLES) / (SAMPLES-1),
+                            float(k / SAMPLES / SAMPLES) / (SAMPLES-1), p);
+                        inside = reaches(spheres[i], p);
+                    }
+                    if (inside)
+                        reachInside.insert(i);
+                }
+
+                set<uint32_t> got(result.Indices.begin() + offset, result.Indices.begin() + offset + count);
+                float dimmest = INFINITY;
+                if (count == MAX_LIGHTS_PER_CLUSTER) {
+                    ++full;
+                    for (uint32_t i: got)
+                        dimmest = std::min(dimmest, intensity(i));
+                }
+                for (uint32_t i: reachInside)
+                    missed += !got.count(i) && intensity(i) > dimmest;
+                for (uint32_t i: got)
+                    extra += !touchBox.count(i);
+                extra += count - got.size(); // Duplicates
+            }
+        }
+    }
+    Check(missed == 0, name + " misses no light (" + to_string(missed) + " missed)");
+    Check(extra == 0, name + " adds no light out of reach (" + to_string(extra) + " added)");
+    Check(full == result.FullClusters, name + " counts its full clusters");
+    Check(expectFull == (full > 0), name + (expectFull ? " fills clusters" : " fills no cluster"));
+}
+
+// BoxSet::Cull against testing box by box, plane by plane. Counts that
+// aren't a multiple of 4 leave the last group of four part padding, which
+// must neither show up as boxes nor be written to. Boxes within float
+// error of a plane can go either way and aren't counted.
+static void TestCullingMatchesScalar(size_t boxCount) {
+    mt19937 rng(boxCount);
+    uniform_real_distribution<float> unit(0, 1), signedUnit(-1, 1);
+    Culling::BoxSet boxes;
+    vector<array<float, 6>> reference;
+    for (size_t i=0; i<boxCount; ++i) {
+        array<float, 6> box;
+        for (int axis=0; axis<3; ++axis) {
+            const float center = signedUnit(rng) * 10, extent = unit(rng) * 2;
+            box[axis] = center - extent;
+            box[3+axis] = center + extent;
+        }
+        boxes.Add(&box[0], &box[3]);
+        reference.push_back(box);
+    }
+    Check(boxes.Size() == boxCount, "BoxSet counts its boxes");
+
+    const string name = "Cull of " + to_string(boxCount) + " boxes";
+    size_t wrong = 0, wrongCount = 0, overrun = 0;
+    for (int frustum=0; frustum<20; ++frustum) {
+        float planes[6][4];
+        for (auto& plane: planes) {
+            for (int c=0; c<3; ++c)
+                plane[c] = signedUnit(rng);
+            plane[3] = signedUnit(rng) * 8;
+        }
+        const uint8_t SENTINEL = 0xAB;
+        vector<uint8_t> visible(boxCount + 4, SENTINEL);
+        const size_t visibleCount = boxes.Cull(planes, visible.data());
+        size_t counted = 0;
+        for (size_t i=0; i<boxCount; ++i) {
+            counted += visible[i] == 1;
+            bool outside = false, borderline = false;
+            for (const auto& plane: planes) {
+                double d = plane[3], r = 0;
+                for (int axis=0; axis<3; ++axis) {
+                    const double center = (reference[i][axis] + reference[i][3+axis]) / 2.0;
+                    const double extent = (reference[i][3+axis] - reference[i][axis]) / 2.0;
+                    d += plane[axis] * center;
+                    r += fabs(plane[axis]) * extent;
+                }
+                outside |= d + r < 0;
+                borderline |= fabs(d + r) < 1e-4;
+            }
+            if (!borderline && visible[i] != !outside)
+                ++wrong;
+        }
+        wrongCount += counted != visibleCount;
+        for (size_t i=boxCount; i<visible.size(); ++i)
+            overrun += visible[i] != SENTINEL;
+    }
+    Check(wrong == 0, name + " agrees with the scalar test (" + to_string(wrong) + " boxes differ)");
+    Check(wrongCount == 0, name + " returns the visible count");
+    Check(overrun == 0, name + " writes no result past the last box");
+}
+
+int main() {
+    TestOverdrawKeepsTriangles();
+    for (size_t boxCount: {1, 3, 5, 7, 13, 1022})
+        TestCullingMatchesScalar(boxCount);
+    TestClustersMatchBruteForce(500, 0.02f, false, nullptr);
+    ThreadPool pool(4);
+    TestClustersMatchBruteForce(1000, 0.02f, false, &pool);
+    // Big lights, the clusters near the eye get more than they keep
+    TestClustersMatchBruteForce(3000, 0.002f, true, &pool);
+    if (Failures)
+        cerr << Failures << " checks failed" << endl;
+    else
+        cerr << "All checks passed" << endl;
+    return Failures;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULLING_SSE2 1
+#endif
+
+// Frustum culling of many bounding boxes at once
+// * Boxes are stored as centers and half extents, one array per axis
+//   (padded to a multiple of four), so every plane is tested against
+//   four boxes at a time with SSE2
+// * A box is culled when it's entirely on the outer side of one of the
+//   planes. Boxes near the frustum's edges can pass without touching it,
+//   never the other way around.
+// * Pure CPU, doesn't touch GL
+// ---
+namespace Culling {
+
+class BoxSet {
+    std::vector<float> Center[3], Extent[3];
+    size_t Count = 0;
+
+    // Bit n of the result is set if box i+n is outside one of the planes
+    int OutsideFour(size_t i, const float planes[6][4]) const {
+#ifdef CULLING_SSE2
+        const __m128 cx = _mm_loadu_ps(&Center[0][i]), cy = _mm_loadu_ps(&Center[1][i]),
+            cz = _mm_loadu_ps(&Center[2][i]);
+        const __m128 ex = _mm_loadu_ps(&Extent[0][i]), ey = _mm_loadu_ps(&Extent[1][i]),
+            ez = _mm_loadu_ps(&Extent[2][i]);
+        __m128 outside = _mm_setzero_ps();
+        for (int p=0; p<6; ++p) {
+            const float *plane = planes[p];
+            // Signed distance of the center, plus how far the box reaches
+            // towards the plane's inner side
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane[0]), cx),
+                _mm_mul_ps(_mm_set1_ps(plane[1]), cy)),
+                _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane[2]), cz), _mm_set1_ps(plane[3])));
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::abs(plane[0])), ex),
+                _mm_mul_ps(_mm_set1_ps(std::abs(plane[1])), ey)),
+                _mm_mul_ps(_mm_set1_ps(std::abs(plane[2])), ez));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+        }
+        return _mm_movemask_ps(outside);
+#else
+        int mask = 0;
+        for (int n=0; n<4; ++n) {
+            for (int p=0; p<6; ++p) {
+                const float *plane = planes[p];
+                float d = plane[3], r = 0;
+                for (int axis=0; axis<3; ++axis) {
+                    d += plane[axis] * Center[axis][i+n];
+                    r += std::abs(plane[axis]) * Extent[axis][i+n];
+                }
+                if (d + r < 0) {
+                    mask |= 1 << n;
+                    break;
+                }
+            }
+        }
+        return mask;
+#endif
+    }
+
+public:
+    void Clear() {
+        for (int axis=0; axis<3; ++axis) {
+            Center[axis].clear();
+            Extent[axis].clear();
+        }
+        Count = 0;
+    }
+    void Add(const float min[3], const float max[3]) {
+        const size_t padded = (Count + 4) & ~size_t(3);
+        for (int axis=0; axis<3; ++axis) {
+            Center[axis].resize(padded);
+            Extent[axis].resize(padded);
+            Center[axis][Count] = (min[axis] + max[axis]) / 2;
+            Extent[axis][Count] = (max[axis] - min[axis]) / 2;
+        }
+        ++Count;
+    }
+    size_t Size() const { return Count; }
+
+    // Sets visible[i] to whether box i can be inside the frustum given by
+    // planes (xyz = inward normal, w = distance, in the boxes' space, any
+    // length), returns how many can
+    size_t Cull(const float planes[6][4], uint8_t *visible) const {
+        size_t visibleCount = 0;
+        for (size_t i=0; i<Count; i+=4) {
+            const int outside = OutsideFour(i, planes);
+            for (size_t n=0; n<4 && i+n<Count; ++n) {
+                visible[i+n] = !(outside >> n & 1);
+                visibleCount += visible[i+n];
+            }
+        }
+        return visibleCount;
+    }
+};
+
+} // namespace Culling
@@ -0,0 +1,240 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <utility>
+
+// Minimal KTX2 reader/writer
+// https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html
+// * Only what TextureCooker produces: 2D, 1 layer, 1 face,
+//   BC1/BC3/BC4/BC5 blocks, no supercompression
+// * Shared by the cooker and the Texture loader, doesn't touch GL
+// ---
+namespace Ktx2 {
+
+// The subset of VkFormat we use
+enum Format : uint32_t {
+    BC1_RGB_UNORM = 131,
+    BC1_RGB_SRGB = 132,
+    BC3_UNORM = 137,
+    BC3_SRGB = 138,
+    BC4_UNORM = 139,
+    BC5_UNORM = 141,
+};
+
+static const uint8_t IDENTIFIER[12] = {
+    0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+
+// Extra key/value entry so the loader knows how many channels the
+// source image had (decides alpha clipping, same as the stb path)
+static const char SOURCE_CHANNELS_KEY[] = "RGSourceChannels";
+
+struct Header {
+    uint8_t Identifier[12];
+    uint32_t VkFormat;
+    uint32_t TypeSize;
+    uint32_t PixelWidth;
+    uint32_t PixelHeight;
+    uint32_t PixelDepth;
+    uint32_t LayerCount;
+    uint32_t FaceCount;
+    uint32_t LevelCount;
+    uint32_t SupercompressionScheme;
+    // Index
+    uint32_t DfdByteOffset;
+    uint32_t DfdByteLength;
+    uint32_t KvdByteOffset;
+    uint32_t KvdByteLength;
+    uint64_t SgdByteOffset;
+    uint64_t SgdByteLength;
+};
+static_assert(sizeof(Header) == 80, "KTX2 header must match the file layout");
+
+struct LevelIndex {
+    uint64_t ByteOffset;
+    uint64_t ByteLength;
+    uint64_t UncompressedByteLength;
+};
+
+inline uint32_t BlockBytes(uint32_t format) {
+    switch (format) {
+        case BC1_RGB_UNORM: case BC1_RGB_SRGB: case BC4_UNORM: return 8;
+        case BC3_UNORM: case BC3_SRGB: case BC5_UNORM: return 16;
+        default: return 0;
+    }
+}
+inline uint32_t LevelDimension(uint32_t base, int level) {
+    uint32_t dim = base >> level;
+    return dim ? dim : 1;
+}
+inline size_t LevelBytes(uint32_t format, uint32_t width, uint32_t height) {
+    return size_t((width + 3) / 4) * ((height + 3) / 4) * BlockBytes(format);
+}
+// foo/bar.png -> foo/bar.ktx2
+inline std::string PathFor(const std::string& sourcePath) {
+    size_t dot = sourcePath.find_last_of('.');
+    size_t slash = sourcePath.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return sourcePath + ".ktx2";
+    return sourcePath.substr(0, dot) + ".ktx2";
+}
+
+// A parsed file, pointing into memory owned by the caller
+struct Image {
+    uint32_t VkFormat = 0;
+    uint32_t Width = 0;
+    uint32_t Height = 0;
+    int SourceChannels = 0;
+    std::vector<std::pair<const uint8_t*, size_t>> Levels; // Level 0 is the largest
+};
+
+inline bool Parse(const uint8_t *data, size_t size, Image& out) {
+    if (size < sizeof(Header))
+        return false;
+    Header header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.Identifier, IDENTIFIER, sizeof(IDENTIFIER)) != 0
+        || BlockBytes(header.VkFormat) == 0
+        || header.PixelWidth == 0 || header.PixelHeight == 0
+        || header.PixelDepth != 0 || header.LayerCount > 1 || header.FaceCount != 1
+        || header.LevelCount == 0 || header.SupercompressionScheme != 0)
+        return false;
+    if (size < sizeof(Header) + header.LevelCount * sizeof(LevelIndex))
+        return false;
+
+    out.VkFormat = header.VkFormat;
+    out.Width = header.PixelWidth;
+    out.Height = header.PixelHeight;
+    out.Levels.clear();
+    for (uint32_t level=0; level<header.LevelCount; ++level) {
+        LevelIndex index;
+        memcpy(&index, data + sizeof(Header) + level * sizeof(LevelIndex), sizeof(index));
+        size_t expected = LevelBytes(header.VkFormat,
+            LevelDimension(header.PixelWidth, level), LevelDimension(header.PixelHeight, level));
+        if (index.ByteLength != expected || index.ByteOffset > size
+            || size - index.ByteOffset < index.ByteLength)
+            return false;
+        out.Levels.push_back({data + index.ByteOffset, (size_t)index.ByteLength});
+    }
+
+    // Key/value data: { uint32 length; key \0 value; padding }
+    bool hasAlpha = header.VkFormat == BC3_UNORM || header.VkFormat == BC3_SRGB;
+    out.SourceChannels = hasAlpha ? 4 : 3;
+    if (header.KvdByteOffset && (uint64_t)header.KvdByteOffset + header.KvdByteLength <= size) {
+        const uint8_t *kv = data + header.KvdByteOffset;
+        const uint8_t *end = kv + header.KvdByteLength;
+        while (end - kv >= 4) {
+            uint32_t length;
+            memcpy(&length, kv, 4);
+            kv += 4;
+            if ((size_t)(end - kv) < length)
+                break;
+            std::string entry((const char*)kv, length);
+            size_t nul = entry.find('\0');
+            if (nul != std::string::npos && entry.compare(0, nul, SOURCE_CHANNELS_KEY) == 0)
+                out.SourceChannels = atoi(entry.c_str() + nul + 1);
+            kv += (length + 3) & ~3u;
+        }
+    }
+    return true;
+}
+
+// Data format descriptor for the block compressed formats above
+inline std::vector<uint32_t> MakeDfd(uint32_t format) {
+    enum { MODEL_BC1A = 128, MODEL_BC3 = 130, MODEL_BC4 = 131, MODEL_BC5 = 132 };
+    enum { CHANNEL_COLOR = 0, CHANNEL_GREEN = 1, CHANNEL_ALPHA = 15 };
+    enum { PRIMARIES_BT709 = 1, TRANSFER_LINEAR = 1, TRANSFER_SRGB = 2 };
+
+    uint32_t model = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> samples; // (bit offset, channel)
+    switch (format) {
+        case BC1_RGB_UNORM: case BC1_RGB_SRGB:
+            model = MODEL_BC1A; samples = {{0, CHANNEL_COLOR}}; break;
+        case BC3_UNORM: case BC3_SRGB:
+            model = MODEL_BC3; samples = {{0, CHANNEL_ALPHA}, {64, CHANNEL_COLOR}}; break;
+        case BC4_UNORM:
+            model = MODEL_BC4; samples = {{0, CHANNEL_COLOR}}; break;
+        case BC5_UNORM:
+            model = MODEL_BC5; samples = {{0, CHANNEL_COLOR}, {64, CHANNEL_GREEN}}; break;
+    }
+    bool srgb = format == BC1_RGB_SRGB || format == BC3_SRGB;
+    uint32_t blockSize = 24 + 16 * samples.size();
+
+    std::vector<uint32_t> dfd;
+    dfd.push_back(4 + blockSize); // dfdTotalSize
+    dfd.push_back(0); // vendorId = Khronos, descriptorType = basic
+    dfd.push_back(2 | (blockSize << 16)); // version 1.3
+    dfd.push_back(model | (PRIMARIES_BT709 << 8)
+        | ((srgb ? TRANSFER_SRGB : TRANSFER_LINEAR) << 16));
+    dfd.push_back(3 | (3 << 8)); // 4x4x1x1 texel blocks
+    dfd.push_back(BlockBytes(format));
+    dfd.push_back(0);
+    for (auto& sample: samples) {
+        dfd.push_back(sample.first | (63 << 16) | (sample.second << 24));
+        dfd.push_back(0);
+        dfd.push_back(0);
+        dfd.push_back(0xFFFFFFFFu);
+    }
+    return dfd;
+}
+
+// levels[0] is the largest mip. Returns the complete file.
+inline std::vector<uint8_t> Write(uint32_t format, uint32_t width, uint32_t height,
+    const std::vector<std::vector<uint8_t>>& levels,
+    const std::vector<std::pair<std::string, std::string>>& keyValues
+) {
+    auto align = [](size_t offset, size_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    };
+
+    std::vector<uint32_t> dfd = MakeDfd(format);
+    std::vector<uint8_t> kvd;
+    for (auto& kv: keyValues) {
+        uint32_t length = kv.first.size() + 1 + kv.second.size() + 1;
+        kvd.insert(kvd.end(), (uint8_t*)&length, (uint8_t*)&length + 4);
+        kvd.insert(kvd.end(), kv.first.begin(), kv.first.end());
+        kvd.push_back(0);
+        kvd.insert(kvd.end(), kv.second.begin(), kv.second.end());
+        kvd.push_back(0);
+        kvd.resize(align(kvd.size(), 4), 0);
+    }
+
+    Header header = {};
+    memcpy(header.Identifier, IDENTIFIER, sizeof(IDENTIFIER));
+    header.VkFormat = format;
+    header.TypeSize = 1;
+    header.PixelWidth = width;
+    header.PixelHeight = height;
+    header.FaceCount = 1;
+    header.LevelCount = levels.size();
+    header.DfdByteOffset = sizeof(Header) + levels.size() * sizeof(LevelIndex);
+    header.DfdByteLength = dfd.size() * 4;
+    header.KvdByteOffset = kvd.empty() ? 0 : header.DfdByteOffset + header.DfdByteLength;
+    header.KvdByteLength = kvd.size();
+
+    // Mip data goes smallest first, each level aligned to the block size
+    size_t offset = header.DfdByteOffset + header.DfdByteLength + kvd.size();
+    std::vector<LevelIndex> index(levels.size());
+    for (int level=levels.size()-1; level>=0; --level) {
+        offset = align(offset, BlockBytes(format));
+        index[level].ByteOffset = offset;
+        index[level].ByteLength = levels[level].size();
+        index[level].UncompressedByteLength = 0;
+        offset += levels[level].size();
+    }
+
+    std::vector<uint8_t> file(offset, 0);
+    memcpy(&file[0], &header, sizeof(header));
+    memcpy(&file[sizeof(Header)], index.data(), index.size() * sizeof(LevelIndex));
+    memcpy(&file[header.DfdByteOffset], dfd.data(), header.DfdByteLength);
+    if (!kvd.empty())
+        memcpy(&file[header.KvdByteOffset], kvd.data(), kvd.size());
+    for (size_t level=0; level<levels.size(); ++level)
+        memcpy(&file[index[level].ByteOffset], levels[level].data(), levels[level].size());
+    return file;
+}
+
+} // namespace Ktx2
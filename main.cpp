@@ -74,12 +74,77 @@ MeshPtr MakeSpotlightMesh(
     return cone;
 }
 
+// A sphere of radius 1 (or a bit more, so the flat faces don't cut
+// into it), subdivided icosahedron. For point light volumes.
+MeshPtr MakeLightVolumeMesh(int subdivisions) {
+    const float t = (1 + sqrt(5.0f)) / 2;
+    vector<vec3> positions = {
+        {-1, t, 0}, {1, t, 0}, {-1, -t, 0}, {1, -t, 0},
+        {0, -1, t}, {0, 1, t}, {0, -1, -t}, {0, 1, -t},
+        {t, 0, -1}, {t, 0, 1}, {-t, 0, -1}, {-t, 0, 1},
+    };
+    vector<GLuint> indices = {
+        0,11,5, 0,5,1, 0,1,7, 0,7,10, 0,10,11,
+        1,5,9, 5,11,4, 11,10,2, 10,7,6, 7,1,8,
+        3,9,4, 3,4,2, 3,2,6, 3,6,8, 3,8,9,
+        4,9,5, 2,4,11, 6,2,10, 8,6,7, 9,8,1,
+    };
+    for (vec3& p: positions)
+        p = normalize(p);
+    for (int i=0; i<subdivisions; ++i) {
+        map<pair<GLuint, GLuint>, GLuint> midpoints;
+        auto midpoint = [&](GLuint a, GLuint b) {
+            auto key = make_pair(std::min(a, b), std::max(a, b));
+            auto it = midpoints.find(key);
+            if (it != midpoints.end())
+                return it->second;
+            positions.push_back(normalize(positions[a] + positions[b]));
+            return midpoints[key] = positions.size() - 1;
+        };
+        vector<GLuint> finer;
+        for (size_t tri=0; tri<indices.size(); tri+=3) {
+            GLuint a = indices[tri], b = indices[tri+1], c = indices[tri+2];
+            GLuint ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+            finer.insert(finer.end(), {a,ab,ca, b,bc,ab, c,ca,bc, ab,bc,ca});
+        }
+        indices = finer;
+    }
+    // Push the faces out to touch the unit sphere
+    float inradius = 1;
+    for (size_t tri=0; tri<indices.size(); tri+=3) {
+        vec3 a = positions[indices[tri]], b = positions[indices[tri+1]], c = positions[indices[tri+2]];
+        inradius = std::min(inradius, dot(a, normalize(cross(b - a, c - a))));
+    }
+    for (vec3& p: positions)
+        p /= inradius;
+
+    MeshPtr sphere = make_shared<Mesh>();
+    sphere->Positions = positions;
+    sphere->Elements = indices;
+    sphere->UploadToGPU();
+    return sphere;
+}
+
 class Framebuffer {
     GLuint FBO;
     vector<GLuint> Textures;
     vector<GLenum> Formats;
     bool MakeDepthBuffer;
     bool SyncWithWindowSize;
+    size_t GPUBytes = 0;
+    shared_ptr<Framebuffer> DepthSource; // Whose depth buffer is attached instead of our own
+
+    static size_t BytesPerPixel(GLenum format) {
+        switch (format) {
+            case GL_RGBA32F: return 16;
+            case GL_RGBA16F: return 8;
+            case GL_RGBA8: return 4;
+            case GL_DEPTH24_STENCIL8: return 4;
+            default:
+                cerr << "Unknown framebuffer format " << format << endl;
+                abort();
+        }
+    }
 
     void CheckStatus() {
         GLenum fboStatus = glCheckNamedFramebufferStatus(FBO, GL_FRAMEBUFFER);
@@ -102,7 +167,9 @@ class Framebuffer {
         if (MakeDepthBuffer) {
             colorAttachCount -= 1;
             glNamedFramebufferTexture(FBO, GL_DEPTH_STENCIL_ATTACHMENT, Textures.back(), 0);
-        } 
+        } else if (DepthSource) {
+            glNamedFramebufferTexture(FBO, GL_DEPTH_STENCIL_ATTACHMENT, DepthSource->Textures.back(), 0);
+        }
 
         vector<GLenum> drawBufs;
         for (int buf=0; buf<colorAttachCount; ++buf) {
@@ -113,8 +180,13 @@ class Framebuffer {
     }
     void CreateTextures(ivec2 dims) {
         glCreateTextures(GL_TEXTURE_2D, Textures.size(), &Textures[0]);
-        for (int i=0; i<Textures.size(); ++i)
+        size_t bytes = 0;
+        for (int i=0; i<Textures.size(); ++i) {
             glTextureStorage2D(Textures[i], 1, Formats[i], dims.x, dims.y);        
+            bytes += size_t(dims.x) * dims.y * BytesPerPixel(Formats[i]);
+        }
+        GPUMemory::Account(GPUMemory::FramebufferMemory, GPUBytes, bytes);
+        GPUBytes = bytes;
     }
 public:
     Framebuffer(vector<GLenum> formats, bool makeDepthBuffer, bool syncWithWindowSize, int w=1, int h=1) {
@@ -140,6 +212,7 @@ public:
     ~Framebuffer() {
         glDeleteTextures(Textures.size(), &Textures[0]);
         glDeleteFramebuffers(1, &FBO);
+        GPUMemory::Account(GPUMemory::FramebufferMemory, GPUBytes, 0);
     }
     void Update() {
         if (SyncWithWindowSize && TheEngine->WasWindowResized()) {
@@ -149,6 +222,13 @@ public:
             CheckStatus();
         }
     }
+    // Attaches source's depth buffer, for depth testing against what it
+    // rendered. Update() source before this one, so it follows a resize.
+    void ShareDepthBuffer(shared_ptr<Framebuffer> source) {
+        DepthSource = source;
+        AttachTextures();
+        CheckStatus();
+    }
     GLuint GetTexture(int i) { return Textures.at(i); }
     void Bind() {
         glBindFramebuffer(GL_FRAMEBUFFER, FBO);
@@ -157,6 +237,295 @@ public:
 
 typedef shared_ptr<Framebuffer> FramebufferPtr;
 
+// Measures the GPU time of the commands between Begin and End. Results are
+// read back a few frames late, so it never stalls the pipeline.
+// ---
+class GPUTimer {
+    static const int LATENCY = 3;
+    GLuint Queries[LATENCY];
+    bool Issued[LATENCY] = {false};
+    int Current = 0;
+    double Milliseconds = 0;
+
+public:
+    GPUTimer() {
+        glCreateQueries(GL_TIME_ELAPSED, LATENCY, Queries);
+    }
+    ~GPUTimer() {
+        glDeleteQueries(LATENCY, Queries);
+    }
+    GPUTimer(const GPUTimer&) = delete;
+    GPUTimer& operator=(const GPUTimer&) = delete;
+
+    void Begin() {
+        glBeginQuery(GL_TIME_ELAPSED, Queries[Current]);
+    }
+    void End() {
+        glEndQuery(GL_TIME_ELAPSED);
+        Issued[Current] = true;
+        Current = (Current + 1) % LATENCY;
+        if (Issued[Current]) {
+            GLuint64 nanoseconds;
+            glGetQueryObjectui64v(Queries[Current], GL_QUERY_RESULT, &nanoseconds);
+            Milliseconds = nanoseconds / 1e6;
+        }
+    }
+    double GetMilliseconds() const { return Milliseconds; }
+};
+
+// Copies of a uniform block, one per frame in flight, in a persistently
+// mapped buffer. Upload() writes the next copy and binds it, a fence per
+// copy makes sure the GPU is done reading it before it's overwritten.
+// Block is bound with its own size, which has to be the std140 one.
+// ---
+template<class Block>
+class UniformRing {
+    // std140 rounds a block up to a vec4, so a Block that isn't would
+    // bind a range shorter than the shader's block
+    static_assert(sizeof(Block) % 16 == 0, "pad Block to a multiple of 16 bytes");
+    static const int LATENCY = 3;
+    GLuint Buffer = 0;
+    GLuint Binding;
+    GLsizeiptr Stride;
+    char *Mapped;
+    GLsync Fences[LATENCY] = {};
+    int Current = 0;
+
+public:
+    explicit UniformRing(GLuint binding): Binding(binding) {
+        GLint alignment;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        alignment = std::max(alignment, 16); // Both are powers of two
+        Stride = (sizeof(Block) + alignment-1) / alignment * alignment;
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glCreateBuffers(1, &Buffer);
+        glNamedBufferStorage(Buffer, Stride * LATENCY, nullptr, flags);
+        Mapped = (char*)glMapNamedBufferRange(Buffer, 0, Stride * LATENCY, flags);
+    }
+    ~UniformRing() {
+        for (GLsync fence: Fences)
+            glDeleteSync(fence);
+        glUnmapNamedBuffer(Buffer);
+        glDeleteBuffers(1, &Buffer);
+    }
+    UniformRing(const UniformRing&) = delete;
+    UniformRing& operator=(const UniformRing&) = delete;
+
+    void Upload(const Block& block) {
+        Current = (Current + 1) % LATENCY;
+        if (Fences[Current]) {
+            // Normally long signaled, LATENCY frames have passed
+            glClientWaitSync(Fences[Current], GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1e9));
+            glDeleteSync(Fences[Current]);
+            Fences[Current] = 0;
+        }
+        memcpy(Mapped + Current*Stride, &block, sizeof(Block));
+        glBindBufferRange(GL_UNIFORM_BUFFER, Binding, Buffer, Current*Stride, sizeof(Block));
+    }
+    // After the last draw that reads the current copy
+    void Fence() {
+        Fences[Current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+};
+
+// The light list, as a shader storage buffer (Lights in DRLighting.frag)
+// * Grows on demand, to the next power of two
+// * Upload() only sends the lights that changed since the last one, in
+//   runs of consecutive changed lights
+// ---
+class LightBuffer {
+    // std430 Light
+    struct GPULight {
+        vec3 Position;
+        float Pad0;
+        vec3 Color;
+        float Pad1;
+    };
+    static_assert(sizeof(GPULight) == 32, "std430 layout");
+
+    GLuint Buffer = 0;
+    GLuint Binding;
+    size_t Capacity = 0;
+    vector<GPULight> Uploaded; // What the buffer holds
+    size_t UploadedCount = 0; // By the last Upload()
+
+    void Reserve(size_t count) {
+        if (count <= Capacity)
+            return;
+        size_t capacity = std::max(Capacity, MIN_CAPACITY);
+        while (capacity < count)
+            capacity *= 2;
+        glDeleteBuffers(1, &Buffer);
+        glCreateBuffers(1, &Buffer);
+        glNamedBufferStorage(Buffer, capacity * sizeof(GPULight), nullptr, GL_DYNAMIC_STORAGE_BIT);
+        Capacity = capacity;
+        Uploaded.clear(); // The new buffer is empty
+    }
+
+public:
+    static constexpr size_t MIN_CAPACITY = 256;
+
+    explicit LightBuffer(GLuint binding): Binding(binding) {
+        Reserve(MIN_CAPACITY);
+    }
+    ~LightBuffer() {
+        glDeleteBuffers(1, &Buffer);
+    }
+    LightBuffer(const LightBuffer&) = delete;
+    LightBuffer& operator=(const LightBuffer&) = delete;
+
+    void Upload(const vector<Light>& lights) {
+        Reserve(lights.size());
+        const size_t known = std::min(Uploaded.size(), lights.size());
+        Uploaded.resize(lights.size());
+        auto changed = [&](size_t i) {
+            return i >= known || Uploaded[i].Position != lights[i].Position
+                || Uploaded[i].Color != lights[i].Color;
+        };
+        UploadedCount = 0;
+        for (size_t i=0; i<lights.size();) {
+            if (!changed(i)) {
+                ++i;
+                continue;
+            }
+            size_t end = i;
+            for (; end<lights.size() && changed(end); ++end) {
+                Uploaded[end].Position = lights[end].Position;
+                Uploaded[end].Color = lights[end].Color;
+            }
+            glNamedBufferSubData(Buffer, i * sizeof(GPULight), (end - i) * sizeof(GPULight), &Uploaded[i]);
+            UploadedCount += end - i;
+            i = end;
+        }
+    }
+    void Bind() {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, Binding, Buffer);
+    }
+    size_t GetUploadedCount() const { return UploadedCount; }
+};
+const GLuint LIGHT_BUFFER_BINDING = 1; // 0 is MaterialTable's
+
+// A shader storage buffer (or another target, e.g. draw commands) for
+// data that's rewritten whole every frame, grows on demand to the next
+// power of two
+// ---
+class StorageBuffer {
+    GLuint Buffer = 0;
+    GLuint Binding;
+    GLenum Target;
+    size_t Capacity = 0; // Bytes
+
+public:
+    static constexpr size_t MIN_CAPACITY = 4096;
+
+    // binding only matters for indexed targets
+    explicit StorageBuffer(GLuint binding, GLenum target = GL_SHADER_STORAGE_BUFFER)
+        : Binding(binding), Target(target) {}
+    ~StorageBuffer() {
+        glDeleteBuffers(1, &Buffer);
+    }
+    StorageBuffer(const StorageBuffer&) = delete;
+    StorageBuffer& operator=(const StorageBuffer&) = delete;
+
+    void Upload(const void *data, size_t bytes) {
+        if (bytes > Capacity || !Buffer) {
+            size_t capacity = std::max(Capacity, MIN_CAPACITY);
+            while (capacity < bytes)
+                capacity *= 2;
+            glDeleteBuffers(1, &Buffer);
+            glCreateBuffers(1, &Buffer);
+            glNamedBufferStorage(Buffer, capacity, nullptr, GL_DYNAMIC_STORAGE_BIT);
+            Capacity = capacity;
+        }
+        if (bytes)
+            glNamedBufferSubData(Buffer, 0, bytes, data);
+    }
+    template<class T>
+    void Upload(const vector<T>& data) {
+        Upload(data.data(), data.size() * sizeof(T));
+    }
+    void Bind() {
+        if (Target == GL_SHADER_STORAGE_BUFFER)
+            glBindBufferBase(Target, Binding, Buffer);
+        else
+            glBindBuffer(Target, Buffer);
+    }
+};
+
+// std140, keep in sync with Data/shaders/FrameUniforms.glsl!
+// vec3s are followed by a float to fill their 16 bytes, bools are 4 bytes.
+struct FrameUniforms {
+    mat4 ShadowmapVPMat;
+    mat4 ViewMat;
+    mat4 ProjectionMat;
+    vec3 CameraPosition;
+    float Gamma;
+    vec3 FlashlightPosition;
+    float FlashlightCutoffAng;
+    vec3 FlashlightDirection;
+    float FogDensity;
+    vec3 FlashlightColor;
+    float ParallaxDepth;
+    vec3 AmbientLight;
+    float AttenConst;
+    float AttenLin;
+    float AttenQuad;
+    float RSMSamplingRadius;
+    float RSMReflectionFact;
+    GLint RSMVPLCount;
+    GLint RaymarchSteps;
+    GLint LightCount;
+    GLint VisualizeBuffer;
+    GLint VisualizeRSMBuffer;
+    GLint Tonemap;
+    GLint VisualizeShadowmap;
+    GLint VisualizeIndirectLighting;
+    GLint EnableIndirectLighting;
+    GLint LightCulling; // DeferredRenderer::LightCullingMode
+    GLint TileCountX;
+    float LightCutoff;
+};
+static_assert(offsetof(FrameUniforms, CameraPosition) == 192, "std140 layout");
+static_assert(offsetof(FrameUniforms, AttenLin) == 272, "std140 layout");
+static_assert(sizeof(FrameUniforms) == 336, "std140 layout");
+// std140 rounds the block up to a vec4, pad when adding fields
+static_assert(sizeof(FrameUniforms) % 16 == 0, "std140 block size");
+const GLuint FRAME_UNIFORMS_BINDING = 0;
+
+// Tiled light culling, keep in sync with LightCulling.comp and DRLighting.frag!
+const int LIGHT_TILE_SIZE = 16;
+const int MAX_LIGHTS_PER_TILE = 1023;
+const GLuint TILE_LIGHT_BUFFER_BINDING = 2;
+const GLuint TILE_OVERFLOW_BINDING = 6;
+
+// Clustered light culling, the grid is Clustering::Grid's default, keep
+// in sync with DRLighting.frag!
+const GLuint CLUSTER_OFFSET_COUNT_BINDING = 3;
+const GLuint CLUSTER_INDEX_BINDING = 4;
+
+// Per command of a multi-draw, std430, keep in sync with
+// Data/shaders/DrawParameters.glsl!
+struct DrawData {
+    mat4 ModelMat;
+    mat4 NormalMat; // Upper left 3x3
+    vec3 PositionOffset;
+    GLint MaterialID;
+    vec3 PositionScale;
+    GLint Padding; // std430 rounds the struct up to 16 bytes anyway
+};
+static_assert(offsetof(DrawData, PositionOffset) == 128, "std430 layout");
+static_assert(sizeof(DrawData) == 160, "std430 layout");
+const GLuint DRAW_DATA_BINDING = 5;
+
+// What DeferredRenderer::Draw frustum culled, summed over a pass.
+// Triangles at full detail.
+struct MeshCullStats {
+    int Total = 0;
+    int Culled = 0;
+    size_t TotalTriangles = 0;
+    size_t CulledTriangles = 0;
+};
+
 class DeferredRenderer {
 public:
     enum Buffer {
@@ -180,26 +549,418 @@ public:
 
         RSMBufferCount
     };
+
+    // Which lights DRLighting loops over, per pixel
+    enum LightCullingMode {
+        NoLightCulling, // All of them
+        TiledLightCulling, // Those of its screen tile, LightCulling.comp on the GPU
+        ClusteredLightCulling, // Those of its froxel, Clustering::ClusterBuilder on the CPU
+        LightVolumeCulling, // None, a sphere per light shades the pixels it covers beforehand
+    };
 private:
     FramebufferPtr GBuffer, RSM;
+    FramebufferPtr LightAccum; // Point lights of LightVolumeCulling, HDR, GBuffer's depth
     ShaderPtr ShadowmapStage;
     ShaderPtr GeometryStage;
     ShaderPtr LightingStage;
+    ShaderPtr LightCullingStage;
+    ShaderPtr LightVolumeStage;
     MeshPtr ScreenQuad;
+    MeshPtr LightVolume;
     mat4 ShadowmapVPMat;
     mat4 GeometryVPMat;
+    mat4 ModelMat = mat4(1);
+    bool InGeometryStage = false;
+    GPUTimer GeometryTimer;
+    GPUTimer LightingTimer; // Culling included
+    int VisualizedBuffer = -1, VisualizedRSMBuffer = -1; // -1 = final render
+    int CullFace = -1; // GL_CULL_FACE as last set, -1 = unknown
 
-    void SetMaterial(Material mat) {
-        mat.DiffuseMap->Bind(0);
-        mat.SpecularMap->Bind(1);
-        mat.NormalMap->Bind(2);
-        mat.BumpMap->Bind(3);
-        mat.TranslucencyMap->Bind(4);
-        if (mat.DiffuseMap->ShouldAlphaClip())
-            glDisable(GL_CULL_FACE);
-        else
+    // Set for every mesh, so resolved once
+    struct DrawUniforms {
+        Uniform<vec3> PositionOffset, PositionScale;
+        Uniform<GLint> MaterialID;
+        Uniform<bool> MultiDraw;
+        Uniform<GLint> FirstDraw;
+
+        DrawUniforms() {}
+        DrawUniforms(Shader *stage)
+            : PositionOffset(stage, "PositionOffset"), PositionScale(stage, "PositionScale"),
+              MaterialID(stage, "MaterialID"), MultiDraw(stage, "MultiDraw"),
+              FirstDraw(stage, "FirstDraw") {}
+    };
+    DrawUniforms ShadowmapDraw, GeometryDraw;
+    shared_ptr<UniformRing<FrameUniforms>> FrameRing;
+    shared_ptr<LightBuffer> LightList;
+
+    Clustering::ClusterBuilder Clusters;
+    shared_ptr<StorageBuffer> ClusterOffsetCounts, ClusterIndices;
+    double ClusterBuildMs = 0;
+
+    void BuildClusters(const mat4& viewMat, float aspectRatio) {
+        static_assert(sizeof(Light) == 6*sizeof(float), "Build() reads Lights as floats");
+        auto start = chrono::steady_clock::now();
+        Clustering::Grid grid;
+        grid.TanHalfFovY = tan(FOV / 2);
+        grid.Aspect = aspectRatio;
+        Clusters.SetGrid(grid);
+        Clusters.Build((const float*)Lights.data(), Lights.size(), 6, value_ptr(viewMat),
+            AttenConst, AttenLin, AttenQuad, LightCutoff, TheThreadPool.get());
+        ClusterBuildMs = MillisecondsSince(start);
+        ClusterOffsetCounts->Upload(Clusters.Result.OffsetCounts);
+        ClusterIndices->Upload(Clusters.Result.Indices);
+    }
+
+    // Per 16x16 tile: how many lights reach it, then their indices.
+    // Sized for the window.
+    GLuint TileLightBuffer = 0;
+    ivec2 TileCount = ivec2(0);
+    size_t TileLightBufferBytes = 0;
+
+    void ResizeTileLightBuffer(ivec2 windowSize) {
+        ivec2 tileCount = (windowSize + LIGHT_TILE_SIZE-1) / LIGHT_TILE_SIZE;
+        if (tileCount == TileCount)
+            return;
+        TileCount = tileCount;
+        size_t bytes = size_t(TileCount.x) * TileCount.y * (MAX_LIGHTS_PER_TILE+1) * sizeof(GLuint);
+        glDeleteBuffers(1, &TileLightBuffer);
+        glCreateBuffers(1, &TileLightBuffer);
+        glNamedBufferStorage(TileLightBuffer, std::max(bytes, sizeof(GLuint)), nullptr, 0);
+        GPUMemory::Account(GPUMemory::FramebufferMemory, TileLightBufferBytes, bytes);
+        TileLightBufferBytes = bytes;
+    }
+
+    // Tiles whose lights didn't fit in MAX_LIGHTS_PER_TILE (they're shaded
+    // with every light instead) and the lights past it, counted by
+    // LightCulling.comp. Like GPUTimer, a few buffers in turn, each read
+    // back when it comes around again.
+    static const int OVERFLOW_LATENCY = 3;
+    GLuint TileOverflowBuffers[OVERFLOW_LATENCY] = {};
+    bool TileOverflowIssued[OVERFLOW_LATENCY] = {false};
+    int TileOverflowCurrent = 0;
+    GLuint TileOverflow[2] = {0, 0}; // Tiles, lights
+
+    void CountTileOverflow() {
+        GLuint buffer = TileOverflowBuffers[TileOverflowCurrent];
+        if (TileOverflowIssued[TileOverflowCurrent])
+            glGetNamedBufferSubData(buffer, 0, sizeof(TileOverflow), TileOverflow);
+        glClearNamedBufferData(buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, TILE_OVERFLOW_BINDING, buffer);
+        TileOverflowIssued[TileOverflowCurrent] = true;
+        TileOverflowCurrent = (TileOverflowCurrent + 1) % OVERFLOW_LATENCY;
+    }
+    // Of the last frame
+    int TextureBinds = 0; // Material textures
+    int ProgramChanges = 0;
+    int VertexArrayBinds = 0;
+    int DrawCalls = 0;
+
+    // Commands and their DrawData, one pair per pass, so the geometry
+    // pass doesn't overwrite what the shadowmap pass still has to read
+    shared_ptr<StorageBuffer> DrawCommands[2], DrawDataBuffers[2];
+    vector<MergedGeometry::DrawCommand> CommandScratch;
+    vector<DrawData> DrawDataScratch;
+    // Where a model's commands are in CommandScratch: the single sided
+    // ones in [First, TwoSided), the two sided ones in [TwoSided, End)
+    struct ModelCommands {
+        const Model *TheModel;
+        size_t First, TwoSided, End;
+    };
+    vector<ModelCommands> ModelCommandRanges;
+
+    // A mesh waiting in Queue
+    struct QueuedDraw {
+        ModelPtr TheModel;
+        mat4 ModelMat;
+        int MeshIndex;
+    };
+    RenderQueue Queue;
+    vector<QueuedDraw> QueuedDraws;
+    vector<uint8_t> MeshVisible; // Draw scratch
+
+    // For estimating on screen texel density
+    const float FOV = radians(60.0f);
+    const float FAR_PLANE = 250.0f;
+    vec3 CameraPosition;
+    float WorldPerPixelAtUnitDistance = 0;
+
+    // From eye to the world space bounding box of mesh, 0 inside it
+    float DistanceTo(const Mesh& mesh, vec3 eye) const {
+        vec3 wsMin(INFINITY), wsMax(-INFINITY);
+        for (int corner=0; corner<8; ++corner) {
+            vec3 p(
+                (corner & 1) ? mesh.BoundsMax.x : mesh.BoundsMin.x,
+                (corner & 2) ? mesh.BoundsMax.y : mesh.BoundsMin.y,
+                (corner & 4) ? mesh.BoundsMax.z : mesh.BoundsMin.z);
+            p = vec3(ModelMat * vec4(p, 1));
+            wsMin = min(wsMin, p);
+            wsMax = max(wsMax, p);
+        }
+        vec3 outside = max(vec3(0), max(wsMin - eye, eye - wsMax));
+        return length(outside);
+    }
+
+    // Asks each texture of each mesh for the mip level that gives about one
+    // texel per pixel, based on the distance to the mesh bounding box
+    void RequestTextureLevels(ModelPtr model) {
+        const float modelScale = length(vec3(ModelMat[0]));
+        for (int i=0; i<model->Meshes.size(); ++i) {
+            const Mesh& mesh = *model->Meshes[i];
+            float distance = std::max(DistanceTo(mesh, CameraPosition), 0.01f);
+            float worldPerPixel = distance * WorldPerPixelAtUnitDistance;
+            float uvPerPixel = mesh.UVDensity / modelScale * worldPerPixel;
+
+            for (Texture *texture: model->Materials[i].GetTextures()) {
+                float texelsPerPixel = uvPerPixel * std::max(texture->GetWidth(), texture->GetHeight());
+                texture->RequestLevel((int)floor(log2(std::max(texelsPerPixel, 1.0f))));
+            }
+        }
+    }
+
+    // The coarsest LOD whose simplification error, seen from eye, stays
+    // under LODErrorPixels
+    int SelectLOD(const Mesh& mesh, vec3 eye, float worldPerPixelAtUnitDistance) const {
+        const float modelScale = length(vec3(ModelMat[0]));
+        float distance = std::max(DistanceTo(mesh, eye), 0.01f);
+        float worldPerPixel = distance * worldPerPixelAtUnitDistance;
+        int lod = 0;
+        while (lod+1 < mesh.GetLODCount()
+            && mesh.GetLODError(lod+1) * modelScale < LODErrorPixels * worldPerPixel)
+            ++lod;
+        return lod;
+    }
+
+    // Alpha clipped materials are drawn two sided
+    void SetCullFace(bool enable) {
+        if (CullFace == (int)enable)
+            return;
+        if (enable)
             glEnable(GL_CULL_FACE);
-    }    
+        else
+            glDisable(GL_CULL_FACE);
+        CullFace = enable;
+    }
+    // Same textures, same key
+    static uint32_t MaterialKey(const Material& mat) {
+        array<Texture*, MaterialSlotCount> textures = mat.GetTextures();
+        uint64_t hash = HashBytes(textures.data(), sizeof(textures));
+        return uint32_t(hash ^ hash >> 32);
+    }
+    // Whether everything queued can go out through FlushMultiDraw
+    bool CanMultiDraw() const {
+        if (!MultiDrawIndirect || !MergedGeometry::Enabled || !UseMaterialTables)
+            return false;
+        for (const QueuedDraw& draw: QueuedDraws)
+            if (!draw.TheModel->Merged || !draw.TheModel->Table)
+                return false;
+        return true;
+    }
+    // Draws what Draw() queued this stage, in key order unless !SortDraws
+    void FlushDraws() {
+        if (SortDraws)
+            Queue.Sort();
+        if (CanMultiDraw()) {
+            FlushMultiDraw();
+            Queue.Clear();
+            QueuedDraws.clear();
+            return;
+        }
+        DrawUniforms& uniforms = InGeometryStage ? GeometryDraw : ShadowmapDraw;
+        const mat4& viewProjection = InGeometryStage ? GeometryVPMat : ShadowmapVPMat;
+        const vec3 eye = InGeometryStage ? CameraPosition : Flashlight.GetPosition();
+        const float worldPerPixelAtUnitDistance = InGeometryStage ? WorldPerPixelAtUnitDistance
+            : 2 * tan(Flashlight.CutoffAng) / SHADOWMAP_SIZE;
+        MeshletStats& stats = InGeometryStage ? GeometryMeshletStats : ShadowmapMeshletStats;
+
+        // Meshlets are culled in model space
+        Frustum frustum(viewProjection * ModelMat);
+        vec3 modelEye;
+        bool haveModelMat = false;
+        const Model *boundModel = nullptr;
+        bool useTable = false;
+        for (const RenderQueue::Entry& entry: Queue.GetEntries()) {
+            const QueuedDraw& draw = QueuedDraws[entry.Item];
+            if (!haveModelMat || draw.ModelMat != ModelMat) {
+                SetModelMatrix(draw.ModelMat);
+                frustum = Frustum(viewProjection * ModelMat);
+                modelEye = vec3(inverse(ModelMat) * vec4(eye, 1));
+                haveModelMat = true;
+            }
+            Model& model = *draw.TheModel;
+            if (&model != boundModel) {
+                useTable = UseMaterialTables && model.Table;
+                if (useTable)
+                    model.Table->Bind();
+                else
+                    uniforms.MaterialID.Set(-1);
+                boundModel = &model;
+            }
+
+            const int i = draw.MeshIndex;
+            Mesh& mesh = *model.Meshes[i];
+            int lod = SelectLOD(mesh, eye, worldPerPixelAtUnitDistance);
+            if (!InGeometryStage)
+                lod += ShadowmapLODBias;
+            if (useTable)
+                uniforms.MaterialID.Set(i); // One material per mesh
+            else
+                SetMaterial(model.Materials[i]);
+            // Alpha clipped materials are drawn two sided, see SetCullFace
+            const bool cullBackfacing = !model.Materials[i].DiffuseMap->ShouldAlphaClip();
+            SetCullFace(cullBackfacing);
+            if (mesh.GetFormat() == CompactVertices) {
+                uniforms.PositionOffset.Set(mesh.GetPositionOffset());
+                uniforms.PositionScale.Set(mesh.GetPositionScale());
+            }
+            if (MeshletCulling)
+                mesh.DrawMeshlets(frustum, modelEye, cullBackfacing, stats, lod);
+            else
+                mesh.Draw(lod);
+        }
+        Queue.Clear();
+        QueuedDraws.clear();
+    }
+    // FlushDraws with two glMultiDrawElementsIndirect per model (their
+    // MaterialTable has to be bound in between), one for the single sided
+    // meshes with culling on and one for the two sided ones without. The
+    // culling and LOD choice are the same, every visible meshlet range
+    // becomes a command.
+    void FlushMultiDraw() {
+        const mat4& viewProjection = InGeometryStage ? GeometryVPMat : ShadowmapVPMat;
+        const vec3 eye = InGeometryStage ? CameraPosition : Flashlight.GetPosition();
+        const float worldPerPixelAtUnitDistance = InGeometryStage ? WorldPerPixelAtUnitDistance
+            : 2 * tan(Flashlight.CutoffAng) / SHADOWMAP_SIZE;
+        MeshletStats& stats = InGeometryStage ? GeometryMeshletStats : ShadowmapMeshletStats;
+
+        // Commands grouped by model and sidedness, in queue order within each
+        CommandScratch.clear();
+        DrawDataScratch.clear();
+        ModelCommandRanges.clear();
+        for (const RenderQueue::Entry& entry: Queue.GetEntries()) {
+            const Model *model = QueuedDraws[entry.Item].TheModel.get();
+            bool seen = false;
+            for (const ModelCommands& range: ModelCommandRanges)
+                seen |= range.TheModel == model;
+            if (!seen)
+                ModelCommandRanges.push_back({model, 0, 0, 0});
+        }
+        auto addCommands = [&](const Model *theModel, bool twoSided) {
+            Frustum frustum(viewProjection * ModelMat);
+            vec3 modelEye;
+            mat4 normalMat;
+            bool haveModelMat = false;
+            for (const RenderQueue::Entry& entry: Queue.GetEntries()) {
+                const QueuedDraw& draw = QueuedDraws[entry.Item];
+                if (draw.TheModel.get() != theModel)
+                    continue;
+                const Model& model = *draw.TheModel;
+                const int i = draw.MeshIndex;
+                // Alpha clipped materials are drawn two sided, see SetCullFace
+                const bool cullBackfacing = !model.Materials[i].DiffuseMap->ShouldAlphaClip();
+                if (cullBackfacing == twoSided)
+                    continue;
+                if (!haveModelMat || draw.ModelMat != ModelMat) {
+                    ModelMat = draw.ModelMat; // For SelectLOD, the uniforms aren't used
+                    frustum = Frustum(viewProjection * ModelMat);
+                    modelEye = vec3(inverse(ModelMat) * vec4(eye, 1));
+                    normalMat = mat4(transpose(inverse(mat3(ModelMat))));
+                    haveModelMat = true;
+                }
+                const Mesh& mesh = *model.Meshes[i];
+                int lod = SelectLOD(mesh, eye, worldPerPixelAtUnitDistance);
+                if (!InGeometryStage)
+                    lod += ShadowmapLODBias;
+                const DrawData data = {ModelMat, normalMat, mesh.GetPositionOffset(), i,
+                    mesh.GetPositionScale(), 0};
+                auto emit = [&](GLuint firstElement, GLsizei count) {
+                    CommandScratch.push_back({(GLuint)count, 1,
+                        model.Merged->FirstElement[i] + firstElement, model.Merged->BaseVertex[i], 0});
+                    DrawDataScratch.push_back(data);
+                };
+                if (MeshletCulling) {
+                    mesh.ForEachVisibleRange(frustum, modelEye, cullBackfacing, stats, lod, emit);
+                } else {
+                    GLuint firstElement;
+                    GLsizei count;
+                    mesh.GetLODRange(lod, firstElement, count);
+                    emit(firstElement, count);
+                }
+            }
+        };
+        for (ModelCommands& range: ModelCommandRanges) {
+            range.First = CommandScratch.size();
+            addCommands(range.TheModel, false);
+            range.TwoSided = CommandScratch.size();
+            addCommands(range.TheModel, true);
+            range.End = CommandScratch.size();
+        }
+        if (CommandScratch.empty())
+            return;
+
+        DrawUniforms& uniforms = InGeometryStage ? GeometryDraw : ShadowmapDraw;
+        const int pass = InGeometryStage;
+        DrawCommands[pass]->Upload(CommandScratch);
+        DrawDataBuffers[pass]->Upload(DrawDataScratch);
+        DrawCommands[pass]->Bind();
+        DrawDataBuffers[pass]->Bind();
+        uniforms.MultiDraw.Set(true);
+        for (const ModelCommands& range: ModelCommandRanges) {
+            if (range.End == range.First)
+                continue;
+            const Model& model = *range.TheModel;
+            model.Table->Bind();
+            if (range.TwoSided > range.First) {
+                SetCullFace(true);
+                uniforms.FirstDraw.Set((GLint)range.First);
+                model.Merged->Draw(range.First, range.TwoSided - range.First);
+            }
+            if (range.End > range.TwoSided) {
+                SetCullFace(false);
+                uniforms.FirstDraw.Set((GLint)range.TwoSided);
+                model.Merged->Draw(range.TwoSided, range.End - range.TwoSided);
+            }
+        }
+        uniforms.MultiDraw.Set(false);
+    }
+    // Sums up the point lights into LightAccum, a sphere per light. Only
+    // the back faces are drawn, depth tested against the G-buffer (GEQUAL,
+    // so it still works with the camera inside a sphere): the pixels behind
+    // a light's volume never run its shader.
+    void DrawLightVolumes() {
+        LightAccum->Bind();
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_GEQUAL);
+        glDepthMask(GL_FALSE);
+        glEnable(GL_DEPTH_CLAMP); // Back faces past the far plane
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+
+        LightVolumeStage->Use();
+        for (int buf=0; buf<DepthBuf; ++buf)
+            glBindTextureUnit(buf, GBuffer->GetTexture(buf));
+        LightVolume->DrawInstanced(Lights.size());
+
+        glDisable(GL_BLEND);
+        glCullFace(GL_BACK);
+        CullFace = -1;
+        glDisable(GL_DEPTH_CLAMP);
+        glDepthMask(GL_TRUE);
+        glDepthFunc(GL_LESS);
+        glDisable(GL_DEPTH_TEST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    // The one by one path, for models without a MaterialTable
+    void SetMaterial(const Material& mat) {
+        mat.DiffuseMap->Bind(DiffuseSlot);
+        mat.SpecularMap->Bind(SpecularSlot);
+        mat.NormalMap->Bind(NormalSlot);
+        mat.BumpMap->Bind(BumpSlot);
+        mat.TranslucencyMap->Bind(TranslucencySlot);
+    }
 public:
     float ParallaxDepth =0.04f;
     float Gamma =2.2;
@@ -212,7 +973,6 @@ public:
     bool VisualizeShadowmap = false;
     vec3 AmbientLight = vec3(1);
     vector<Light> Lights;
-    const int MAX_LIGHTS = 100; // Keep in sync with shader!
     const int SHADOWMAP_SIZE = 512;
     Spotlight Flashlight;
     float RSMSamplingRadius=0.1;
@@ -220,8 +980,24 @@ public:
     float RSMReflectionFact=0.5;
     bool VisualizeIndirectLighting = false;
     bool EnableIndirectLighting = true;    
+    int TextureUploadBudget = 4 << 20; // Bytes per frame, for texture streaming
+    bool MeshletCulling = true;
+    bool MeshCulling = true; // Whole meshes against the frustum, before queueing
+    bool UseMaterialTables = true; // Off = bind every material's textures one by one
+    bool SortDraws = true; // Off = draw meshes in the order they were queued
+    bool MultiDrawIndirect = true; // Off = a draw call per mesh, needs MergedGeometry::Enabled
+    LightCullingMode LightCulling = TiledLightCulling;
+    float LightCutoff = 0.01f; // Point lights count as 0 past where they fall below this
+    float LODErrorPixels = 1; // 0 = always full detail
+    // Extra levels for the low resolution RSM. Off by default: a coarser
+    // shadow caster than the receiver it falls on self-shadows without a
+    // depth bias to match.
+    int ShadowmapLODBias = 0;
+    MeshletStats ShadowmapMeshletStats, GeometryMeshletStats; // Of the last frame
+    MeshCullStats ShadowmapCullStats, GeometryCullStats; // Of the last frame
 
     DeferredRenderer() {
+        TRACE_SCOPE("DeferredRenderer()");
         RSM = make_shared<Framebuffer>(
             vector<GLuint>{GL_RGBA32F, GL_RGBA32F, GL_RGBA8},
             true, false, SHADOWMAP_SIZE, SHADOWMAP_SIZE
@@ -237,79 +1013,109 @@ public:
             glTextureParameterfv(RSM->GetTexture(buf), GL_TEXTURE_BORDER_COLOR, value_ptr(black));
         }
 
+        LightAccum = make_shared<Framebuffer>(vector<GLuint>{GL_RGBA16F}, false, true);
+        LightAccum->ShareDepthBuffer(GBuffer);
+
         ScreenQuad = MakeScreenQuadMesh();
+        LightVolume = MakeLightVolumeMesh(1);
 
-        ShadowmapStage = Load<Shader>("Data/shaders/RSM");
-        ShadowmapStage->SetUniform("DiffuseMap", 0);  
-        GeometryStage = Load<Shader>("Data/shaders/DRGeometry");
-        GeometryStage->SetUniform("DiffuseMap", 0);  
-        GeometryStage->SetUniform("SpecularMap", 1);  
-        GeometryStage->SetUniform("NormalMap", 2);  
-        GeometryStage->SetUniform("BumpMap", 3);           
-        GeometryStage->SetUniform("TranslucencyMap", 4);           
-        LightingStage = Load<Shader>("Data/shaders/DRLighting");
-        int unit = 0;
-        for (int buf=0;buf<DepthBuf; ++buf) {
-            LightingStage->SetUniform("GBuffer["+to_string(buf)+"]", unit++);
-        }
-        for (int buf=0;buf<RSMBufferCount; ++buf) {
-            LightingStage->SetUniform("RSM["+to_string(buf)+"]", unit++);
+        // Only submitted here, the three build in parallel. Samplers have
+        // their units in the shaders (layout binding), so nothing here
+        // waits for them, the first SetUniform does.
+        ShadowmapStage = TheResources->LoadNow<Shader>("Data/shaders/RSM").Get();
+        GeometryStage = TheResources->LoadNow<Shader>("Data/shaders/DRGeometry").Get();
+        LightingStage = TheResources->LoadNow<Shader>("Data/shaders/DRLighting").Get();
+        LightCullingStage = TheResources->LoadNow<Shader>("Data/shaders/LightCulling").Get();
+        LightVolumeStage = TheResources->LoadNow<Shader>("Data/shaders/LightVolume").Get();
+
+        FrameRing = make_shared<UniformRing<FrameUniforms>>(FRAME_UNIFORMS_BINDING);
+        ShadowmapDraw = DrawUniforms(ShadowmapStage.get());
+        GeometryDraw = DrawUniforms(GeometryStage.get());
+        LightList = make_shared<LightBuffer>(LIGHT_BUFFER_BINDING);
+        ClusterOffsetCounts = make_shared<StorageBuffer>(CLUSTER_OFFSET_COUNT_BINDING);
+        ClusterIndices = make_shared<StorageBuffer>(CLUSTER_INDEX_BINDING);
+        glCreateBuffers(OVERFLOW_LATENCY, TileOverflowBuffers);
+        for (GLuint buffer: TileOverflowBuffers)
+            glNamedBufferStorage(buffer, sizeof(TileOverflow), nullptr, GL_DYNAMIC_STORAGE_BIT);
+        for (int pass=0; pass<2; ++pass) {
+            DrawCommands[pass] = make_shared<StorageBuffer>(0, GL_DRAW_INDIRECT_BUFFER);
+            DrawDataBuffers[pass] = make_shared<StorageBuffer>(DRAW_DATA_BINDING);
         }
+    }
+    ~DeferredRenderer() {
+        glDeleteBuffers(1, &TileLightBuffer);
+        glDeleteBuffers(OVERFLOW_LATENCY, TileOverflowBuffers);
+        GPUMemory::Account(GPUMemory::FramebufferMemory, TileLightBufferBytes, 0);
+    }
+    DeferredRenderer(const DeferredRenderer&) = delete;
+    DeferredRenderer& operator=(const DeferredRenderer&) = delete;
 
-        VisualizeRSMBuffer(-1);
-        VisualizeBuffer(-1); // go straight to final render.
+    // Whether the shaders are done compiling
+    bool IsReady() {
+        return ShadowmapStage->IsReady() && GeometryStage->IsReady() && LightingStage->IsReady()
+            && LightCullingStage->IsReady() && LightVolumeStage->IsReady();
     }
     void Update(const Camera& camera) {
+        ++GPUMemory::Frame;
+        TextureBinds = Texture::BindCount;
+        Texture::BindCount = 0;
+        ProgramChanges = Shader::UseCount;
+        Shader::UseCount = 0;
+        VertexArrayBinds = Mesh::BindCount;
+        Mesh::BindCount = 0;
+        DrawCalls = Mesh::DrawCount;
+        Mesh::DrawCount = 0;
         GBuffer->Update();
+        LightAccum->Update(); // After GBuffer, shares its depth
         RSM->Update();
 
         ivec2 windowSize = TheEngine->GetWindowSize();
         float aspectRatio = (float)windowSize.x / windowSize.y;
-        mat4 projectionMat = perspective(radians(60.0f), aspectRatio, 0.1f, 250.0f);  
+        mat4 projectionMat = perspective(FOV, aspectRatio, 0.1f, 250.0f);  
         GeometryVPMat = projectionMat * camera.GetViewMatrix();
-        GeometryStage->SetUniform("MVPMat", GeometryVPMat);
-        GeometryStage->SetUniform("ModelMat", mat4(1));
-        GeometryStage->SetUniform("NormalMat", mat3(1));
-        GeometryStage->SetUniform("CameraPosition", camera.GetPosition());
+        CameraPosition = camera.GetPosition();
+        WorldPerPixelAtUnitDistance = 2 * tan(FOV / 2) / std::max(windowSize.y, 1);
         ShadowmapVPMat = perspective(2*Flashlight.CutoffAng, 1.0f, 0.1f, 250.0f) * Flashlight.GetViewMatrix();
-        ShadowmapStage->SetUniform("MVPMat", ShadowmapVPMat);
-        ShadowmapStage->SetUniform("ModelMat", mat4(1));
-        ShadowmapStage->SetUniform("NormalMat", mat3(1));
-        ShadowmapStage->SetUniform("FlashlightPosition", Flashlight.GetPosition());
-        ShadowmapStage->SetUniform("FlashlightDirection", Flashlight.GetDirection());
-        ShadowmapStage->SetUniform("FlashlightColor", Flashlight.Color);
-        ShadowmapStage->SetUniform("FlashlightCutoffAng", Flashlight.CutoffAng);        
-
-        GeometryStage->SetUniform("ParallaxDepth", ParallaxDepth);
-        GeometryStage->SetUniform("Gamma", Gamma);
-
-        LightingStage->SetUniform("AmbientLight", AmbientLight);
-        LightingStage->SetUniform("LightCount", std::min((int)Lights.size(), MAX_LIGHTS));
-        for (int i=0; i<std::min((int)Lights.size(),MAX_LIGHTS); ++i) {
-            LightingStage->SetUniform("Lights["+to_string(i)+"].Position", Lights[i].Position);
-            LightingStage->SetUniform("Lights["+to_string(i)+"].Color", Lights[i].Color);
-        }
-        LightingStage->SetUniform("FlashlightPosition", Flashlight.GetPosition());
-        LightingStage->SetUniform("FlashlightDirection", Flashlight.GetDirection());
-        LightingStage->SetUniform("FlashlightColor", Flashlight.Color);
-        LightingStage->SetUniform("FlashlightCutoffAng", Flashlight.CutoffAng);
-        LightingStage->SetUniform("CameraPosition", camera.GetPosition());
-        LightingStage->SetUniform("Gamma", Gamma);
-        LightingStage->SetUniform("FogDensity", FogDensity);
-        LightingStage->SetUniform("RaymarchSteps", RaymarchSteps);
-        LightingStage->SetUniform("Tonemap", Tonemap);
-        LightingStage->SetUniform("VisualizeShadowmap", VisualizeShadowmap);
-        LightingStage->SetUniform("ShadowmapVPMat", ShadowmapVPMat);
-        LightingStage->SetUniform("AttenConst", AttenConst);
-        LightingStage->SetUniform("AttenLin", AttenLin);
-        LightingStage->SetUniform("AttenQuad", AttenQuad);
-        LightingStage->SetUniform("RSMSamplingRadius", (float)RSMSamplingRadius);
-        LightingStage->SetUniform("RSMVPLCount", RSMVPLCount);
-        LightingStage->SetUniform("RSMReflectionFact", RSMReflectionFact);
-        LightingStage->SetUniform("VisualizeIndirectLighting", VisualizeIndirectLighting);
-        LightingStage->SetUniform("EnableIndirectLighting", EnableIndirectLighting);
+
+        ResizeTileLightBuffer(windowSize);
+
+        FrameUniforms frame;
+        frame.ShadowmapVPMat = ShadowmapVPMat;
+        frame.ViewMat = camera.GetViewMatrix();
+        frame.ProjectionMat = projectionMat;
+        frame.CameraPosition = camera.GetPosition();
+        frame.Gamma = Gamma;
+        frame.FlashlightPosition = Flashlight.GetPosition();
+        frame.FlashlightCutoffAng = Flashlight.CutoffAng;
+        frame.FlashlightDirection = Flashlight.GetDirection();
+        frame.FogDensity = FogDensity;
+        frame.FlashlightColor = Flashlight.Color;
+        frame.ParallaxDepth = ParallaxDepth;
+        frame.AmbientLight = AmbientLight;
+        frame.AttenConst = AttenConst;
+        frame.AttenLin = AttenLin;
+        frame.AttenQuad = AttenQuad;
+        frame.RSMSamplingRadius = RSMSamplingRadius;
+        frame.RSMReflectionFact = RSMReflectionFact;
+        frame.RSMVPLCount = RSMVPLCount;
+        frame.RaymarchSteps = RaymarchSteps;
+        frame.LightCount = Lights.size();
+        frame.VisualizeBuffer = VisualizedBuffer;
+        frame.VisualizeRSMBuffer = VisualizedRSMBuffer;
+        frame.Tonemap = Tonemap;
+        frame.VisualizeShadowmap = VisualizeShadowmap;
+        frame.VisualizeIndirectLighting = VisualizeIndirectLighting;
+        frame.EnableIndirectLighting = EnableIndirectLighting;
+        frame.LightCulling = LightCulling;
+        frame.TileCountX = TileCount.x;
+        frame.LightCutoff = LightCutoff;
+        FrameRing->Upload(frame);
+        LightList->Upload(Lights);
+        if (LightCulling == ClusteredLightCulling)
+            BuildClusters(frame.ViewMat, aspectRatio);
     }
     void SetModelMatrix(mat4 model) {
+        ModelMat = model;
         mat3 normalMat = mat3(transpose(inverse(mat3(model))));
         GeometryStage->SetUniform("NormalMat", normalMat);
         GeometryStage->SetUniform("ModelMat", model);
@@ -319,14 +1125,51 @@ public:
         ShadowmapStage->SetUniform("ModelMat", model);
     }
 
+    // Queues model's meshes, EndShadowmapStage/EndGeometryStage draw them
     void Draw(ModelPtr model) {
+        if (InGeometryStage)
+            RequestTextureLevels(model);
+        model->UpdateMaterialTable();
+
+        // Meshes outside the pass's frustum (the camera's, or the much
+        // narrower flashlight's) don't get queued at all
+        MeshCullStats& cullStats = InGeometryStage ? GeometryCullStats : ShadowmapCullStats;
+        MeshVisible.assign(model->Meshes.size(), 1);
+        if (MeshCulling && model->Bounds.Size() == model->Meshes.size()) {
+            Frustum frustum((InGeometryStage ? GeometryVPMat : ShadowmapVPMat) * ModelMat);
+            float planes[6][4];
+            for (int p=0; p<6; ++p)
+                memcpy(planes[p], value_ptr(frustum.Planes[p]), sizeof(planes[p]));
+            model->Bounds.Cull(planes, MeshVisible.data());
+        }
+
+        const unsigned pass = InGeometryStage ? 1 : 0;
+        const unsigned program = (InGeometryStage ? GeometryStage : ShadowmapStage)->GetProgram();
+        const vec3 eye = InGeometryStage ? CameraPosition : Flashlight.GetPosition();
         for (int i=0; i<model->Meshes.size(); ++i) {
-            SetMaterial(model->Materials[i]);
-            model->Meshes[i]->Draw();
+            GLuint firstElement;
+            GLsizei elementCount;
+            model->Meshes[i]->GetLODRange(0, firstElement, elementCount);
+            cullStats.Total++;
+            cullStats.TotalTriangles += elementCount / 3;
+            if (!MeshVisible[i]) {
+                cullStats.Culled++;
+                cullStats.CulledTriangles += elementCount / 3;
+                continue;
+            }
+            const Material& mat = model->Materials[i];
+            const float depth = DistanceTo(*model->Meshes[i], eye) / FAR_PLANE;
+            Queue.Submit(RenderQueue::MakeKey(pass, mat.DiffuseMap->ShouldAlphaClip(), program,
+                MaterialKey(mat), depth), QueuedDraws.size());
+            QueuedDraws.push_back({model, ModelMat, i});
         }
     }
     void BeginShadowmapStage() {
         SetModelMatrix(mat4(1.0f));
+        ShadowmapMeshletStats = MeshletStats();
+        ShadowmapCullStats = MeshCullStats();
+        CullFace = -1;
+        Texture::ForgetBindings();
         
         RSM->Bind();
 
@@ -338,10 +1181,15 @@ public:
         ShadowmapStage->Use();
     }
     void EndShadowmapStage() {
+        FlushDraws();
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
     }
     void BeginGeometryStage() {
         SetModelMatrix(mat4(1.0f));
+        GeometryMeshletStats = MeshletStats();
+        GeometryCullStats = MeshCullStats();
+        CullFace = -1;
+        Texture::ForgetBindings();
         
         GBuffer->Bind();
 
@@ -352,9 +1200,19 @@ public:
         glEnable(GL_DEPTH_TEST);
 
         GeometryStage->Use();
+        InGeometryStage = true;
+        GeometryTimer.Begin();
     }
     void EndGeometryStage() {
+        FlushDraws();
+        GeometryTimer.End();
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        InGeometryStage = false;
+        Texture::UpdateStreaming(TextureUploadBudget, MaterialTable::GetEvictableBytes());
+        MaterialTable::UpdateStreaming(TextureUploadBudget - std::min<size_t>(TextureUploadBudget,
+            Texture::Stats.UploadedBytes));
+        Texture::EnforceBudget();
+        MaterialTable::EnforceBudget();
     }
     void DoLightingStage() {
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -366,6 +1224,22 @@ public:
         glClear(GL_COLOR_BUFFER_BIT);
         glDisable(GL_DEPTH_TEST);
 
+        LightingTimer.Begin();
+        LightList->Bind();
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, TILE_LIGHT_BUFFER_BINDING, TileLightBuffer);
+        if (LightCulling == TiledLightCulling) {
+            LightCullingStage->Use();
+            CountTileOverflow();
+            glBindTextureUnit(0, GBuffer->GetTexture(DepthBuf));
+            glDispatchCompute(TileCount.x, TileCount.y, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        } else if (LightCulling == ClusteredLightCulling) {
+            ClusterOffsetCounts->Bind();
+            ClusterIndices->Bind();
+        } else if (LightCulling == LightVolumeCulling) {
+            DrawLightVolumes();
+        }
+
         LightingStage->Use();
 
         int unit=0;
@@ -375,13 +1249,57 @@ public:
         for (int buf=0; buf<RSMBufferCount; ++buf) {
             glBindTextureUnit(unit++, RSM->GetTexture(buf));
         }
+        glBindTextureUnit(unit++, LightAccum->GetTexture(0));
         ScreenQuad->Draw();
+        LightingTimer.End();
+        FrameRing->Fence();
+    }
+    double GetGeometryPassMs() const {
+        return GeometryTimer.GetMilliseconds();
+    }
+    double GetLightingPassMs() const {
+        return LightingTimer.GetMilliseconds();
+    }
+    // Of the last frame that was clustered
+    double GetClusterBuildMs() const {
+        return ClusterBuildMs;
+    }
+    size_t GetClusterLightIndexCount() const {
+        return Clusters.Result.Indices.size();
+    }
+    int GetFullClusterCount() const {
+        return Clusters.Result.FullClusters;
+    }
+    // Of a tiled frame a few frames back
+    int GetOverflowedTileCount() const {
+        return TileOverflow[0];
+    }
+    int GetOverflowedLightCount() const {
+        return TileOverflow[1];
+    }
+    int GetTileCount() const {
+        return TileCount.x * TileCount.y;
+    }
+    int GetTextureBinds() const {
+        return TextureBinds;
+    }
+    int GetProgramChanges() const {
+        return ProgramChanges;
+    }
+    int GetVertexArrayBinds() const {
+        return VertexArrayBinds;
+    }
+    int GetDrawCalls() const {
+        return DrawCalls;
+    }
+    size_t GetUploadedLightCount() const {
+        return LightList->GetUploadedCount();
     }
     void VisualizeBuffer(int buf) {
-        LightingStage->SetUniform("VisualizeBuffer", buf);
+        VisualizedBuffer = buf;
     }
     void VisualizeRSMBuffer(int buf) {
-        LightingStage->SetUniform("VisualizeRSMBuffer", buf);
+        VisualizedRSMBuffer = buf;
     }    
 };
 
@@ -407,6 +1325,90 @@ void AnimateLights(DeferredRenderer& rend) {
     }
 }
 
+// Times the lighting pass with each light culling mode, at a few light
+// counts. Every configuration gets WARMUP_FRAMES (GPUTimer results lag
+// behind) and is then averaged over MEASURE_FRAMES.
+// ---
+class LightingBenchmark {
+    static const int WARMUP_FRAMES = 10;
+    static const int MEASURE_FRAMES = 60;
+    static const int MODE_COUNT = 4; // DeferredRenderer::LightCullingMode
+    const vector<int> LightCounts = {100, 1000, 10000};
+
+    int Step = -1; // LightCounts[Step/MODE_COUNT], mode Step%MODE_COUNT. -1 = not running
+    int Frame = 0;
+    double SumMs = 0, SumBuildMs = 0;
+    double ModeMs[MODE_COUNT] = {};
+    double ClusterBuildMs = 0;
+    int TiledOverflowedTiles = 0; // Most in a frame of the tiled step
+    int FullClusters = 0; // Same for the clustered step
+    vector<Light> SavedLights;
+    DeferredRenderer::LightCullingMode SavedCulling = DeferredRenderer::TiledLightCulling;
+
+    void BeginStep(DeferredRenderer& rend) {
+        RandomizeLights(rend, LightCounts[Step/MODE_COUNT]);
+        rend.LightCulling = (DeferredRenderer::LightCullingMode)(Step % MODE_COUNT);
+        Frame = 0;
+        SumMs = 0;
+        SumBuildMs = 0;
+        if (Step % MODE_COUNT == DeferredRenderer::TiledLightCulling)
+            TiledOverflowedTiles = 0;
+        if (Step % MODE_COUNT == DeferredRenderer::ClusteredLightCulling)
+            FullClusters = 0;
+    }
+
+public:
+    vector<string> Results;
+
+    bool IsRunning() const { return Step >= 0; }
+    void Start(DeferredRenderer& rend) {
+        SavedLights = rend.Lights;
+        SavedCulling = rend.LightCulling;
+        Results.clear();
+        Step = 0;
+        BeginStep(rend);
+    }
+    // Once per frame
+    void Update(DeferredRenderer& rend) {
+        if (!IsRunning())
+            return;
+        if (++Frame <= WARMUP_FRAMES)
+            return;
+        SumMs += rend.GetLightingPassMs();
+        SumBuildMs += rend.GetClusterBuildMs();
+        if (Step % MODE_COUNT == DeferredRenderer::TiledLightCulling)
+            TiledOverflowedTiles = std::max(TiledOverflowedTiles, rend.GetOverflowedTileCount());
+        if (Step % MODE_COUNT == DeferredRenderer::ClusteredLightCulling)
+            FullClusters = std::max(FullClusters, rend.GetFullClusterCount());
+        if (Frame < WARMUP_FRAMES + MEASURE_FRAMES)
+            return;
+
+        ModeMs[Step % MODE_COUNT] = SumMs / MEASURE_FRAMES;
+        if (Step % MODE_COUNT == DeferredRenderer::ClusteredLightCulling)
+            ClusterBuildMs = SumBuildMs / MEASURE_FRAMES;
+        if (Step % MODE_COUNT == MODE_COUNT-1) {
+            char line[256];
+            snprintf(line, sizeof(line),
+                "%5d lights: full-screen %.2f ms, tiled %.2f ms (%d/%d tiles overflowed), clustered %.2f ms + %.2f ms CPU (%d/%d clusters full), volumes %.2f ms",
+                LightCounts[Step/MODE_COUNT], ModeMs[DeferredRenderer::NoLightCulling],
+                ModeMs[DeferredRenderer::TiledLightCulling],
+                TiledOverflowedTiles, rend.GetTileCount(),
+                ModeMs[DeferredRenderer::ClusteredLightCulling], ClusterBuildMs,
+                FullClusters, Clustering::Grid().ClusterCount(),
+                ModeMs[DeferredRenderer::LightVolumeCulling]);
+            Results.push_back(line);
+            cerr << line << endl;
+        }
+        if (++Step < LightCounts.size() * MODE_COUNT) {
+            BeginStep(rend);
+        } else {
+            Step = -1;
+            rend.Lights = SavedLights;
+            rend.LightCulling = SavedCulling;
+        }
+    }
+};
+
 void SyncFlashlightToCamera(DeferredRenderer& rend, Camera& cam) {
     rend.Flashlight.SetPosition( cam.GetPosition() );
     rend.Flashlight.SetPitch( cam.GetPitch());
@@ -418,9 +1420,64 @@ void RotateFlashlight(DeferredRenderer& rend) {
 }
 
 int main(int argc, char** argv) {
-    TheEngine = make_shared<Engine>();
+    Trace::SetThreadName("Main");
+    string traceFile = "startup_trace.json";
+    for (int i=1; i<argc; ++i) {
+        if (string(argv[i]) == "--no-texture-streaming")
+            Texture::StreamingEnabled = false;
+        if (string(argv[i]) == "--legacy-vertex-format")
+            Mesh::ModelVertexFormat = FloatVertices;
+        if (string(argv[i]) == "--gpu-budget-mb" && i+1 < argc)
+            GPUMemory::Budget = size_t(atoi(argv[++i])) << 20;
+        if (string(argv[i]) == "--trace-file" && i+1 < argc)
+            traceFile = argv[++i];
+        if (string(argv[i]) == "--no-trace")
+            Trace::SetEnabled(false);
+        if (string(argv[i]) == "--no-shader-cache")
+            Shader::BinaryCacheEnabled = false;
+        if (string(argv[i]) == "--no-texture-arrays")
+            MaterialTable::Enabled = false;
+        if (string(argv[i]) == "--no-multi-draw")
+            MergedGeometry::Enabled = false;
+    }
+
+    if (Mesh::ModelVertexFormat == CompactVertices)
+        Shader::Defines += "#define COMPACT_VERTICES\n";
+
+    {
+        TRACE_SCOPE("Engine()");
+        TheEngine = make_shared<Engine>();
+    }
+    // Multi-draws take their materials from the texture arrays and
+    // decode CompactVertices, gl_DrawIDARB is in no core version before 4.6
+    if (MergedGeometry::Enabled && (Mesh::ModelVertexFormat != CompactVertices
+        || !MaterialTable::Enabled || !glfwExtensionSupported("GL_ARB_shader_draw_parameters"))) {
+        cerr << "Multi-draw indirect unavailable, drawing mesh by mesh" << endl;
+        MergedGeometry::Enabled = false;
+    }
+    if (MergedGeometry::Enabled)
+        Shader::Defines += "#define MULTI_DRAW_INDIRECT\n";
+    TheThreadPool = make_shared<ThreadPool>();
+    TheResources = make_shared<ResourceManager>(*TheThreadPool);
+
+    // Draws as an empty model until it's loaded. Started before the
+    // renderer, so importing and texture decoding overlap the shader builds.
+    ModelHandle sponza = TheResources->Load<Model>("Data/models/sponza.obj", make_shared<Model>());
+    const double RESOURCE_FINALIZE_BUDGET_MS = 4.0;
+
     DeferredRenderer drenderer;
     drenderer.AmbientLight = vec3(0.05);
+    {
+        // Upload whatever finishes loading while the driver compiles
+        TRACE_SCOPE("Wait for shaders");
+        while (!drenderer.IsReady()) {
+            // Or the window goes unresponsive while a cold shader cache compiles.
+            // Closing it is seen by the first frame.
+            glfwPollEvents();
+            TheResources->Update(RESOURCE_FINALIZE_BUDGET_MS);
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
 
     FPSCamera camera;
     camera.SetPosition(vec3(0.0f, 2.0f, 2.0f));  
@@ -433,9 +1490,19 @@ int main(int argc, char** argv) {
                               // otherwise fbo incomplete
                               // maybe due to window size.
 
-    ModelPtr sponza = Load<Model>("Data/models/sponza.obj");
+    bool firstFrame = true, sponzaReady = false;
 
     while (TheEngine->Run()) {
+        if (firstFrame) {
+            Trace::Instant("First frame");
+            firstFrame = false;
+        }
+        if (!sponzaReady && sponza.IsReady()) {
+            Trace::Instant("Model ready");
+            sponzaReady = true;
+        }
+        TheResources->Update(RESOURCE_FINALIZE_BUDGET_MS);
+
         { // Imgui widgets...
         ImGui::DragFloat("Parallax depth",&drenderer.ParallaxDepth,
             0.01f, 0, 0.2f, "%f", 1.0f); 
@@ -462,10 +1529,45 @@ int main(int argc, char** argv) {
             drenderer.VisualizeRSMBuffer(-1);
         }
         static int lightCount = 16;
-        ImGui::SliderInt("Light count", &lightCount, 0, drenderer.MAX_LIGHTS);
+        ImGui::SliderInt("Light count", &lightCount, 0, 65536, "%d", ImGuiSliderFlags_Logarithmic);
         if (ImGui::Button("Randomize lights")) {
             RandomizeLights(drenderer, lightCount);
         }
+        ImGui::Text("%zu lights, %zu uploaded last frame", drenderer.Lights.size(),
+            drenderer.GetUploadedLightCount());
+        int lightCulling = drenderer.LightCulling;
+        if (ImGui::Combo("Light culling", &lightCulling, "Off\0Tiled (GPU)\0Clustered (CPU)\0Light volumes\0"))
+            drenderer.LightCulling = (DeferredRenderer::LightCullingMode)lightCulling;
+        // InfluenceRadius divides by the cutoff
+        ImGui::SliderFloat("Light cutoff", &drenderer.LightCutoff, 1e-4f, 0.1f, "%.4f",
+            ImGuiSliderFlags_Logarithmic | ImGuiSliderFlags_AlwaysClamp);
+        ImGui::Text("Lighting pass: %.2f ms (GPU)", drenderer.GetLightingPassMs());
+        if (drenderer.LightCulling == DeferredRenderer::ClusteredLightCulling) {
+            ImGui::Text("Cluster build: %.2f ms (CPU, %u threads), %zu light indices",
+                drenderer.GetClusterBuildMs(), TheThreadPool->GetThreadCount(),
+                drenderer.GetClusterLightIndexCount());
+            if (drenderer.GetFullClusterCount() > 0) {
+                ImGui::TextColored(ImVec4(1,0.5f,0,1),
+                    "%d/%d clusters full, they keep their %u brightest lights",
+                    drenderer.GetFullClusterCount(), Clustering::Grid().ClusterCount(),
+                    Clustering::MAX_LIGHTS_PER_CLUSTER);
+            }
+        }
+        if (drenderer.LightCulling == DeferredRenderer::TiledLightCulling
+            && drenderer.GetOverflowedTileCount() > 0) {
+            ImGui::TextColored(ImVec4(1,0.5f,0,1),
+                "%d/%d tiles over %d lights (%d more), shaded with every light",
+                drenderer.GetOverflowedTileCount(), drenderer.GetTileCount(),
+                MAX_LIGHTS_PER_TILE, drenderer.GetOverflowedLightCount());
+        }
+        static LightingBenchmark benchmark;
+        if (benchmark.IsRunning())
+            ImGui::Text("Benchmarking...");
+        else if (ImGui::Button("Benchmark lighting (100/1k/10k lights)"))
+            benchmark.Start(drenderer);
+        for (const string& line: benchmark.Results)
+            ImGui::Text("%s", line.c_str());
+        benchmark.Update(drenderer);
         ImGui::ColorEdit3("Ambient light", value_ptr(drenderer.AmbientLight));
         static bool animateLights = true;
         ImGui::Checkbox("Animate lights", &animateLights);
@@ -495,6 +1597,51 @@ int main(int argc, char** argv) {
         ImGui::SliderInt("VPL Count", &drenderer.RSMVPLCount, 0, 128);
         ImGui::Checkbox("Enable Indirect Light", &drenderer.EnableIndirectLighting);
         ImGui::Checkbox("Visualize Just Indirect Light", &drenderer.VisualizeIndirectLighting);
+        if (Texture::StreamingEnabled) {
+            ImGui::SliderInt("Texture upload budget (bytes/frame)", &drenderer.TextureUploadBudget,
+                64 << 10, 64 << 20);
+        }
+        static int gpuBudgetMiB = GPUMemory::Budget >> 20;
+        if (ImGui::SliderInt("GPU memory budget (MiB, 0 = unlimited)", &gpuBudgetMiB, 0, 2048))
+            GPUMemory::Budget = size_t(gpuBudgetMiB) << 20;
+        ImGui::Text("GPU memory: %.1f MiB (peak %.1f MiB)",
+            GPUMemory::TotalBytes() / 1048576.0, GPUMemory::PeakBytes / 1048576.0);
+        ImGui::Text("Textures %.1f MiB, meshes %.1f MiB, framebuffers %.1f MiB",
+            GPUMemory::Bytes[GPUMemory::TextureMemory] / 1048576.0,
+            GPUMemory::Bytes[GPUMemory::MeshMemory] / 1048576.0,
+            GPUMemory::Bytes[GPUMemory::FramebufferMemory] / 1048576.0);
+        ImGui::Text("Streamed: %.1f KiB last frame, %d textures pending, %.1f KiB evicted",
+            Texture::Stats.UploadedBytes / 1024.0, Texture::Stats.PendingTextures,
+            Texture::Stats.EvictedBytes / 1024.0);
+        ImGui::Text("Geometry pass: %.2f ms (GPU)", drenderer.GetGeometryPassMs());
+        ImGui::Checkbox("Mesh frustum culling", &drenderer.MeshCulling);
+        ImGui::Checkbox("Meshlet culling", &drenderer.MeshletCulling);
+        if (MaterialTable::Enabled)
+            ImGui::Checkbox("Material texture arrays", &drenderer.UseMaterialTables);
+        ImGui::Checkbox("Sort draws", &drenderer.SortDraws);
+        if (MergedGeometry::Enabled)
+            ImGui::Checkbox("Multi-draw indirect", &drenderer.MultiDrawIndirect);
+        ImGui::Text("State changes last frame: %d programs, %d textures, %d vertex arrays",
+            drenderer.GetProgramChanges(), drenderer.GetTextureBinds(),
+            drenderer.GetVertexArrayBinds());
+        ImGui::Text("Draw calls last frame: %d", drenderer.GetDrawCalls());
+        ImGui::SliderFloat("LOD error (pixels, 0 = full detail)", &drenderer.LODErrorPixels, 0, 8);
+        ImGui::SliderInt("Shadowmap LOD bias", &drenderer.ShadowmapLODBias, 0, 3);
+        for (auto pass: {make_pair("Shadowmap", &drenderer.ShadowmapCullStats),
+                         make_pair("Geometry", &drenderer.GeometryCullStats)}) {
+            const MeshCullStats& stats = *pass.second;
+            ImGui::Text("%s: %d/%d meshes culled, %zu/%zu triangles (full detail)",
+                pass.first, stats.Culled, stats.Total, stats.CulledTriangles, stats.TotalTriangles);
+        }
+        for (auto pass: {make_pair("Shadowmap", &drenderer.ShadowmapMeshletStats),
+                         make_pair("Geometry", &drenderer.GeometryMeshletStats)}) {
+            const MeshletStats& stats = *pass.second;
+            ImGui::Text("%s: %d/%d meshlets culled (%d frustum, %d backface), %zu/%zu triangles drawn",
+                pass.first, stats.FrustumCulled + stats.BackfaceCulled, stats.Total,
+                stats.FrustumCulled, stats.BackfaceCulled, stats.DrawnTriangles, stats.TotalTriangles);
+        }
+        if (int pending = TheResources->GetPendingCount())
+            ImGui::Text("Loading %d resources...", pending);
         }
 
         camera.Update();
@@ -502,14 +1649,25 @@ int main(int argc, char** argv) {
 
         drenderer.BeginShadowmapStage();
             drenderer.SetModelMatrix(scale(vec3(0.01f)));
-            drenderer.Draw(sponza);
+            drenderer.Draw(sponza.Get());
         drenderer.EndShadowmapStage();
 
         drenderer.BeginGeometryStage();
             drenderer.SetModelMatrix(scale(vec3(0.01f)));
-            drenderer.Draw(sponza);
+            drenderer.Draw(sponza.Get());
         drenderer.EndGeometryStage();
         
         drenderer.DoLightingStage();
     }
+
+    // The pool stops first, so no job touches the resources as they go
+    TheThreadPool.reset();
+    TheResources.reset();
+
+    if (Trace::IsEnabled()) {
+        if (Trace::Write(traceFile))
+            cerr << "Wrote startup trace to " << traceFile << endl;
+        else
+            cerr << "Couldn't write trace " << traceFile << endl;
+    }
 }
@@ -1,4 +1,14 @@
 #include <stdio.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -11,10 +21,19 @@
 #include <assimp/postprocess.h>
 #include <assimp/IOStream.hpp>
 #include <assimp/IOSystem.hpp>
+#include <assimp/DefaultIOSystem.h>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
 #include "stb_image.h"
+#include "threadpool.hpp"
+#include "resources.hpp"
+#include "ktx2.hpp"
+#include "meshprocessing.hpp"
+#include "trace.hpp"
+#include "clustering.hpp"
+#include "culling.hpp"
+#include "renderqueue.hpp"
 #include <array>
 #include <algorithm>
 #include <vector>
@@ -24,6 +43,11 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
 using namespace glm;
 using namespace std;
 
@@ -39,7 +63,18 @@ typedef shared_ptr<Mesh> MeshPtr;
 typedef shared_ptr<Shader> ShaderPtr;
 typedef shared_ptr<FPSCamera> FPSCameraPtr;
 typedef shared_ptr<Engine> EnginePtr;
+typedef shared_ptr<ThreadPool> ThreadPoolPtr;
+typedef shared_ptr<ResourceManager> ResourceManagerPtr;
+typedef Handle<Texture> TextureHandle;
+typedef Handle<Model> ModelHandle;
+typedef Handle<Shader> ShaderHandle;
+// main() resets TheThreadPool and then TheResources before it returns,
+// while there's still a GL context and the class statics the resources
+// unregister from (Texture::StreamingTextures, MaterialTable::Tables)
+// are alive. Static teardown order doesn't protect those.
 EnginePtr TheEngine;
+ResourceManagerPtr TheResources;
+ThreadPoolPtr TheThreadPool;
 
 // * Sets everything up (gl/glfw/imgui)
 // * Handles glfw callbacks
@@ -87,16 +122,24 @@ public:
             cerr << "GLFW error (" << code << ")" << msg << endl;
             abort();
         });
-        glfwInit();
+        {
+            TRACE_SCOPE("glfwInit");
+            glfwInit();
+        }
         glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
         glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
         glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
         glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
         glfwWindowHint(GLFW_DOUBLEBUFFER, GLFW_TRUE);
-        Window = glfwCreateWindow(640, 480, "RG-Projekat", 0, 0);
-
-        glfwMakeContextCurrent(Window);
-        gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+        {
+            TRACE_SCOPE("Create window and GL context");
+            Window = glfwCreateWindow(640, 480, "RG-Projekat", 0, 0);
+            glfwMakeContextCurrent(Window);
+        }
+        {
+            TRACE_SCOPE("Load GL functions");
+            gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+        }
         glEnable(GL_DEBUG_OUTPUT);
         glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
         glDebugMessageCallback([](GLenum source, GLenum type, GLuint id,
@@ -136,6 +179,7 @@ public:
         // https://blog.conan.io/2019/06/26/An-introduction-to-the-Dear-ImGui-library.html
         // Init imgui
         // ----------
+        TRACE_SCOPE("Init ImGui");
         IMGUI_CHECKVERSION();
         Gui = ImGui::CreateContext();
         ImGui_ImplGlfw_InitForOpenGL(Window, true);
@@ -270,61 +314,743 @@ public:
     }
 };
 
+// View frustum planes pulled out of a clip matrix (Gribb & Hartmann,
+// "Fast Extraction of Viewing Frustum Planes from the World-View-Projection
+// Matrix"). Planes are in whatever space the matrix takes as input, so
+// projection * view * model gives model space planes.
+// ---
+struct Frustum {
+    vec4 Planes[6]; // xyz = inward normal, w = distance
+
+    Frustum(const mat4& clip) {
+        mat4 rows = transpose(clip);
+        for (int i=0; i<3; ++i) {
+            Planes[2*i] = rows[3] + rows[i];
+            Planes[2*i + 1] = rows[3] - rows[i];
+        }
+        for (vec4& plane: Planes)
+            plane /= length(vec3(plane));
+    }
+    bool Intersects(vec3 center, float radius) const {
+        for (const vec4& plane: Planes)
+            if (dot(vec3(plane), center) + plane.w < -radius)
+                return false;
+        return true;
+    }
+};
+
+// Read-only memory mapping of a whole file
+// ---------------
+class MappedFile {
+    const uint8_t *Data = nullptr;
+    size_t Size = 0;
+#ifdef _WIN32
+    HANDLE File = INVALID_HANDLE_VALUE;
+    HANDLE Mapping = 0;
+#endif
+
+public:
+    MappedFile(string path) {
+#ifdef _WIN32
+        File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (File == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(File, &size) || size.QuadPart == 0)
+            return;
+        Mapping = CreateFileMappingA(File, 0, PAGE_READONLY, 0, 0, 0);
+        if (!Mapping)
+            return;
+        Data = (const uint8_t*)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+        if (Data)
+            Size = size.QuadPart;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                Data = (const uint8_t*)p;
+                Size = st.st_size;
+            }
+        }
+        close(fd); // The mapping stays valid
+#endif
+    }
+    ~MappedFile() {
+#ifdef _WIN32
+        if (Data) UnmapViewOfFile(Data);
+        if (Mapping) CloseHandle(Mapping);
+        if (File != INVALID_HANDLE_VALUE) CloseHandle(File);
+#else
+        if (Data) munmap((void*)Data, Size);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool IsOpen() const { return Data != nullptr; }
+    const uint8_t *GetData() const { return Data; }
+    size_t GetSize() const { return Size; }
+};
+
+// 64-bit FNV-1a, good enough to detect changed source files
+uint64_t HashBytes(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+    const uint8_t *bytes = (const uint8_t*)data;
+    for (size_t i=0; i<size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+double MillisecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// GPU memory accounting
+// * Texture, Mesh and Framebuffer report every allocation they make
+// * When over Budget, textures drop their top mips, least recently
+//   drawn first (see Texture::EnforceBudget)
+// ---
+struct GPUMemory {
+    enum Category {
+        TextureMemory,
+        MeshMemory,
+        FramebufferMemory,
+
+        CategoryCount
+    };
+    static array<size_t, CategoryCount> Bytes;
+    static size_t PeakBytes;
+    static size_t Budget; // 0 = unlimited
+    static uint64_t Frame; // Advanced once per frame, for LRU
+
+    static size_t TotalBytes() {
+        size_t total = 0;
+        for (size_t bytes: Bytes)
+            total += bytes;
+        return total;
+    }
+    static void Account(Category category, size_t oldBytes, size_t newBytes) {
+        Bytes[category] += newBytes;
+        Bytes[category] -= oldBytes;
+        PeakBytes = std::max(PeakBytes, TotalBytes());
+    }
+};
+
+array<size_t, GPUMemory::CategoryCount> GPUMemory::Bytes = {0};
+size_t GPUMemory::PeakBytes = 0;
+size_t GPUMemory::Budget = 0;
+uint64_t GPUMemory::Frame = 0;
+
+// S3TC isn't core GL, glad was generated without extensions
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// Decoded texture pixels, waiting for upload
+// * Decoding is pure CPU work and can happen on any thread
+// * A cooked .ktx2 next to the source (see texcooker.cpp) is used instead
+//   of the source image, unless the source is newer
+// ---
+struct TextureImage {
+    string Path;
+    int Width = 0;
+    int Height = 0;
+    int Channels = 0;
+    shared_ptr<GLubyte> Pixels; // Always RGBA8, null if decoding failed
+    vector<vector<GLubyte>> Mips; // Levels 1.., only built for streaming
+    shared_ptr<MappedFile> CookedFile;
+    Ktx2::Image Cooked; // Points into CookedFile
+    double DecodeMs = 0;
+
+    bool IsCooked() const { return CookedFile != nullptr; }
+
+    // 2x2 box filter, RGBA8
+    static vector<GLubyte> Downsample(const GLubyte *src, int w, int h) {
+        int dw = std::max(1, w/2), dh = std::max(1, h/2);
+        vector<GLubyte> dst(size_t(dw) * dh * 4);
+        for (int y=0; y<dh; ++y) {
+            int y0 = std::min(2*y, h-1), y1 = std::min(2*y+1, h-1);
+            for (int x=0; x<dw; ++x) {
+                int x0 = std::min(2*x, w-1), x1 = std::min(2*x+1, w-1);
+                for (int c=0; c<4; ++c) {
+                    int sum = src[(y0*w + x0)*4 + c] + src[(y0*w + x1)*4 + c]
+                        + src[(y1*w + x0)*4 + c] + src[(y1*w + x1)*4 + c];
+                    dst[(size_t(y)*dw + x)*4 + c] = (sum + 2) / 4;
+                }
+            }
+        }
+        return dst;
+    }
+
+    static bool IsCookedUpToDate(string path, string cookedPath) {
+        error_code ec;
+        auto cookedTime = filesystem::last_write_time(cookedPath, ec);
+        if (ec)
+            return false;
+        auto sourceTime = filesystem::last_write_time(path, ec);
+        return ec || cookedTime >= sourceTime;
+    }
+
+    // buildMips: keep the full chain on the CPU, so mip levels can be
+    // uploaded later (cooked files always have one)
+    static TextureImage Decode(string path, bool buildMips, bool allowCooked = true) {
+        TRACE_SCOPE("Decode " + path);
+        auto start = chrono::steady_clock::now();
+        TextureImage image;
+        image.Path = path;
+
+        string cookedPath = Ktx2::PathFor(path);
+        if (allowCooked && IsCookedUpToDate(path, cookedPath)) {
+            auto file = make_shared<MappedFile>(cookedPath);
+            if (file->IsOpen() && Ktx2::Parse(file->GetData(), file->GetSize(), image.Cooked)) {
+                image.CookedFile = file;
+                image.Width = image.Cooked.Width;
+                image.Height = image.Cooked.Height;
+                image.Channels = image.Cooked.SourceChannels;
+                image.DecodeMs = MillisecondsSince(start);
+                return image;
+            }
+            cerr << "Ignoring broken " << cookedPath << endl;
+        }
+
+        GLubyte *pixels = stbi_load(path.c_str(), &image.Width, &image.Height, &image.Channels, 4);
+        if (pixels)
+            image.Pixels = shared_ptr<GLubyte>(pixels, stbi_image_free);
+        if (pixels && buildMips) {
+            const GLubyte *src = pixels;
+            int w = image.Width, h = image.Height;
+            while (w > 1 || h > 1) {
+                image.Mips.push_back(Downsample(src, w, h));
+                src = image.Mips.back().data();
+                w = std::max(1, w/2);
+                h = std::max(1, h/2);
+            }
+        }
+        image.DecodeMs = MillisecondsSince(start);
+        return image;
+    }
+};
+
+// * Cooked (.ktx2) textures come with their mip chain, others use
+//   glGenerateTextureMipmap
+// * In streaming mode only the smallest mips are uploaded at first.
+//   Draws ask for finer levels (RequestLevel), UpdateStreaming uploads
+//   them within a per-frame byte budget.
+// * Streaming textures that haven't been bound for a while give their top
+//   mips back when GPUMemory is over budget. Drawing them again requests
+//   the levels back, like any other streaming texture.
+// * The CPU copy only keeps the levels that aren't on the GPU. Evicted
+//   levels get decoded from the file again, on a worker.
+// ---
 class Texture {
-    GLuint TextureID;
+    GLuint TextureID = 0;
     bool HasAlphaChannel = false;
+    GLenum Format = GL_RGBA8;
+    uint32_t CookedFormat = 0; // VkFormat, 0 for uncompressed
+    int Width = 0;
+    int Height = 0;
+    int LevelCount = 1;
+
+    // Only levels [ResidentLevel, LevelCount) live on the GPU, as levels
+    // [0, LevelCount-ResidentLevel) of TextureID. Source keeps the rest on
+    // the CPU (or mapped from the cooked file).
+    bool Streaming = false;
+    TextureImage Source;
+    bool HasSource = false; // Kept after packing, the table streams from it
+    // Source has levels [0, SourceLevels), ReleaseSource drops the ones the
+    // GPU has. Getting them back means decoding the file again.
+    int SourceLevels = 0;
+    struct SourceReload {
+        atomic<bool> Done{false};
+        TextureImage Image;
+    };
+    shared_ptr<SourceReload> Reload; // In flight on a worker
+    int ResidentLevel = 0;
+    int WantedLevel = 0; // Finest level asked for since the last update
+    uint64_t LastUsedFrame = 0;
+    bool Packed = false; // A view of a MaterialTable layer, see PackInto
+    GLuint PackedArray = 0; // The array it's a view of, its table streams it
+
+    static vector<Texture*> StreamingTextures;
+
+    static bool SupportsBC() {
+        static bool supported = glfwExtensionSupported("GL_EXT_texture_compression_s3tc");
+        return supported;
+    }
+    // The sRGB formats upload as UNORM too, the geometry stage linearizes
+    // diffuse maps itself (see the Gamma slider)
+    static GLenum GLFormatFor(uint32_t vkFormat) {
+        switch (vkFormat) {
+            case Ktx2::BC1_RGB_UNORM: case Ktx2::BC1_RGB_SRGB: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+            case Ktx2::BC3_UNORM: case Ktx2::BC3_SRGB: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+            case Ktx2::BC4_UNORM: return GL_COMPRESSED_RED_RGTC1;
+            case Ktx2::BC5_UNORM: return GL_COMPRESSED_RG_RGTC2;
+            default: return 0;
+        }
+    }
+
+    int LevelWidth(int level) const { return std::max(1, Width >> level); }
+    int LevelHeight(int level) const { return std::max(1, Height >> level); }
+    size_t LevelBytes(int level) const {
+        if (CookedFormat)
+            return Ktx2::LevelBytes(CookedFormat, LevelWidth(level), LevelHeight(level));
+        return size_t(LevelWidth(level)) * LevelHeight(level) * 4;
+    }
+    size_t BytesFrom(int level) const {
+        size_t bytes = 0;
+        for (; level<LevelCount; ++level)
+            bytes += LevelBytes(level);
+        return bytes;
+    }
+    void Account(size_t oldBytes, size_t newBytes) {
+        GPUMemory::Account(GPUMemory::TextureMemory, oldBytes, newBytes);
+    }
+    // Coarsest level streaming starts at, eviction never goes below it
+    int TailLevel() const {
+        int level = 0;
+        while (level < LevelCount-1
+            && std::max(LevelWidth(level), LevelHeight(level)) > STREAMING_INITIAL_SIZE)
+            ++level;
+        return level;
+    }
+    // What dropping down to the tail would give back, for textures
+    // not drawn this frame
+    size_t EvictableBytes() const {
+        if (!Streaming || LastUsedFrame >= GPUMemory::Frame || ResidentLevel >= TailLevel())
+            return 0;
+        return BytesFrom(ResidentLevel) - BytesFrom(TailLevel());
+    }
+
+    void ApplySamplerState() {
+        ApplySamplerState(TextureID, Format);
+    }
+    // Pixels of level in image, bytes is only set for cooked (compressed) ones
+    const void *LevelPixels(const TextureImage& image, int level, GLsizei& bytes) const {
+        if (CookedFormat) {
+            bytes = image.Cooked.Levels[level].second;
+            return image.Cooked.Levels[level].first;
+        }
+        bytes = 0;
+        return level == 0 ? image.Pixels.get() : image.Mips[level-1].data();
+    }
+    void UploadLevel(const TextureImage& image, int level) {
+        const int gpuLevel = level - ResidentLevel;
+        GLsizei bytes;
+        const void *pixels = LevelPixels(image, level, bytes);
+        if (CookedFormat) {
+            glCompressedTextureSubImage2D(TextureID, gpuLevel, 0, 0,
+                LevelWidth(level), LevelHeight(level), Format, bytes, pixels);
+        } else {
+            glTextureSubImage2D(TextureID, gpuLevel, 0, 0,
+                LevelWidth(level), LevelHeight(level), GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        }
+    }
+
+    // Reallocates the GPU texture to hold [level, LevelCount), keeping the
+    // levels both versions share and uploading the missing ones, then
+    // drops those from Source. Going finer needs HasSourceFrom(level).
+    void SetResidentLevel(int level) {
+        level = clamp(level, 0, LevelCount-1);
+        if (level == ResidentLevel)
+            return;
+        GLuint newID;
+        glCreateTextures(GL_TEXTURE_2D, 1, &newID);
+        glTextureStorage2D(newID, LevelCount - level, Format, LevelWidth(level), LevelHeight(level));
+        for (int l=std::max(level, ResidentLevel); l<LevelCount; ++l) {
+            glCopyImageSubData(
+                TextureID, GL_TEXTURE_2D, l - ResidentLevel, 0, 0, 0,
+                newID, GL_TEXTURE_2D, l - level, 0, 0, 0,
+                LevelWidth(l), LevelHeight(l), 1);
+        }
+        ForgetBinding(TextureID);
+        glDeleteTextures(1, &TextureID);
+        TextureID = newID;
+
+        const int oldLevel = ResidentLevel;
+        const size_t oldBytes = BytesFrom(oldLevel);
+        ResidentLevel = level;
+        for (int l=level; l<oldLevel; ++l)
+            UploadLevel(Source, l);
+        ReleaseSource(level);
+        ApplySamplerState();
+        Account(oldBytes, BytesFrom(level));
+    }
+
+    // What Bind() last put on each unit, so binding it again is free
+    static const int CACHED_UNITS = 16;
+    static GLuint BoundTextures[CACHED_UNITS];
+    static void ForgetBinding(GLuint id) {
+        for (GLuint& bound: BoundTextures)
+            if (bound == id)
+                bound = 0;
+    }
 
 public:
-    Texture(string path) {
+    // Start out with just the levels this size and smaller
+    static const int STREAMING_INITIAL_SIZE = 64;
+    static bool StreamingEnabled;
+    static int BindCount; // Actual binds by Bind(), the renderer resets it every frame
+
+    // Also for the texture arrays of MaterialTable, which hold textures of
+    // one format each
+    static void ApplySamplerState(GLuint id, GLenum format) {
+        glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        if (format == GL_COMPRESSED_RED_RGTC1) {
+            // Grayscale source, read back as gray like stb would expand it
+            glTextureParameteri(id, GL_TEXTURE_SWIZZLE_G, GL_RED);
+            glTextureParameteri(id, GL_TEXTURE_SWIZZLE_B, GL_RED);
+        }
+    }
+
+    struct StreamingStats {
+        size_t UploadedBytes = 0; // During the last UpdateStreaming, whole arrays for MaterialTable
+        size_t EvictedBytes = 0; // During the last EnforceBudget
+        int PendingTextures = 0; // Still below the wanted level
+    };
+    static StreamingStats Stats;
+
+    // For TheResources, decoding runs on a worker
+    typedef TextureImage Prepared;
+    static TextureImage Prepare(string path) {
+        return TextureImage::Decode(path, StreamingEnabled);
+    }
+
+    Texture(string path): Texture(Prepare(path)) {}
+    Texture(const TextureImage& decoded) {
+        TRACE_SCOPE("Upload " + decoded.Path);
+        const TextureImage *imagep = &decoded;
+        TextureImage fallback;
+        if (decoded.IsCooked() && !SupportsBC()) {
+            cerr << "No BC texture support, decoding " << decoded.Path << " instead" << endl;
+            fallback = TextureImage::Decode(decoded.Path, StreamingEnabled, false);
+            imagep = &fallback;
+        }
+        const TextureImage& image = *imagep;
+
         glCreateTextures(GL_TEXTURE_2D, 1, &TextureID);
-        int w, h;
-        cerr << "Loading texture from " << path << endl;
-        int channels;
-        GLubyte *pixels = stbi_load(path.c_str(), &w, &h, &channels, 4);
-        if (!pixels) {
+        cerr << "Loading texture from " << image.Path << (image.IsCooked() ? " (cooked)" : "") << endl;
+        if (!image.Pixels && !image.IsCooked()) {
             cerr << "Failed!" << endl;
             abort();
         }
-        if (channels == 4)
+        Width = image.Width;
+        Height = image.Height;
+        if (image.Channels == 4)
             HasAlphaChannel = true;
-        int levels = std::max(1, (int)log2((double)w));
-        glTextureParameteri(TextureID, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTextureParameteri(TextureID, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTextureStorage2D(TextureID, levels, GL_RGBA8, w, h);
-        glTextureSubImage2D(TextureID, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-        glGenerateTextureMipmap(TextureID);
+
+        if (!image.IsCooked() && image.Mips.empty()) {
+            // Plain upload, the GPU builds the mips
+            LevelCount = std::max(1, (int)log2((double)Width));
+            glTextureStorage2D(TextureID, LevelCount, GL_RGBA8, Width, Height);
+            glTextureSubImage2D(TextureID, 0, 0, 0, Width, Height, GL_RGBA, GL_UNSIGNED_BYTE, image.Pixels.get());
+            glGenerateTextureMipmap(TextureID);
+            ApplySamplerState();
+            Account(0, BytesFrom(0));
+            return;
+        }
+
+        if (image.IsCooked()) {
+            CookedFormat = image.Cooked.VkFormat;
+            Format = GLFormatFor(CookedFormat);
+            LevelCount = image.Cooked.Levels.size();
+        } else {
+            LevelCount = image.Mips.size() + 1;
+        }
+        Streaming = StreamingEnabled;
+        ResidentLevel = 0;
+        if (Streaming) {
+            Source = image;
+            HasSource = true;
+            SourceLevels = LevelCount;
+            ResidentLevel = TailLevel();
+            StreamingTextures.push_back(this);
+        }
+        WantedLevel = LevelCount;
+        glTextureStorage2D(TextureID, LevelCount - ResidentLevel, Format,
+            LevelWidth(ResidentLevel), LevelHeight(ResidentLevel));
+        for (int level=ResidentLevel; level<LevelCount; ++level)
+            UploadLevel(image, level);
+        ReleaseSource(ResidentLevel);
+        ApplySamplerState();
+        Account(0, BytesFrom(ResidentLevel));
     }
     ~Texture() {
+        if (Streaming)
+            StreamingTextures.erase(find(StreamingTextures.begin(), StreamingTextures.end(), this));
+        if (!Packed)
+            Account(BytesFrom(ResidentLevel), 0);
+        ForgetBinding(TextureID);
         glDeleteTextures(1, &TextureID);
     }
+    Texture(const Texture&) = delete;
+    Texture& operator=(const Texture&) = delete;
+
     void Bind(GLuint unit) {
+        LastUsedFrame = GPUMemory::Frame;
+        if (unit < CACHED_UNITS && BoundTextures[unit] == TextureID)
+            return;
         glBindTextureUnit(unit, TextureID);
+        if (unit < CACHED_UNITS)
+            BoundTextures[unit] = TextureID;
+        ++BindCount;
+    }
+    // Whatever binds texture units behind Bind()'s back calls this
+    static void ForgetBindings() {
+        fill(begin(BoundTextures), end(BoundTextures), 0);
     }
     bool ShouldAlphaClip() const { return HasAlphaChannel; }
-};
+    int GetWidth() const { return Width; }
+    int GetHeight() const { return Height; }
+    GLenum GetFormat() const { return Format; }
+    int GetLevelCount() const { return LevelCount; }
+    // With every level resident
+    size_t GetFullBytes() const { return BytesFrom(0); }
 
+    // Copies levels [arrayLevel, LevelCount) into layer of array, a
+    // GL_TEXTURE_2D_ARRAY of the same format and size holding just those
+    // levels. What isn't on the GPU comes from Source.
+    void CopyIntoLayer(GLuint array, int layer, int arrayLevel) {
+        for (int level=arrayLevel; level<LevelCount; ++level) {
+            if (level >= ResidentLevel) {
+                glCopyImageSubData(
+                    TextureID, GL_TEXTURE_2D, level - ResidentLevel, 0, 0, 0,
+                    array, GL_TEXTURE_2D_ARRAY, level - arrayLevel, 0, 0, layer,
+                    LevelWidth(level), LevelHeight(level), 1);
+                continue;
+            }
+            GLsizei bytes;
+            const void *pixels = LevelPixels(Source, level, bytes);
+            if (CookedFormat) {
+                glCompressedTextureSubImage3D(array, level - arrayLevel, 0, 0, layer,
+                    LevelWidth(level), LevelHeight(level), 1, Format, bytes, pixels);
+            } else {
+                glTextureSubImage3D(array, level - arrayLevel, 0, 0, layer,
+                    LevelWidth(level), LevelHeight(level), 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+            }
+        }
+    }
+    // Drops levels [level, LevelCount) from Source, once the GPU has them
+    void ReleaseSource(int level) {
+        if (level >= SourceLevels)
+            return;
+        if (CookedFormat) {
+            // Mapped from the file, only worth unmapping as a whole
+            if (level > 0)
+                return;
+            Source.CookedFile.reset();
+            Source.Cooked.Levels.clear();
+        } else {
+            if (level == 0)
+                Source.Pixels.reset();
+            Source.Mips.resize(std::max(0, level-1));
+        }
+        SourceLevels = level;
+    }
+    // Whether Source has the levels CopyIntoLayer(..., level) needs. Ones
+    // released and evicted since get decoded again, on a worker (false
+    // until that's in) or right here if wait.
+    bool HasSourceFrom(int level, bool wait = false) {
+        if (level >= ResidentLevel || SourceLevels >= ResidentLevel)
+            return true;
+        if (!HasSource)
+            return false;
+        auto decode = [path = Source.Path, cooked = CookedFormat != 0](SourceReload& reload) {
+            reload.Image = TextureImage::Decode(path, true, cooked);
+            reload.Done = true;
+        };
+        if (wait || !TheThreadPool) {
+            Reload = make_shared<SourceReload>(); // Never mind one in flight
+            decode(*Reload);
+        } else if (!Reload) {
+            Reload = make_shared<SourceReload>();
+            TheThreadPool->Submit([reload = Reload, decode] { decode(*reload); });
+        }
+        if (!Reload->Done)
+            return false;
+        TextureImage image = move(Reload->Image);
+        Reload.reset();
+        const int levels = image.IsCooked() ? (int)image.Cooked.Levels.size() : (int)image.Mips.size() + 1;
+        if (image.Width != Width || image.Height != Height || levels != LevelCount
+            || (image.IsCooked() ? image.Cooked.VkFormat != CookedFormat : CookedFormat || !image.Pixels)) {
+            cerr << image.Path << " changed on disk, it stays at mip " << ResidentLevel << endl;
+            HasSource = false;
+            return false;
+        }
+        Source = move(image);
+        SourceLevels = LevelCount;
+        return true;
+    }
+    // Turns the texture into a view of layer of array (see CopyIntoLayer),
+    // again whenever its table reallocates the array
+    void ViewLayer(GLuint array, int layer, int arrayLevel) {
+        if (!Packed)
+            Account(BytesFrom(ResidentLevel), 0); // The array accounts for it now
+        ForgetBinding(TextureID);
+        glDeleteTextures(1, &TextureID);
+        // Views need a name that was never bound, so no glCreateTextures
+        glGenTextures(1, &TextureID);
+        glTextureView(TextureID, GL_TEXTURE_2D, array, Format, 0, LevelCount - arrayLevel, layer, 1);
+        ResidentLevel = arrayLevel;
+        PackedArray = array;
+        ApplySamplerState();
+        Packed = true;
+    }
+    friend class MaterialTable;
 
-class Mesh {
-    GLuint VertexArray;
+    // Ask for at least this mip to be resident (0 = full resolution)
+    void RequestLevel(int level) {
+        WantedLevel = std::min(WantedLevel, std::max(level, 0));
+    }
 
-    // Attributes
-    GLuint PositionBuffer;
-    GLuint ColorBuffer;
-    GLuint TexCoordBuffer;
-    GLuint NormalBuffer;
-    GLuint TangentBuffer;
-    GLuint BitangentBuffer;
-    
-    GLuint ElementBuffer;
-    GLsizei ElementCount;
+    // Raises the resident level of requested textures, one level per
+    // texture per round so everything sharpens evenly, until budgetBytes
+    // have been uploaded (at least one level always goes through).
+    // Won't upload more than EnforceBudget (and whatever else evicts,
+    // otherEvictableBytes) could make room for.
+    static void UpdateStreaming(size_t budgetBytes, size_t otherEvictableBytes = 0) {
+        if (GPUMemory::Budget) {
+            size_t room = GPUMemory::Budget + otherEvictableBytes + GetEvictableBytes();
+            size_t total = GPUMemory::TotalBytes();
+            budgetBytes = std::min(budgetBytes, room > total ? room - total : 0);
+        }
 
-    static GLuint BoundVertexArray;
-    void Bind() {
-        if (BoundVertexArray != VertexArray)
-            glBindVertexArray(VertexArray);
-        BoundVertexArray = VertexArray;
+        vector<Texture*> pending;
+        int waiting = 0; // For evicted levels to be decoded again
+        for (Texture *t: StreamingTextures) {
+            if (t->WantedLevel >= t->ResidentLevel)
+                continue;
+            if (t->HasSourceFrom(t->WantedLevel))
+                pending.push_back(t);
+            else
+                ++waiting;
+        }
+        // Blurriest first
+        sort(pending.begin(), pending.end(), [](Texture *a, Texture *b) {
+            return a->ResidentLevel - a->WantedLevel > b->ResidentLevel - b->WantedLevel;
+        });
+
+        vector<int> targets;
+        for (Texture *t: pending)
+            targets.push_back(t->ResidentLevel);
+        size_t uploaded = 0;
+        bool progress = true;
+        while (progress && budgetBytes > 0 && uploaded < budgetBytes) {
+            progress = false;
+            for (int i=0; i<pending.size(); ++i) {
+                if (targets[i] <= pending[i]->WantedLevel)
+                    continue;
+                size_t cost = pending[i]->LevelBytes(targets[i]-1);
+                if (uploaded > 0 && uploaded + cost > budgetBytes)
+                    continue;
+                uploaded += cost;
+                --targets[i];
+                progress = true;
+            }
+        }
+
+        Stats.PendingTextures = waiting;
+        for (int i=0; i<pending.size(); ++i) {
+            pending[i]->SetResidentLevel(targets[i]);
+            if (targets[i] > pending[i]->WantedLevel)
+                ++Stats.PendingTextures;
+        }
+        Stats.UploadedBytes = uploaded;
+        for (Texture *t: StreamingTextures)
+            t->WantedLevel = t->LevelCount;
     }
-public:
+
+    static size_t GetEvictableBytes() {
+        size_t bytes = 0;
+        for (Texture *t: StreamingTextures)
+            bytes += t->EvictableBytes();
+        return bytes;
+    }
+
+    // Drops top mips of textures that weren't drawn this frame, least
+    // recently drawn first, until GPUMemory is within its budget
+    static void EnforceBudget() {
+        Stats.EvictedBytes = 0;
+        if (!GPUMemory::Budget || GPUMemory::TotalBytes() <= GPUMemory::Budget)
+            return;
+        vector<Texture*> candidates;
+        for (Texture *t: StreamingTextures)
+            if (t->EvictableBytes() > 0)
+                candidates.push_back(t);
+        sort(candidates.begin(), candidates.end(), [](Texture *a, Texture *b) {
+            return a->LastUsedFrame < b->LastUsedFrame;
+        });
+        for (Texture *t: candidates) {
+            size_t total = GPUMemory::TotalBytes();
+            if (total <= GPUMemory::Budget)
+                break;
+            size_t excess = total - GPUMemory::Budget;
+            const size_t resident = t->BytesFrom(t->ResidentLevel);
+            int level = t->ResidentLevel;
+            while (level < t->TailLevel() && resident - t->BytesFrom(level) < excess)
+                ++level;
+            t->SetResidentLevel(level);
+            Stats.EvictedBytes += resident - t->BytesFrom(level);
+        }
+    }
+};
+
+vector<Texture*> Texture::StreamingTextures;
+bool Texture::StreamingEnabled = true;
+int Texture::BindCount = 0;
+GLuint Texture::BoundTextures[Texture::CACHED_UNITS] = {};
+Texture::StreamingStats Texture::Stats;
+
+// How far apart vertex attributes may be for MeshStreams::Weld to merge
+// them (0 = only bitwise equal). Positions are in model units.
+struct WeldTolerances {
+    float Position = 1e-4f;
+    float Color = 1.0f / 512;
+    float TexCoord = 1e-5f;
+    float Normal = 1e-3f;
+    float Tangent = 0.05f; // Merged tangent frames get averaged
+};
+
+// Vertex layouts a Mesh can be uploaded in
+enum VertexFormat {
+    // Six separate float streams, 68 bytes per vertex
+    FloatVertices,
+    // One interleaved stream, 20 bytes per vertex, see CompactVertex.
+    // Shaders need COMPACT_VERTICES defined and the mesh's PositionOffset/
+    // PositionScale uniforms (DRGeometry.vert, RSM.vert).
+    CompactVertices,
+};
+
+struct CompactVertex {
+    GLushort Position[4]; // Unorm within the mesh bounds, w unused
+    GLushort TexCoord[2]; // Half floats
+    GLshort QTangent[4]; // Snorm tangent frame quaternion, w < 0 flips the bitangent
+};
+static_assert(sizeof(CompactVertex) == 20, "CompactVertex must stay tightly packed");
+
+// One level of detail: a range of Mesh::Elements over the shared vertices,
+// and the meshlets cut from it. Stored as is in the mesh cache.
+struct MeshLOD {
+    uint32_t ElementOffset;
+    uint32_t ElementCount;
+    uint32_t MeshletOffset;
+    uint32_t MeshletCount;
+    float Error; // How far the surface moved from LOD 0, in model units
+};
+
+// CPU side of a Mesh. Importing builds these on a worker thread,
+// Mesh adds the GL objects.
+// ---
+struct MeshStreams {
     vector<vec3> Positions;
     vector<vec3> Colors;
     vector<vec2> TexCoords;
@@ -332,11 +1058,325 @@ public:
     vector<vec3> Tangents;
     vector<vec3> Bitangents;
     vector<GLuint> Elements;
+    // Ranges of Elements for culling, empty = draw everything
+    vector<MeshProcessing::Meshlet> Meshlets;
+    // Level 0 is the full mesh. Empty = one level, all of Elements.
+    vector<MeshLOD> LODs;
+    // The vertices as CompactVertices uploads them, quantized on the
+    // worker (see Quantize). Empty for FloatVertices.
+    vector<CompactVertex> Compacted;
+
+    // Model space bounding box and texture coordinate units per model
+    // space unit, for estimating the needed mip levels
+    vec3 BoundsMin = vec3(0);
+    vec3 BoundsMax = vec3(0);
+    float UVDensity = 1;
+
+    void ComputeBounds() {
+        if (Positions.empty())
+            return;
+        BoundsMin = BoundsMax = Positions[0];
+        for (const vec3& p: Positions) {
+            BoundsMin = min(BoundsMin, p);
+            BoundsMax = max(BoundsMax, p);
+        }
+        double worldArea = 0, uvArea = 0;
+        const size_t elementCount = LODs.empty() ? Elements.size() : LODs[0].ElementCount;
+        for (size_t i=0; i+2<elementCount; i+=3) {
+            GLuint a = Elements[i], b = Elements[i+1], c = Elements[i+2];
+            worldArea += length(cross(Positions[b]-Positions[a], Positions[c]-Positions[a])) / 2;
+            vec2 e0 = TexCoords[b]-TexCoords[a], e1 = TexCoords[c]-TexCoords[a];
+            uvArea += fabs(e0.x*e1.y - e0.y*e1.x) / 2;
+        }
+        if (worldArea > 0 && uvArea > 0)
+            UVDensity = sqrt(uvArea / worldArea);
+    }
+
+    static size_t VertexBytes() {
+        return 5 * sizeof(vec3) + sizeof(vec2);
+    }
+
+    // Tangent frame as a unit quaternion with the bitangent's handedness
+    // in the sign of w (Frey & Herzeg, "Spherical Skinning with Dual
+    // Quaternions and QTangents"). The frame gets orthonormalized.
+    static vec4 EncodeQTangent(vec3 normal, vec3 tangent, vec3 bitangent) {
+        vec3 n = normalize(normal);
+        vec3 t = tangent - n * dot(n, tangent);
+        if (length(t) < 1e-6f)
+            t = cross(n, fabs(n.x) < 0.9f ? vec3(1,0,0) : vec3(0,1,0));
+        t = normalize(t);
+        vec3 b = cross(n, t);
+        const bool mirrored = dot(b, bitangent) < 0;
+
+        // Rotation matrix with columns t, b, n to quaternion
+        vec4 q;
+        float trace = t.x + b.y + n.z;
+        if (trace > 0) {
+            float s = 0.5f / sqrt(trace + 1);
+            q = vec4((b.z - n.y) * s, (n.x - t.z) * s, (t.y - b.x) * s, 0.25f / s);
+        } else if (t.x > b.y && t.x > n.z) {
+            float s = 2 * sqrt(1 + t.x - b.y - n.z);
+            q = vec4(0.25f * s, (b.x + t.y) / s, (n.x + t.z) / s, (b.z - n.y) / s);
+        } else if (b.y > n.z) {
+            float s = 2 * sqrt(1 + b.y - t.x - n.z);
+            q = vec4((b.x + t.y) / s, 0.25f * s, (n.y + b.z) / s, (n.x - t.z) / s);
+        } else {
+            float s = 2 * sqrt(1 + n.z - t.x - b.y);
+            q = vec4((n.x + t.z) / s, (n.y + b.z) / s, 0.25f * s, (t.y - b.x) / s);
+        }
+        q = normalize(q);
+        if (q.w < 0)
+            q = -q;
+        // Keep w away from zero, snorm16 has no -0 to carry the sign
+        const float BIAS = 1.0f / 32767;
+        if (q.w < BIAS) {
+            vec3 xyz = vec3(q) * (sqrt(1 - BIAS*BIAS) / length(vec3(q)));
+            q = vec4(xyz, BIAS);
+        }
+        return mirrored ? -q : q;
+    }
+    static GLshort PackSnorm16(float value) {
+        return (GLshort)round(clamp(value, -1.0f, 1.0f) * 32767);
+    }
+    static GLushort PackUnorm16(float value) {
+        return (GLushort)round(clamp(value, 0.0f, 1.0f) * 65535);
+    }
+
+    // Quantizes to CompactVertex. Texture coordinates move by a whole
+    // number of tiles towards 0 (invisible with GL_REPEAT), so the half
+    // floats keep their precision. Needs BoundsMin/BoundsMax.
+    vector<CompactVertex> Compact(size_t vertexCount,
+        const vec3 *positions, const vec2 *texCoords,
+        const vec3 *normals, const vec3 *tangents, const vec3 *bitangents
+    ) const {
+        vec2 uvMin(INFINITY);
+        for (size_t i=0; i<vertexCount; ++i)
+            uvMin = min(uvMin, texCoords[i]);
+        const vec2 uvShift = vertexCount ? floor(uvMin) : vec2(0);
+        const vec3 extent = BoundsMax - BoundsMin;
+
+        vector<CompactVertex> vertices(vertexCount);
+        for (size_t i=0; i<vertexCount; ++i) {
+            CompactVertex& v = vertices[i];
+            for (int c=0; c<3; ++c)
+                v.Position[c] = PackUnorm16(extent[c] > 0 ? (positions[i][c] - BoundsMin[c]) / extent[c] : 0);
+            v.Position[3] = 0;
+            uint32_t uv = packHalf2x16(texCoords[i] - uvShift);
+            memcpy(v.TexCoord, &uv, sizeof(uv));
+            vec4 q = EncodeQTangent(normals[i], tangents[i], bitangents[i]);
+            for (int c=0; c<4; ++c)
+                v.QTangent[c] = PackSnorm16(q[c]);
+        }
+        return vertices;
+    }
+
+    // Fills Compacted, after ComputeBounds
+    void Quantize() {
+        Compacted = Compact(Positions.size(), Positions.data(), TexCoords.data(),
+            Normals.data(), Tangents.data(), Bitangents.data());
+    }
+
+    // Merges vertices whose attributes all match within tolerances and
+    // remaps Elements, dropping the triangles that collapse. Returns how
+    // many bytes of vertex data that saved.
+    size_t Weld(const WeldTolerances& tolerances) {
+        using namespace MeshProcessing;
+        const size_t vertexCount = Positions.size();
+        vector<WeldStream> streams = {
+            {value_ptr(Positions[0]), 3, tolerances.Position},
+            {value_ptr(Colors[0]), 3, tolerances.Color},
+            {value_ptr(TexCoords[0]), 2, tolerances.TexCoord},
+            {value_ptr(Normals[0]), 3, tolerances.Normal},
+            {value_ptr(Tangents[0]), 3, tolerances.Tangent},
+            {value_ptr(Bitangents[0]), 3, tolerances.Tangent},
+        };
+        size_t uniqueCount;
+        vector<uint32_t> remap = WeldVertices(streams, vertexCount, uniqueCount);
+
+        vector<vec3> tangents(uniqueCount, vec3(0)), bitangents(uniqueCount, vec3(0));
+        for (size_t i=0; i<vertexCount; ++i) {
+            tangents[remap[i]] += Tangents[i];
+            bitangents[remap[i]] += Bitangents[i];
+        }
+        for (size_t i=0; i<uniqueCount; ++i) {
+            if (length(tangents[i]) > 0) tangents[i] = normalize(tangents[i]);
+            if (length(bitangents[i]) > 0) bitangents[i] = normalize(bitangents[i]);
+        }
+        CompactStream(Positions, remap, uniqueCount);
+        CompactStream(Colors, remap, uniqueCount);
+        CompactStream(TexCoords, remap, uniqueCount);
+        CompactStream(Normals, remap, uniqueCount);
+        Tangents = move(tangents);
+        Bitangents = move(bitangents);
+        RemapIndices(Elements, remap);
+        RemoveDegenerateTriangles(Elements);
+        return (vertexCount - uniqueCount) * VertexBytes();
+    }
+
+    // Reorders triangles for the post-transform cache and overdraw, then
+    // vertices for fetch locality. Returns the cache stats before/after.
+    pair<MeshProcessing::CacheStats, MeshProcessing::CacheStats> Optimize() {
+        using namespace MeshProcessing;
+        const size_t vertexCount = Positions.size();
+        CacheStats before = AnalyzeVertexCache(Elements, vertexCount);
+        const size_t elementCount = Elements.size();
+        OptimizeVertexCache(Elements, vertexCount);
+        OptimizeOverdraw(Elements, value_ptr(Positions[0]), vertexCount);
+        // Reordering must never lose (or make up) triangles
+        if (Elements.size() != elementCount) {
+            cerr << "Optimize changed the element count from " << elementCount << " to "
+                 << Elements.size() << endl;
+            abort();
+        }
+        vector<uint32_t> remap = OptimizeVertexFetch(Elements, vertexCount);
+        RemapStream(Positions, remap);
+        RemapStream(Colors, remap);
+        RemapStream(TexCoords, remap);
+        RemapStream(Normals, remap);
+        RemapStream(Tangents, remap);
+        RemapStream(Bitangents, remap);
+        return {before, AnalyzeVertexCache(Elements, vertexCount)};
+    }
+
+    // Appends simplified copies of the triangles to Elements, each with
+    // about half the triangles of the one before, until simplification
+    // stops paying off. Call after Optimize().
+    void BuildLODs() {
+        using namespace MeshProcessing;
+        static const int MAX_LODS = 4;
+        static const size_t MIN_LOD_TRIANGLES = 64;
+        static const float MIN_LOD_REDUCTION = 0.8f; // Next level must have at most this many triangles
+        const size_t vertexCount = Positions.size();
+        LODs.clear();
+        LODs.push_back({0, (uint32_t)Elements.size(), 0, 0, 0});
+        vector<uint32_t> previous = Elements;
+        while (LODs.size() < MAX_LODS) {
+            // Each level starts from the last one, so the errors add up
+            const size_t target = previous.size() / 3 / 2;
+            if (target < MIN_LOD_TRIANGLES)
+                break;
+            float error;
+            vector<uint32_t> lod = Simplify(previous, value_ptr(Positions[0]), vertexCount, target, error);
+            if (lod.size() > previous.size() * MIN_LOD_REDUCTION)
+                break;
+            OptimizeVertexCache(lod, vertexCount);
+            LODs.push_back({(uint32_t)Elements.size(), (uint32_t)lod.size(), 0, 0, LODs.back().Error + error});
+            Elements.insert(Elements.end(), lod.begin(), lod.end());
+            previous = move(lod);
+        }
+        if (LODs.size() == 1)
+            LODs.clear();
+    }
+
+    // Splits each LOD into meshlets, call after BuildLODs()
+    void BuildMeshlets() {
+        using namespace MeshProcessing;
+        const float *positions = value_ptr(Positions[0]);
+        if (LODs.empty()) {
+            Meshlets = MeshProcessing::BuildMeshlets(Elements, positions, Positions.size());
+            return;
+        }
+        Meshlets.clear();
+        for (MeshLOD& lod: LODs) {
+            vector<uint32_t> elements(Elements.begin() + lod.ElementOffset,
+                Elements.begin() + lod.ElementOffset + lod.ElementCount);
+            vector<Meshlet> meshlets = MeshProcessing::BuildMeshlets(elements, positions, Positions.size());
+            for (Meshlet& m: meshlets)
+                m.ElementOffset += lod.ElementOffset;
+            lod.MeshletOffset = Meshlets.size();
+            lod.MeshletCount = meshlets.size();
+            Meshlets.insert(Meshlets.end(), meshlets.begin(), meshlets.end());
+        }
+    }
+};
+
+// What Mesh::DrawMeshlets culled, summed over a pass
+struct MeshletStats {
+    int Total = 0;
+    int FrustumCulled = 0;
+    int BackfaceCulled = 0;
+    size_t TotalTriangles = 0;
+    size_t DrawnTriangles = 0;
+};
+
+class Mesh: public MeshStreams {
+    GLuint VertexArray;
+    VertexFormat Format;
+
+    // Attributes, FloatVertices
+    GLuint PositionBuffer = 0;
+    GLuint ColorBuffer = 0;
+    GLuint TexCoordBuffer = 0;
+    GLuint NormalBuffer = 0;
+    GLuint TangentBuffer = 0;
+    GLuint BitangentBuffer = 0;
+    // CompactVertices
+    GLuint VertexBuffer = 0;
+    
+    GLuint ElementBuffer;
+    GLsizei ElementCount;
+    GLsizei VertexCount = 0;
+    GLenum ElementType = GL_UNSIGNED_INT; // 16-bit when the vertices fit
+    size_t GPUBytes = 0;
+    // Where the elements and vertices start in the buffers, not 0 when
+    // they're a MergedGeometry's (see UseMergedBuffers)
+    GLuint FirstElement = 0;
+    GLint BaseVertex = 0;
+    bool OwnsBuffers = true;
+    // DrawMeshlets scratch
+    vector<GLsizei> DrawCounts;
+    vector<const void*> DrawOffsets;
+    vector<GLint> DrawBaseVertices;
+
+    static GLuint BoundVertexArray;
+    void Bind() { BindVertexArray(VertexArray); }
+
+    size_t ElementSize() const {
+        return ElementType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+    }
+public:
+    // What Model meshes get uploaded as
+    static VertexFormat ModelVertexFormat;
+    static int BindCount; // Vertex array changes, the renderer resets it every frame
+    static int DrawCount; // Draw calls, MergedGeometry's included, reset with BindCount
+
+    // Skips the bind if vertexArray already is, counts the ones it does
+    static void BindVertexArray(GLuint vertexArray) {
+        if (BoundVertexArray != vertexArray) {
+            glBindVertexArray(vertexArray);
+            ++BindCount;
+        }
+        BoundVertexArray = vertexArray;
+    }
+    // Call before deleting a vertex array, GL reuses the name
+    static void ForgetVertexArray(GLuint vertexArray) {
+        if (BoundVertexArray == vertexArray)
+            BoundVertexArray = 0;
+    }
+
+    // Attribute setup for an interleaved CompactVertex buffer
+    static void SetupCompactVertexArray(GLuint vertexArray, GLuint vertexBuffer, GLuint elementBuffer) {
+        glVertexArrayAttribFormat(vertexArray, 0, 4, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(CompactVertex, Position));
+        glVertexArrayAttribFormat(vertexArray, 2, 2, GL_HALF_FLOAT, GL_FALSE, offsetof(CompactVertex, TexCoord));
+        glVertexArrayAttribFormat(vertexArray, 6, 4, GL_SHORT, GL_TRUE, offsetof(CompactVertex, QTangent));
+        for (GLuint attrib: {0, 2, 6}) {
+            glVertexArrayAttribBinding(vertexArray, attrib, 0);
+            glEnableVertexArrayAttrib(vertexArray, attrib);
+        }
+        glVertexArrayVertexBuffer(vertexArray, 0, vertexBuffer, 0, sizeof(CompactVertex));
+        glVertexArrayElementBuffer(vertexArray, elementBuffer);
+    }
 
-    Mesh() {
+    Mesh(VertexFormat format = FloatVertices): Format(format) {
         glCreateVertexArrays(1, &VertexArray);
         glCreateBuffers(1, &ElementBuffer);
 
+        if (Format == CompactVertices) {
+            glCreateBuffers(1, &VertexBuffer);
+            SetupCompactVertexArray(VertexArray, VertexBuffer, ElementBuffer);
+            return;
+        }
+
         // Attributes
         glCreateBuffers(1, &PositionBuffer);
         glCreateBuffers(1, &ColorBuffer);
@@ -373,18 +1413,74 @@ public:
         glVertexArrayElementBuffer(VertexArray, ElementBuffer);    
     }   
     ~Mesh() {
-        glDeleteVertexArrays(1, &VertexArray);
+        if (OwnsBuffers) {
+            ForgetVertexArray(VertexArray);
+            glDeleteVertexArrays(1, &VertexArray);
+        }
         glDeleteBuffers(1, &PositionBuffer);
         glDeleteBuffers(1, &ColorBuffer);
         glDeleteBuffers(1, &TexCoordBuffer);
         glDeleteBuffers(1, &NormalBuffer);
         glDeleteBuffers(1, &TangentBuffer);
         glDeleteBuffers(1, &BitangentBuffer);
+        glDeleteBuffers(1, &VertexBuffer);
+        glDeleteBuffers(1, &ElementBuffer);
+        GPUMemory::Account(GPUMemory::MeshMemory, GPUBytes, 0);
     } 
+    Mesh(const Mesh&) = delete;
+    Mesh& operator=(const Mesh&) = delete;
+
+    VertexFormat GetFormat() const { return Format; }
+    // For decoding CompactVertices positions
+    vec3 GetPositionOffset() const { return BoundsMin; }
+    vec3 GetPositionScale() const { return BoundsMax - BoundsMin; }
+
+    GLsizei GetElementCount() const { return ElementCount; }
+    GLsizei GetVertexCount() const { return VertexCount; }
+
+    // Instead of UploadToGPU: the data is in a MergedGeometry's buffers,
+    // drawn through its vertexArray. The mesh's own buffers go.
+    void UseMergedBuffers(GLuint vertexArray, GLenum elementType, GLuint firstElement, GLint baseVertex,
+        size_t vertexCount, size_t elementCount
+    ) {
+        if (OwnsBuffers) {
+            ForgetVertexArray(VertexArray);
+            glDeleteVertexArrays(1, &VertexArray);
+            glDeleteBuffers(1, &VertexBuffer);
+            glDeleteBuffers(1, &ElementBuffer);
+            VertexBuffer = ElementBuffer = 0;
+            GPUMemory::Account(GPUMemory::MeshMemory, GPUBytes, 0);
+            GPUBytes = 0;
+        }
+        VertexArray = vertexArray;
+        ElementType = elementType;
+        FirstElement = firstElement;
+        BaseVertex = baseVertex;
+        VertexCount = vertexCount;
+        ElementCount = elementCount;
+        OwnsBuffers = false;
+    }
+
     void UploadToGPU() {
-        ElementCount = Elements.size();
-        const size_t VERTEX_COUNT = Positions.size();
-        
+        UploadToGPU(Positions.size(), Positions.data(), Colors.data(), TexCoords.data(),
+            Normals.data(), Tangents.data(), Bitangents.data(),
+            Elements.size(), Elements.data(),
+            Compacted.size() == Positions.size() ? Compacted.data() : nullptr);
+    }
+
+    // Upload straight from external memory (e.g. a mapped mesh cache),
+    // without going through the CPU side vectors.
+    // CompactVertices uploads compacted if there is one, or quantizes
+    // against BoundsMin/BoundsMax here (set them first).
+    void UploadToGPU(size_t vertexCount,
+        const vec3 *positions, const vec3 *colors, const vec2 *texCoords,
+        const vec3 *normals, const vec3 *tangents, const vec3 *bitangents,
+        size_t elementCount, const GLuint *elements, const CompactVertex *compacted = nullptr
+    ) {
+        ElementCount = elementCount;
+        VertexCount = vertexCount;
+        const size_t VERTEX_COUNT = vertexCount;
+
         // Sanity checks
         /*
         assert(Positions.size() == VERTEX_COUNT);
@@ -401,57 +1497,665 @@ public:
         // ---
 
         // Attributes
-        glNamedBufferData(PositionBuffer, VERTEX_COUNT * sizeof(Positions[0]), Positions.data(), GL_STATIC_DRAW);
-        glNamedBufferData(ColorBuffer, VERTEX_COUNT * sizeof(Colors[0]), Colors.data(), GL_STATIC_DRAW);
-        glNamedBufferData(TexCoordBuffer, VERTEX_COUNT * sizeof(TexCoords[0]), TexCoords.data(), GL_STATIC_DRAW);
-        glNamedBufferData(NormalBuffer, VERTEX_COUNT * sizeof(Normals[0]), Normals.data(), GL_STATIC_DRAW);
-        glNamedBufferData(TangentBuffer, VERTEX_COUNT * sizeof(Tangents[0]), Tangents.data(), GL_STATIC_DRAW);
-        glNamedBufferData(BitangentBuffer, VERTEX_COUNT * sizeof(Bitangents[0]), Bitangents.data(), GL_STATIC_DRAW);
+        size_t vertexBytes;
+        if (Format == CompactVertices) {
+            vector<CompactVertex> vertices;
+            if (!compacted) {
+                vertices = Compact(VERTEX_COUNT, positions, texCoords, normals, tangents, bitangents);
+                compacted = vertices.data();
+            }
+            vertexBytes = VERTEX_COUNT * sizeof(CompactVertex);
+            glNamedBufferData(VertexBuffer, vertexBytes, compacted, GL_STATIC_DRAW);
+        } else {
+            glNamedBufferData(PositionBuffer, VERTEX_COUNT * sizeof(vec3), positions, GL_STATIC_DRAW);
+            glNamedBufferData(ColorBuffer, VERTEX_COUNT * sizeof(vec3), colors, GL_STATIC_DRAW);
+            glNamedBufferData(TexCoordBuffer, VERTEX_COUNT * sizeof(vec2), texCoords, GL_STATIC_DRAW);
+            glNamedBufferData(NormalBuffer, VERTEX_COUNT * sizeof(vec3), normals, GL_STATIC_DRAW);
+            glNamedBufferData(TangentBuffer, VERTEX_COUNT * sizeof(vec3), tangents, GL_STATIC_DRAW);
+            glNamedBufferData(BitangentBuffer, VERTEX_COUNT * sizeof(vec3), bitangents, GL_STATIC_DRAW);
+            vertexBytes = VERTEX_COUNT * VertexBytes();
+        }
         
-        glNamedBufferData(ElementBuffer, ElementCount * sizeof(GLuint), Elements.data(), GL_STATIC_DRAW);
+        size_t elementBytes;
+        if (VERTEX_COUNT <= 65536) {
+            vector<GLushort> shortElements(elements, elements + elementCount);
+            ElementType = GL_UNSIGNED_SHORT;
+            elementBytes = ElementCount * sizeof(GLushort);
+            glNamedBufferData(ElementBuffer, elementBytes, shortElements.data(), GL_STATIC_DRAW);
+        } else {
+            ElementType = GL_UNSIGNED_INT;
+            elementBytes = ElementCount * sizeof(GLuint);
+            glNamedBufferData(ElementBuffer, elementBytes, elements, GL_STATIC_DRAW);
+        }
+
+        size_t bytes = vertexBytes + elementBytes;
+        GPUMemory::Account(GPUMemory::MeshMemory, GPUBytes, bytes);
+        GPUBytes = bytes;
+    }
+
+    int GetLODCount() const { return std::max((int)LODs.size(), 1); }
+    float GetLODError(int lod) const { return LODs.empty() ? 0 : LODs[lod].Error; }
+
+    // Elements of a LOD, all of them if there are no LODs
+    void GetLODRange(int lod, GLuint& first, GLsizei& count) const {
+        if (LODs.empty()) {
+            first = 0;
+            count = ElementCount;
+            return;
+        }
+        const MeshLOD& level = LODs[clamp(lod, 0, GetLODCount()-1)];
+        first = level.ElementOffset;
+        count = level.ElementCount;
     }
 
-    void Draw() {
+    void Draw(int lod = 0) {
         Bind();
-        glDrawElements(GL_TRIANGLES, ElementCount, GL_UNSIGNED_INT, 0);
+        GLuint first;
+        GLsizei count;
+        GetLODRange(lod, first, count);
+        glDrawElementsBaseVertex(GL_TRIANGLES, count, ElementType,
+            (const void*)((FirstElement + first) * ElementSize()), BaseVertex);
+        ++DrawCount;
     }    
+    void DrawInstanced(int instanceCount) {
+        Bind();
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, ElementCount, ElementType,
+            (const void*)(FirstElement * ElementSize()), instanceCount, BaseVertex);
+        ++DrawCount;
+    }
+
+    // Calls emit(GLuint firstElement, GLsizei elementCount) for the
+    // meshlets of a LOD that are inside frustum and, if cullBackfacing,
+    // not facing away from eye. Both in model space. Adjacent visible
+    // meshlets are merged into one range. Without meshlets it's the whole LOD.
+    template<class Emit>
+    void ForEachVisibleRange(const Frustum& frustum, vec3 eye, bool cullBackfacing, MeshletStats& stats,
+        int lod, Emit emit
+    ) const {
+        if (Meshlets.empty()) {
+            GLuint first;
+            GLsizei count;
+            GetLODRange(lod, first, count);
+            emit(first, count);
+            return;
+        }
+        const MeshProcessing::Meshlet *begin = Meshlets.data(), *end = begin + Meshlets.size();
+        if (!LODs.empty()) {
+            const MeshLOD& level = LODs[clamp(lod, 0, GetLODCount()-1)];
+            begin = Meshlets.data() + level.MeshletOffset;
+            end = begin + level.MeshletCount;
+        }
+        GLuint rangeStart = 0;
+        GLsizei rangeCount = 0;
+        for (const MeshProcessing::Meshlet *m=begin; m!=end; ++m) {
+            stats.Total++;
+            stats.TotalTriangles += m->ElementCount / 3;
+            if (!frustum.Intersects(make_vec3(m->Center), m->Radius)) {
+                stats.FrustumCulled++;
+                continue;
+            }
+            if (cullBackfacing && MeshProcessing::IsBackfacing(*m, value_ptr(eye))) {
+                stats.BackfaceCulled++;
+                continue;
+            }
+            stats.DrawnTriangles += m->ElementCount / 3;
+            if (rangeCount && m->ElementOffset == rangeStart + rangeCount) {
+                rangeCount += m->ElementCount;
+                continue;
+            }
+            if (rangeCount)
+                emit(rangeStart, rangeCount);
+            rangeStart = m->ElementOffset;
+            rangeCount = m->ElementCount;
+        }
+        if (rangeCount)
+            emit(rangeStart, rangeCount);
+    }
+
+    // Draws what ForEachVisibleRange finds, as a single glMultiDrawElements
+    void DrawMeshlets(const Frustum& frustum, vec3 eye, bool cullBackfacing, MeshletStats& stats,
+        int lod = 0
+    ) {
+        if (Meshlets.empty()) {
+            Draw(lod);
+            return;
+        }
+        const size_t elementSize = ElementSize();
+        DrawCounts.clear();
+        DrawOffsets.clear();
+        ForEachVisibleRange(frustum, eye, cullBackfacing, stats, lod, [&](GLuint first, GLsizei count) {
+            DrawCounts.push_back(count);
+            DrawOffsets.push_back((const void*)((FirstElement + first) * elementSize));
+        });
+        if (DrawCounts.empty())
+            return;
+        DrawBaseVertices.assign(DrawCounts.size(), BaseVertex);
+        Bind();
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, DrawCounts.data(), ElementType,
+            DrawOffsets.data(), DrawCounts.size(), DrawBaseVertices.data());
+        ++DrawCount;
+    }
 };
 
 GLuint Mesh::BoundVertexArray = 0;
+int Mesh::BindCount = 0;
+int Mesh::DrawCount = 0;
+VertexFormat Mesh::ModelVertexFormat = CompactVertices;
 
-template<class Resource>
-shared_ptr<Resource> Load(string path) {
-    using ResPtr = shared_ptr<Resource>;
-    static map<string, ResPtr> Loaded;
+// Texture slots of a material, also the order paths are stored in the mesh cache
+enum MaterialSlot {
+    DiffuseSlot,
+    SpecularSlot,
+    NormalSlot,
+    BumpSlot,
+    TranslucencySlot,
 
-    auto it = Loaded.find(path);
-    if (it == Loaded.end()) {
-        ResPtr res = make_shared<Resource>(path);
-        Loaded[path] = res;
-        return res;
-    }
-    return it->second;    
-}
+    MaterialSlotCount
+};
+typedef array<string, MaterialSlotCount> MaterialPaths;
 
 class Material {
+    // The defaults double as placeholders while a model's textures load
+    static TextureHandle Default(string path) {
+        return TheResources->LoadNow<Texture>(path);
+    }
 public:    
-    TexturePtr DiffuseMap = Load<Texture>("Data/textures/white.png");
-    TexturePtr SpecularMap = Load<Texture>("Data/textures/black.png");
-    TexturePtr NormalMap = Load<Texture>("Data/textures/blankNormal.png");
-    TexturePtr TranslucencyMap = Load<Texture>("Data/textures/black.png");
+    TextureHandle DiffuseMap = Default("Data/textures/white.png");
+    TextureHandle SpecularMap = Default("Data/textures/black.png");
+    TextureHandle NormalMap = Default("Data/textures/blankNormal.png");
+    TextureHandle TranslucencyMap = Default("Data/textures/black.png");
 
     // --For parallax mapping
-    TexturePtr BumpMap = Load<Texture>("Data/textures/black.png"); 
+    TextureHandle BumpMap = Default("Data/textures/black.png"); 
     
     bool Translucent = false; // --No backface culling + Diffuse light
                               //   affects both front&back faces ...
                               //  ( for nice leaf rendering )
+
+    // Indexed by MaterialSlot
+    array<Texture*, MaterialSlotCount> GetTextures() const {
+        return {DiffuseMap.Get().get(), SpecularMap.Get().get(), NormalMap.Get().get(),
+            BumpMap.Get().get(), TranslucencyMap.Get().get()};
+    }
+    array<TextureHandle*, MaterialSlotCount> GetSlots() {
+        return {&DiffuseMap, &SpecularMap, &NormalMap, &BumpMap, &TranslucencyMap};
+    }
+    // Whether all textures are in (or won't come)
+    bool IsLoaded() {
+        for (TextureHandle *slot: GetSlots())
+            if (!slot->IsReady() && !slot->IsCancelled())
+                return false;
+        return true;
+    }
 };
 
-class Shader {
+// Every texture of a set of materials, packed into GL_TEXTURE_2D_ARRAYs
+// * One array per (format, size, level count). For each material an SSBO
+//   says which array and layer each slot is in, shaders pick the material
+//   with the MaterialID uniform. A whole model draws with one Bind().
+// * Packed textures become views of their layer (see Texture::ViewLayer),
+//   so nothing is stored twice and binding them one by one still works
+// * The arrays stream instead of their textures: each holds the levels
+//   from its ResidentLevel down, goes finer when its textures are asked
+//   for finer levels (UpdateStreaming) and gives levels back when over
+//   budget (EnforceBudget), all layers at once
+// * Changing levels reallocates the whole array, the old storage stays
+//   until the new one is written. That's what gets charged, and why an
+//   array moves as many levels as it can at once.
+// * The layers' Source only keeps the levels their array doesn't have
+// ---
+class MaterialTable {
+    struct TextureArray {
+        GLuint TextureID = 0;
+        GLenum Format;
+        int Width, Height, LevelCount;
+        vector<Texture*> Layers;
+        int ResidentLevel = 0;
+        bool Streaming = true; // Every layer can get its Source (back)
+        uint64_t LastUsedFrame = 0;
+        size_t Bytes = 0; // Of the resident levels
+    };
+    vector<TextureArray> Arrays;
+    GLuint MaterialBuffer = 0;
+
+    static vector<MaterialTable*> Tables;
+
+    static size_t BytesFrom(const TextureArray& arr, int level) {
+        return arr.Layers[0]->BytesFrom(level) * arr.Layers.size();
+    }
+    static size_t EvictableBytes(const TextureArray& arr) {
+        const int tail = arr.Layers[0]->TailLevel();
+        if (!arr.Streaming || arr.LastUsedFrame >= GPUMemory::Frame || arr.ResidentLevel >= tail)
+            return 0;
+        return BytesFrom(arr, arr.ResidentLevel) - BytesFrom(arr, tail);
+    }
+    // Whether every layer has the Source (re)allocating to level needs,
+    // see Texture::HasSourceFrom
+    static bool HasSourceFrom(TextureArray& arr, int level, bool wait = false) {
+        bool ready = true;
+        for (Texture *t: arr.Layers)
+            ready = t->HasSourceFrom(level, wait) && ready; // Starts every reload
+        return ready;
+    }
+    // (Re)allocates arr to hold [level, LevelCount) of every layer. The
+    // levels come from the layers (views of the old storage, if they're
+    // this table's) or their Source, and the layers become views again,
+    // dropping the Source levels they now have. Needs HasSourceFrom.
+    static void SetResidentLevel(TextureArray& arr, int level) {
+        GLuint newID;
+        glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &newID);
+        glTextureStorage3D(newID, arr.LevelCount - level, arr.Format,
+            std::max(1, arr.Width >> level), std::max(1, arr.Height >> level), arr.Layers.size());
+        const size_t bytes = BytesFrom(arr, level);
+        GPUMemory::Account(GPUMemory::TextureMemory, 0, bytes); // Both are resident for now
+        Texture::ApplySamplerState(newID, arr.Format);
+        for (int layer=0; layer<arr.Layers.size(); ++layer)
+            arr.Layers[layer]->CopyIntoLayer(newID, layer, level);
+        for (int layer=0; layer<arr.Layers.size(); ++layer) {
+            Texture *t = arr.Layers[layer];
+            // A texture shared with another table stays that one's view
+            if (!t->Packed || t->PackedArray == arr.TextureID)
+                t->ViewLayer(newID, layer, level);
+            t->ReleaseSource(t->ResidentLevel);
+        }
+        glDeleteTextures(1, &arr.TextureID);
+        arr.TextureID = newID;
+        arr.ResidentLevel = level;
+        GPUMemory::Account(GPUMemory::TextureMemory, arr.Bytes, 0);
+        arr.Bytes = bytes;
+    }
+
+    // std430, (array, layer) of each MaterialSlot
+    struct GPUMaterial {
+        GLint Maps[MaterialSlotCount][2];
+    };
+
+public:
+    static const int MAX_TEXTURE_ARRAYS = 11; // Keep in sync with shaders!
+    static const GLuint FIRST_UNIT = MaterialSlotCount; // After the one by one slots
+    static const GLuint MATERIAL_BUFFER_BINDING = 0;
+    static bool Enabled;
+
+    // Fails (IsValid() == false) if the textures need more than
+    // MAX_TEXTURE_ARRAYS arrays, nothing gets packed then
+    MaterialTable(const vector<Material>& materials) {
+        TRACE_SCOPE("Pack material textures");
+        vector<GPUMaterial> gpuMaterials(materials.size());
+        map<Texture*, pair<int, int>> placed;
+        for (int i=0; i<materials.size(); ++i) {
+            array<Texture*, MaterialSlotCount> textures = materials[i].GetTextures();
+            for (int slot=0; slot<MaterialSlotCount; ++slot) {
+                Texture *t = textures[slot];
+                if (!placed.count(t)) {
+                    int a = 0;
+                    while (a < Arrays.size() && !(Arrays[a].Format == t->GetFormat()
+                        && Arrays[a].Width == t->GetWidth() && Arrays[a].Height == t->GetHeight()
+                        && Arrays[a].LevelCount == t->GetLevelCount()))
+                        ++a;
+                    if (a == Arrays.size()) {
+                        Arrays.emplace_back();
+                        Arrays[a].Format = t->GetFormat();
+                        Arrays[a].Width = t->GetWidth();
+                        Arrays[a].Height = t->GetHeight();
+                        Arrays[a].LevelCount = t->GetLevelCount();
+                    }
+                    placed[t] = make_pair(a, (int)Arrays[a].Layers.size());
+                    Arrays[a].Layers.push_back(t);
+                }
+                gpuMaterials[i].Maps[slot][0] = placed[t].first;
+                gpuMaterials[i].Maps[slot][1] = placed[t].second;
+            }
+        }
+        if (Arrays.size() > MAX_TEXTURE_ARRAYS) {
+            cerr << "Material textures need " << Arrays.size() << " texture arrays, more than "
+                 << MAX_TEXTURE_ARRAYS << ", binding them one by one" << endl;
+            Arrays.clear();
+            return;
+        }
+
+        for (TextureArray& arr: Arrays) {
+            // Start from the finest level any layer already has, so
+            // nothing gets blurrier (or much bigger) by packing
+            int level = arr.LevelCount - 1;
+            for (Texture *t: arr.Layers) {
+                arr.Streaming = arr.Streaming && t->HasSource;
+                level = std::min(level, t->ResidentLevel);
+            }
+            level = arr.Streaming ? level : 0;
+            // Only waits for levels evicted since they streamed in
+            if (!HasSourceFrom(arr, level, true)) {
+                // One changed on disk since, take what the GPU has
+                for (Texture *t: arr.Layers)
+                    level = std::max(level, t->ResidentLevel);
+            }
+            SetResidentLevel(arr, level);
+            for (Texture *t: arr.Layers) {
+                if (t->Streaming) {
+                    Texture::StreamingTextures.erase(find(Texture::StreamingTextures.begin(),
+                        Texture::StreamingTextures.end(), t));
+                    t->Streaming = false;
+                }
+            }
+        }
+        Tables.push_back(this);
+        glCreateBuffers(1, &MaterialBuffer);
+        glNamedBufferStorage(MaterialBuffer, gpuMaterials.size() * sizeof(GPUMaterial),
+            gpuMaterials.data(), 0);
+        cerr << "Packed " << placed.size() << " textures of " << materials.size()
+             << " materials into " << Arrays.size() << " texture arrays" << endl;
+    }
+    ~MaterialTable() {
+        if (!Arrays.empty())
+            Tables.erase(find(Tables.begin(), Tables.end(), this));
+        for (TextureArray& arr: Arrays) {
+            GPUMemory::Account(GPUMemory::TextureMemory, arr.Bytes, 0);
+            glDeleteTextures(1, &arr.TextureID);
+        }
+        glDeleteBuffers(1, &MaterialBuffer);
+    }
+    MaterialTable(const MaterialTable&) = delete;
+    MaterialTable& operator=(const MaterialTable&) = delete;
+
+    bool IsValid() const { return !Arrays.empty(); }
+
+    void Bind() {
+        for (int a=0; a<Arrays.size(); ++a) {
+            glBindTextureUnit(FIRST_UNIT + a, Arrays[a].TextureID);
+            Arrays[a].LastUsedFrame = GPUMemory::Frame;
+        }
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_BUFFER_BINDING, MaterialBuffer);
+        Texture::BindCount += Arrays.size();
+    }
+
+    static size_t GetEvictableBytes() {
+        size_t bytes = 0;
+        for (MaterialTable *table: Tables)
+            for (const TextureArray& arr: table->Arrays)
+                bytes += EvictableBytes(arr);
+        return bytes;
+    }
+
+    // Texture::UpdateStreaming for the arrays, blurriest first. An array
+    // goes as fine as the finest level any of its layers was asked for,
+    // in one reallocation, as far as budgetBytes of writes (the whole new
+    // array) and room for both copies under GPUMemory::Budget allow. At
+    // least one level always goes through. Adds to Texture::Stats.
+    static void UpdateStreaming(size_t budgetBytes) {
+        size_t room = SIZE_MAX;
+        if (GPUMemory::Budget) {
+            size_t limit = GPUMemory::Budget + GetEvictableBytes() + Texture::GetEvictableBytes();
+            size_t total = GPUMemory::TotalBytes();
+            room = limit > total ? limit - total : 0;
+        }
+        vector<pair<TextureArray*, int>> pending; // And the wanted level
+        for (MaterialTable *table: Tables) {
+            for (TextureArray& arr: table->Arrays) {
+                int level = arr.LevelCount;
+                for (Texture *t: arr.Layers) {
+                    level = std::min(level, t->WantedLevel);
+                    t->WantedLevel = t->LevelCount;
+                }
+                if (arr.Streaming && level < arr.ResidentLevel)
+                    pending.emplace_back(&arr, level);
+            }
+        }
+        sort(pending.begin(), pending.end(), [](const pair<TextureArray*, int>& a,
+            const pair<TextureArray*, int>& b
+        ) {
+            return a.first->ResidentLevel - a.second > b.first->ResidentLevel - b.second;
+        });
+
+        size_t uploaded = 0;
+        for (const pair<TextureArray*, int>& p: pending) {
+            TextureArray *arr = p.first;
+            const int wanted = p.second;
+            int level = arr->ResidentLevel;
+            if (budgetBytes > 0 && HasSourceFrom(*arr, wanted)) {
+                auto fits = [&](int l) { return BytesFrom(*arr, l) <= room; };
+                while (level > wanted && fits(level-1) && uploaded + BytesFrom(*arr, level-1) <= budgetBytes)
+                    --level;
+                if (level == arr->ResidentLevel && uploaded == 0 && fits(level-1))
+                    --level;
+            }
+            if (level != arr->ResidentLevel) {
+                const size_t bytes = BytesFrom(*arr, level);
+                uploaded += bytes;
+                if (room != SIZE_MAX)
+                    room -= bytes - arr->Bytes;
+                SetResidentLevel(*arr, level);
+            }
+            if (level > wanted)
+                Texture::Stats.PendingTextures += arr->Layers.size();
+        }
+        Texture::Stats.UploadedBytes += uploaded;
+    }
+
+    // Texture::EnforceBudget for the arrays, call after it
+    static void EnforceBudget() {
+        if (!GPUMemory::Budget || GPUMemory::TotalBytes() <= GPUMemory::Budget)
+            return;
+        vector<TextureArray*> candidates;
+        for (MaterialTable *table: Tables)
+            for (TextureArray& arr: table->Arrays)
+                if (EvictableBytes(arr) > 0)
+                    candidates.push_back(&arr);
+        sort(candidates.begin(), candidates.end(), [](TextureArray *a, TextureArray *b) {
+            return a->LastUsedFrame < b->LastUsedFrame;
+        });
+        for (TextureArray *arr: candidates) {
+            size_t total = GPUMemory::TotalBytes();
+            if (total <= GPUMemory::Budget)
+                break;
+            size_t excess = total - GPUMemory::Budget;
+            const size_t resident = arr->Bytes;
+            const int tail = arr->Layers[0]->TailLevel();
+            int level = arr->ResidentLevel;
+            while (level < tail && resident - BytesFrom(*arr, level) < excess)
+                ++level;
+            // Layers viewing another table's array may need their Source
+            if (!HasSourceFrom(*arr, level))
+                continue;
+            SetResidentLevel(*arr, level);
+            Texture::Stats.EvictedBytes += resident - arr->Bytes;
+        }
+    }
+};
+typedef shared_ptr<MaterialTable> MaterialTablePtr;
+
+bool MaterialTable::Enabled = true;
+vector<MaterialTable*> MaterialTable::Tables;
+
+// The meshes of a model in one vertex and one element buffer, so a whole
+// pass can go out as a single glMultiDrawElementsIndirect
+// * CompactVertices only. Built straight from the meshes' CPU data, the
+//   meshes get no buffers of their own and draw mesh by mesh from these
+//   (see Mesh::UseMergedBuffers).
+// * Mesh i's elements start at FirstElement[i] and index from
+//   BaseVertex[i], 32-bit if any mesh needed them
+// ---
+class MergedGeometry {
+    GLuint VertexArray = 0;
+    GLuint VertexBuffer = 0;
+    GLuint ElementBuffer = 0;
+    GLenum ElementType = GL_UNSIGNED_SHORT;
+    size_t GPUBytes = 0;
+
+public:
+    // Draw command layout of glMultiDrawElementsIndirect
+    struct DrawCommand {
+        GLuint Count;
+        GLuint InstanceCount;
+        GLuint FirstIndex;
+        GLint BaseVertex;
+        GLuint BaseInstance;
+    };
+    // What a mesh brings, both have to outlive the constructor
+    struct MeshData {
+        const CompactVertex *Vertices;
+        size_t VertexCount;
+        const GLuint *Elements;
+        size_t ElementCount;
+    };
+
+    // Needs GL_ARB_shader_draw_parameters, main() checks
+    static bool Enabled;
+
+    vector<GLuint> FirstElement;
+    vector<GLint> BaseVertex;
+
+    // data[i] is meshes[i]'s
+    MergedGeometry(const vector<MeshPtr>& meshes, const vector<MeshData>& data) {
+        TRACE_SCOPE("Merge mesh buffers");
+        size_t vertexCount = 0, elementCount = 0;
+        for (const MeshData& mesh: data) {
+            FirstElement.push_back(elementCount);
+            BaseVertex.push_back(vertexCount);
+            vertexCount += mesh.VertexCount;
+            elementCount += mesh.ElementCount;
+            // Elements index from their BaseVertex
+            if (mesh.VertexCount > 65536)
+                ElementType = GL_UNSIGNED_INT;
+        }
+        const size_t elementSize = ElementType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+        const size_t vertexBytes = vertexCount * sizeof(CompactVertex);
+        const size_t elementBytes = elementCount * elementSize;
+
+        vector<CompactVertex> vertices;
+        vertices.reserve(vertexCount);
+        vector<GLushort> shortElements;
+        vector<GLuint> elements;
+        if (ElementType == GL_UNSIGNED_SHORT)
+            shortElements.reserve(elementCount);
+        else
+            elements.reserve(elementCount);
+        for (const MeshData& mesh: data) {
+            vertices.insert(vertices.end(), mesh.Vertices, mesh.Vertices + mesh.VertexCount);
+            if (ElementType == GL_UNSIGNED_SHORT)
+                shortElements.insert(shortElements.end(), mesh.Elements, mesh.Elements + mesh.ElementCount);
+            else
+                elements.insert(elements.end(), mesh.Elements, mesh.Elements + mesh.ElementCount);
+        }
+        glCreateBuffers(1, &VertexBuffer);
+        glCreateBuffers(1, &ElementBuffer);
+        glNamedBufferStorage(VertexBuffer, std::max(vertexBytes, (size_t)1),
+            vertexCount ? vertices.data() : nullptr, 0);
+        glNamedBufferStorage(ElementBuffer, std::max(elementBytes, (size_t)1), elementCount
+            ? (ElementType == GL_UNSIGNED_SHORT ? (const void*)shortElements.data() : elements.data())
+            : nullptr, 0);
+
+        glCreateVertexArrays(1, &VertexArray);
+        Mesh::SetupCompactVertexArray(VertexArray, VertexBuffer, ElementBuffer);
+        GPUBytes = vertexBytes + elementBytes;
+        GPUMemory::Account(GPUMemory::MeshMemory, 0, GPUBytes);
+        for (int i=0; i<meshes.size(); ++i) {
+            meshes[i]->UseMergedBuffers(VertexArray, ElementType, FirstElement[i], BaseVertex[i],
+                data[i].VertexCount, data[i].ElementCount);
+        }
+    }
+    ~MergedGeometry() {
+        Mesh::ForgetVertexArray(VertexArray);
+        glDeleteVertexArrays(1, &VertexArray);
+        glDeleteBuffers(1, &VertexBuffer);
+        glDeleteBuffers(1, &ElementBuffer);
+        GPUMemory::Account(GPUMemory::MeshMemory, GPUBytes, 0);
+    }
+    MergedGeometry(const MergedGeometry&) = delete;
+    MergedGeometry& operator=(const MergedGeometry&) = delete;
+
+    // commandCount DrawCommands from the bound GL_DRAW_INDIRECT_BUFFER,
+    // starting at firstCommand. gl_DrawIDARB counts from 0 in every call.
+    void Draw(size_t firstCommand, GLsizei commandCount) {
+        Mesh::BindVertexArray(VertexArray);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, ElementType,
+            (const void*)(firstCommand * sizeof(DrawCommand)), commandCount, 0);
+        ++Mesh::DrawCount;
+    }
+};
+typedef shared_ptr<MergedGeometry> MergedGeometryPtr;
+
+bool MergedGeometry::Enabled = true;
+
+// GL_KHR_parallel_shader_compile (or the ARB one, same enums), glad only
+// has core GL
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+// Uniform names hash to 32 bits (FNV-1a), at compile time for literals
+struct UniformName {
+    uint32_t Hash;
+    const char *Name; // For error messages
+
+    template<size_t N>
+    constexpr UniformName(const char (&name)[N]): Hash(HashName(name)), Name(name) {}
+
+    static constexpr uint32_t HashName(const char *name) {
+        uint32_t hash = 2166136261u;
+        for (; *name; ++name)
+            hash = (hash ^ (uint8_t)*name) * 16777619u;
+        return hash;
+    }
+};
+
+// GL type a uniform needs to have to be set from a T
+template<class T> struct UniformType;
+template<> struct UniformType<mat4> { static const GLenum Value = GL_FLOAT_MAT4; };
+template<> struct UniformType<mat3> { static const GLenum Value = GL_FLOAT_MAT3; };
+template<> struct UniformType<vec3> { static const GLenum Value = GL_FLOAT_VEC3; };
+template<> struct UniformType<float> { static const GLenum Value = GL_FLOAT; };
+template<> struct UniformType<GLint> { static const GLenum Value = GL_INT; };
+template<> struct UniformType<bool> { static const GLenum Value = GL_BOOL; };
+
+template<class T> class Uniform;
+
+// * Compiling and linking are only submitted on construction, errors get
+//   checked on first use (Use/SetUniform), so several programs can build
+//   at once, on driver threads where GL_KHR_parallel_shader_compile is
+//   supported
+// ---
+class Shader {
     GLuint Program = 0;
     static GLuint ActiveProgram;
 
+    // Between construction and Finish()
+    string Path;
+    GLuint VertexShader = 0;
+    GLuint FragmentShader = 0;
+    GLuint ComputeShader = 0;
+    bool Finished = false;
+    bool SavePending = false; // To the binary cache, once linked
+    uint64_t BinaryKey = 0;
+
+    // Active uniforms outside of blocks, sorted by name hash. Arrays
+    // answer to both "name" and "name[0]".
+    struct UniformInfo {
+        uint32_t Hash;
+        GLint Location;
+        GLenum Type;
+    };
+    vector<UniformInfo> Uniforms;
+
+    template<class T> friend class Uniform;
+
+    static bool SupportsParallelCompile() {
+        static bool supported = [] {
+            const char *function = nullptr;
+            if (glfwExtensionSupported("GL_KHR_parallel_shader_compile"))
+                function = "glMaxShaderCompilerThreadsKHR";
+            else if (glfwExtensionSupported("GL_ARB_parallel_shader_compile"))
+                function = "glMaxShaderCompilerThreadsARB";
+            if (!function)
+                return false;
+            // As many compiler threads as the driver likes
+            auto maxThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress(function);
+            if (maxThreads)
+                maxThreads(0xFFFFFFFF);
+            return true;
+        }();
+        return supported;
+    }
+
     static string FileToString(string path) {
         //https://stackoverflow.com/a/2602258
         ifstream t(path);
@@ -459,179 +2163,937 @@ class Shader {
         buffer << t.rdbuf();
         return buffer.str();
     }
+    // Replaces #include "file" lines with the file, relative to dir.
+    // One level deep, included files can't include.
+    static string ExpandIncludes(const string& source, const string& dir) {
+        const string directive = "#include \"";
+        string result;
+        istringstream lines(source);
+        string line;
+        while (getline(lines, line)) {
+            size_t end;
+            if (line.compare(0, directive.size(), directive) == 0
+                && (end = line.find('"', directive.size())) != string::npos) {
+                string path = dir + line.substr(directive.size(), end - directive.size());
+                ifstream file(path);
+                if (!file) {
+                    cerr << "Can't open shader include " << path << endl;
+                    abort();
+                }
+                result += FileToString(path) + "\n";
+            } else {
+                result += line + "\n";
+            }
+        }
+        return result;
+    }
+    // Defines go right after the #version line
+    static string InsertDefines(const string& source) {
+        size_t lineEnd = source.find('\n');
+        if (Defines.empty() || lineEnd == string::npos)
+            return source;
+        return source.substr(0, lineEnd+1) + Defines + source.substr(lineEnd+1);
+    }
+
+    // Program binary cache
+    // --------------------
+    // Linked programs are saved with glGetProgramBinary, one file per
+    // shader. The key covers the sources (after InsertDefines) and the
+    // driver, a changed shader or a driver update means a fresh compile.
+    // The driver may still reject a binary, then we compile as well.
+    struct BinaryHeader {
+        char Magic[8];
+        uint64_t Key;
+        uint32_t Format;
+        uint32_t Length;
+    };
+    static constexpr char BINARY_MAGIC[8] = "RGPROG\0";
+
+    static const string& DriverString() {
+        static string driver = string((const char*)glGetString(GL_VENDOR)) + "\n"
+            + (const char*)glGetString(GL_RENDERER) + "\n" + (const char*)glGetString(GL_VERSION);
+        return driver;
+    }
+    static bool DriverSupportsBinaries() {
+        GLint formatCount = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+        return formatCount > 0;
+    }
+    // glProgramBinary raises an error for formats the driver doesn't list
+    static bool IsBinaryFormatSupported(GLenum format) {
+        GLint formatCount = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+        vector<GLint> formats(formatCount);
+        if (formatCount)
+            glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats.data());
+        return find(formats.begin(), formats.end(), (GLint)format) != formats.end();
+    }
+    static string BinaryPath(const string& shaderPath) {
+        string name = shaderPath;
+        for (char& c: name)
+            if (c == '/' || c == '\\' || c == ':')
+                c = '_';
+        return BinaryCacheDir + "/" + name + ".bin";
+    }
+
+    bool LoadBinary(const string& cachePath, uint64_t key) {
+        TRACE_SCOPE("Load program binary " + cachePath);
+        MappedFile file(cachePath);
+        if (!file.IsOpen() || file.GetSize() < sizeof(BinaryHeader))
+            return false;
+        BinaryHeader header;
+        memcpy(&header, file.GetData(), sizeof(header));
+        if (memcmp(header.Magic, BINARY_MAGIC, sizeof(header.Magic)) != 0 || header.Key != key
+            || file.GetSize() - sizeof(header) < header.Length
+            || !IsBinaryFormatSupported(header.Format))
+            return false;
+
+        Program = glCreateProgram();
+        glProgramBinary(Program, header.Format, file.GetData() + sizeof(header), header.Length);
+        GLint ok;
+        glGetProgramiv(Program, GL_LINK_STATUS, &ok);
+        if (ok == GL_FALSE) {
+            cerr << "Driver rejected program binary " << cachePath << ", compiling" << endl;
+            glDeleteProgram(Program);
+            Program = 0;
+            return false;
+        }
+        return true;
+    }
+    void SaveBinary(const string& cachePath, uint64_t key) {
+        GLint length = 0;
+        glGetProgramiv(Program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+        vector<char> binary(sizeof(BinaryHeader) + length);
+        BinaryHeader header = {};
+        memcpy(header.Magic, BINARY_MAGIC, sizeof(header.Magic));
+        header.Key = key;
+        GLenum format;
+        glGetProgramBinary(Program, length, &length, &format, &binary[sizeof(header)]);
+        header.Format = format;
+        header.Length = length;
+        memcpy(binary.data(), &header, sizeof(header));
+
+        // Same dance as the mesh cache, never leave a half written file
+        error_code ec;
+        filesystem::create_directories(BinaryCacheDir, ec);
+        string tmpPath = cachePath + ".tmp";
+        ofstream out(tmpPath, ios::binary | ios::trunc);
+        out.write(binary.data(), sizeof(header) + length);
+        out.close();
+        remove(cachePath.c_str());
+        if (!out || rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+            cerr << "Couldn't write program binary " << cachePath << endl;
+            remove(tmpPath.c_str());
+        }
+    }
 
 public:
-    Shader(string path) {
-        GLuint vertexShader;
-        GLuint fragmentShader;
-        string vertexSource = FileToString(path+".vert");
-        string fragmentSource = FileToString(path+".frag");
-        const char *vsCstr = vertexSource.c_str();
-        const int vsCstrSize = vertexSource.size();
-        const char *fsCstr = fragmentSource.c_str();
-        const int fsCstrSize = fragmentSource.size();
-        vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    // Prepended to every shader, e.g. "#define COMPACT_VERTICES\n"
+    static string Defines;
+    static bool BinaryCacheEnabled;
+    static string BinaryCacheDir;
+
+    // For TheResources, the sources are read on a worker. A path.comp
+    // makes a compute program, otherwise it's path.vert + path.frag.
+    struct Prepared {
+        string Path;
+        string VertexSource;
+        string FragmentSource;
+        string ComputeSource;
+        uint64_t SourceHash; // Of all sources, for the binary cache
+    };
+    static Prepared Prepare(string path) {
+        TRACE_SCOPE("Read " + path);
+        const string dir = path.substr(0, path.find_last_of('/') + 1);
+        Prepared source = {path};
+        if (filesystem::exists(path+".comp")) {
+            source.ComputeSource = InsertDefines(ExpandIncludes(FileToString(path+".comp"), dir));
+        } else {
+            source.VertexSource = InsertDefines(ExpandIncludes(FileToString(path+".vert"), dir));
+            source.FragmentSource = InsertDefines(ExpandIncludes(FileToString(path+".frag"), dir));
+        }
+        source.SourceHash = HashBytes(source.VertexSource.data(), source.VertexSource.size());
+        source.SourceHash = HashBytes(source.FragmentSource.data(), source.FragmentSource.size(), source.SourceHash);
+        source.SourceHash = HashBytes(source.ComputeSource.data(), source.ComputeSource.size(), source.SourceHash);
+        return source;
+    }
+
+private:
+    // Submits the compile and link, Finish() checks how they went.
+    // retrievable: the linked program will be saved to the binary cache
+    void Compile(const Prepared& source, bool retrievable) {
+        TRACE_SCOPE("Submit compile " + source.Path);
+        auto submit = [](GLenum type, const string& source) {
+            const char *cstr = source.c_str();
+            const int cstrSize = source.size();
+            GLuint shader = glCreateShader(type);
+            glShaderSource(shader, 1, &cstr, &cstrSize);
+            glCompileShader(shader);
+            return shader;
+        };
         Program = glCreateProgram();
-        glShaderSource(vertexShader, 1, &vsCstr, &vsCstrSize);
-        glShaderSource(fragmentShader, 1, &fsCstr, &fsCstrSize);
-        glCompileShader(vertexShader);
-        glCompileShader(fragmentShader);
-        glAttachShader(Program, vertexShader);
-        glAttachShader(Program, fragmentShader);
+        if (!source.ComputeSource.empty()) {
+            ComputeShader = submit(GL_COMPUTE_SHADER, source.ComputeSource);
+            glAttachShader(Program, ComputeShader);
+        } else {
+            VertexShader = submit(GL_VERTEX_SHADER, source.VertexSource);
+            FragmentShader = submit(GL_FRAGMENT_SHADER, source.FragmentSource);
+            glAttachShader(Program, VertexShader);
+            glAttachShader(Program, FragmentShader);
+        }
+        if (retrievable)
+            glProgramParameteri(Program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         glLinkProgram(Program);
+    }
 
+    void CheckCompileStatus(GLuint shader, const char *kind) {
+        if (!shader)
+            return;
         GLint ok;
-        glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &ok);
-        if (ok == GL_FALSE) {
-            GLsizei bufSize;
-            glGetShaderiv(vertexShader, GL_INFO_LOG_LENGTH, &bufSize);
-            GLchar buf[bufSize];
-            glGetShaderInfoLog(vertexShader, bufSize, 0, &buf[0]);
-            cerr << path << ": Vertex shader error: " << buf << endl;
-            abort();
-        }
-        glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &ok);
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
         if (ok == GL_FALSE) {
             GLsizei bufSize;
-            glGetShaderiv(fragmentShader, GL_INFO_LOG_LENGTH, &bufSize);
+            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &bufSize);
             GLchar buf[bufSize];
-            glGetShaderInfoLog(fragmentShader, bufSize, 0, &buf[0]);
-            cerr << path << ": Fragment shader error: " << buf << endl;
+            glGetShaderInfoLog(shader, bufSize, 0, &buf[0]);
+            cerr << Path << ": " << kind << " shader error: " << buf << endl;
             abort();
         }
+    }
+
+    // Waits for the compile and link (if they're still going), aborts on
+    // errors. Render thread only, like everything GL.
+    void Finish() {
+        if (Finished)
+            return;
+        Finished = true;
+        TRACE_SCOPE("Finish compile " + Path);
+        CheckCompileStatus(VertexShader, "Vertex");
+        CheckCompileStatus(FragmentShader, "Fragment");
+        CheckCompileStatus(ComputeShader, "Compute");
+        GLint ok;
         glGetProgramiv(Program, GL_LINK_STATUS, &ok);
         if (ok == GL_FALSE) {
             GLsizei bufSize;
             glGetProgramiv(Program, GL_INFO_LOG_LENGTH, &bufSize);
             GLchar buf[bufSize];
             glGetProgramInfoLog(Program, bufSize, 0, &buf[0]);
-            cerr << path << ": Shader linking error: " << buf << endl;
+            cerr << Path << ": Shader linking error: " << buf << endl;
             abort();
         }
 
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
+        glDeleteShader(VertexShader);
+        glDeleteShader(FragmentShader);
+        glDeleteShader(ComputeShader);
+        VertexShader = FragmentShader = ComputeShader = 0;
+        if (SavePending)
+            SaveBinary(BinaryPath(Path), BinaryKey);
+        Reflect();
+    }
+
+    // Fills Uniforms from the linked program
+    void Reflect() {
+        Uniforms.clear();
+        GLint count = 0, maxNameLength = 0;
+        glGetProgramInterfaceiv(Program, GL_UNIFORM, GL_ACTIVE_RESOURCES, &count);
+        glGetProgramInterfaceiv(Program, GL_UNIFORM, GL_MAX_NAME_LENGTH, &maxNameLength);
+        vector<char> name(maxNameLength + 1);
+        const GLenum props[] = {GL_BLOCK_INDEX, GL_TYPE, GL_LOCATION};
+        for (GLint i=0; i<count; ++i) {
+            GLint values[3];
+            glGetProgramResourceiv(Program, GL_UNIFORM, i, 3, props, 3, nullptr, values);
+            if (values[0] != -1)
+                continue; // In a block, no location
+            glGetProgramResourceName(Program, GL_UNIFORM, i, name.size(), nullptr, name.data());
+            UniformInfo info = {UniformName::HashName(name.data()), values[2], (GLenum)values[1]};
+            Uniforms.push_back(info);
+            string base = name.data();
+            if (base.size() > 3 && base.compare(base.size()-3, 3, "[0]") == 0) {
+                info.Hash = UniformName::HashName(base.substr(0, base.size()-3).c_str());
+                Uniforms.push_back(info);
+            }
+        }
+        sort(Uniforms.begin(), Uniforms.end(), [](const UniformInfo& a, const UniformInfo& b) {
+            return a.Hash < b.Hash;
+        });
+        for (int i=1; i<Uniforms.size(); ++i) {
+            if (Uniforms[i].Hash == Uniforms[i-1].Hash) {
+                cerr << Path << ": Two uniform names hash the same, rename one" << endl;
+                abort();
+            }
+        }
+    }
+
+    // Location of the uniform, -1 if it isn't active (setting it does
+    // nothing then, like with glGetUniformLocation). Aborts if it can't
+    // be set from a T.
+    template<class T>
+    GLint Locate(uint32_t hash, const char *name) {
+        Finish();
+        auto it = lower_bound(Uniforms.begin(), Uniforms.end(), hash,
+            [](const UniformInfo& u, uint32_t h) { return u.Hash < h; });
+        if (it == Uniforms.end() || it->Hash != hash)
+            return -1;
+        if (it->Type != UniformType<T>::Value) {
+            cerr << Path << ": Uniform " << name << " has GL type 0x" << hex << it->Type
+                 << ", not 0x" << UniformType<T>::Value << dec << endl;
+            abort();
+        }
+        return it->Location;
+    }
+
+    void Upload(GLint location, const mat4& value) {
+        glProgramUniformMatrix4fv(Program, location, 1, GL_FALSE, value_ptr(value));
+    }
+    void Upload(GLint location, const mat3& value) {
+        glProgramUniformMatrix3fv(Program, location, 1, GL_FALSE, value_ptr(value));
+    }
+    void Upload(GLint location, const vec3& value) {
+        glProgramUniform3fv(Program, location, 1, value_ptr(value));
+    }
+    void Upload(GLint location, float value) {
+        glProgramUniform1f(Program, location, value);
+    }
+    void Upload(GLint location, GLint value) {
+        glProgramUniform1i(Program, location, value);
+    }
+    void Upload(GLint location, bool value) {
+        glProgramUniform1i(Program, location, value?GL_TRUE:GL_FALSE);
+    }
+
+public:
+    static int UseCount; // Program changes, the renderer resets it every frame
+
+    Shader(string path): Shader(Prepare(path)) {}
+    Shader(const Prepared& source): Path(source.Path) {
+        SupportsParallelCompile();
+        const bool useCache = BinaryCacheEnabled && DriverSupportsBinaries();
+        BinaryKey = HashBytes(DriverString().data(), DriverString().size(), source.SourceHash);
+        if (useCache && LoadBinary(BinaryPath(Path), BinaryKey)) {
+            Finished = true;
+            Reflect();
+            return;
+        }
+        Compile(source, useCache);
+        SavePending = useCache;
     }
     ~Shader() {
+        glDeleteShader(VertexShader);
+        glDeleteShader(FragmentShader);
+        glDeleteShader(ComputeShader);
         glDeleteProgram(Program);
     }
-    void SetUniform(string name, const mat4& value) {
-        glProgramUniformMatrix4fv(Program, 
-            glGetUniformLocation(Program, name.c_str()),
-            1, GL_FALSE, value_ptr(value)
-        );
-    }
-    void SetUniform(string name, const mat3& value) {
-        glProgramUniformMatrix3fv(Program, 
-            glGetUniformLocation(Program, name.c_str()),
-            1, GL_FALSE, value_ptr(value)
-        );
-    }    
-    void SetUniform(string name, GLint value) {
-        glProgramUniform1i(Program, 
-            glGetUniformLocation(Program, name.c_str()),
-            value
-        );
-    }
-    void SetUniform(string name, bool value) {
-        glProgramUniform1i(Program, 
-            glGetUniformLocation(Program, name.c_str()),
-            value?GL_TRUE:GL_FALSE
-        );
-    }         
-    void SetUniform(string name, float value) {
-        glProgramUniform1f(Program, 
-            glGetUniformLocation(Program, name.c_str()),
-            value
-        );
-    }             
-    void SetUniform(string name, vec3 value) {
-        glProgramUniform3fv(Program,
-            glGetUniformLocation(Program, name.c_str()),
-            1, value_ptr(value)
-        );
+
+    // Whether using the program now won't stall on the compiler. Always
+    // true without parallel compile support, as there's no asking then.
+    bool IsReady() {
+        if (Finished || !SupportsParallelCompile())
+            return true;
+        GLint done = GL_FALSE;
+        glGetProgramiv(Program, GL_COMPLETION_STATUS_KHR, &done);
+        return done == GL_TRUE;
+    }
+    // For uniforms set once in a while, a lookup in the reflected table
+    // (no GL queries). Hot ones should hold a Uniform<T> instead.
+    template<class T>
+    void SetUniform(const UniformName& name, const T& value) {
+        Upload(Locate<T>(name.Hash, name.Name), value);
     }
     void Use() {
+        Finish();
         // Minimize state changes
-        if (ActiveProgram != Program)
+        if (ActiveProgram != Program) {
             glUseProgram(Program);
+            ++UseCount;
+        }
         ActiveProgram = Program;
     }
+    GLuint GetProgram() {
+        Finish();
+        return Program;
+    }
 };
 
 GLuint Shader::ActiveProgram = 0;
+int Shader::UseCount = 0;
+string Shader::Defines;
+bool Shader::BinaryCacheEnabled = true;
+string Shader::BinaryCacheDir = "shadercache";
+
+// A uniform of a Shader, looked up on first Set() and then set straight
+// by location. Names can be built at runtime ("Lights[3].Color"), only
+// the constructor hashes them.
+template<class T>
+class Uniform {
+    Shader *Owner = nullptr;
+    string Name;
+    uint32_t Hash = 0;
+    GLint Location = -1;
+    bool Resolved = false;
 
-class Model {
 public:
-    vector<MeshPtr> Meshes;
-    vector<Material> Materials;
+    Uniform() {}
+    Uniform(Shader *owner, string name)
+        : Owner(owner), Name(move(name)), Hash(UniformName::HashName(Name.c_str())) {}
 
-    Model(string path) {
-        Assimp::Importer importer;
+    void Set(const T& value) {
+        if (!Resolved) {
+            Location = Owner->Locate<T>(Hash, Name.c_str());
+            Resolved = true;
+        }
+        Owner->Upload(Location, value);
+    }
+};
+
+class Model {
+    // Mesh cache
+    // ----------
+    // Binary dump of the final Mesh streams (quantized ones too), meshlets and material texture paths, stored
+    // next to the source model. Keyed on the source file hash, the import
+    // flags and the contents of every other file the importer read (.mtl),
+    // so changing any of them forces a fresh import. The paths of those
+    // files follow the header.
+    // Bump the version whenever the layout below changes!
+    static const uint32_t MESH_CACHE_VERSION = 9;
+    struct MeshCacheHeader {
+        char Magic[8];
+        uint32_t Version;
+        uint32_t ImportFlags;
+        uint64_t SourceHash;
+        uint32_t MeshCount;
+        uint32_t ProcessingHash; // Of the Welding settings
+        uint64_t DependencyHash; // See HashFiles
+        uint32_t DependencyCount;
+        uint32_t Padding;
+    };
+    struct MeshCacheEntry {
+        uint32_t VertexCount;
+        uint32_t ElementCount;
+        uint32_t MeshletCount;
+        uint32_t LODCount;
+        uint32_t PathLengths[MaterialSlotCount];
+        float BoundsMin[3];
+        float BoundsMax[3];
+        float UVDensity;
+    };
+    static constexpr char MESH_CACHE_MAGIC[8] = "RGMESH\0";
+    // Everything in the cache is padded to 4 bytes so the streams can be
+    // used straight out of the mapping.
+    static size_t Align4(size_t size) { return (size + 3) & ~size_t(3); }
+
+    // Walks through a mapped cache, bounds checked
+    struct CacheReader {
+        const uint8_t *Cursor;
+        const uint8_t *End;
+
+        template<class T>
+        const T *Take(size_t count) {
+            size_t bytes = Align4(count * sizeof(T));
+            if ((size_t)(End - Cursor) < bytes)
+                return nullptr;
+            const T *p = (const T*)Cursor;
+            Cursor += bytes;
+            return p;
+        }
+    };
+
+    static unsigned ImportFlags() {
         unsigned flags = 0;
         flags |= aiProcess_Triangulate;
         flags |= aiProcess_PreTransformVertices;
         flags |= aiProcess_FlipUVs;
         flags |= aiProcess_FixInfacingNormals;
         flags |= aiProcess_FindInvalidData;
-        const aiScene *scene = importer.ReadFile(path.c_str(), flags);
-        scene = importer.ApplyPostProcessing(aiProcess_GenNormals | aiProcess_CalcTangentSpace);
+        return flags;
+    }
+    static unsigned PostProcessFlags() {
+        return aiProcess_GenNormals | aiProcess_CalcTangentSpace;
+    }
+    static uint32_t ProcessingHash() {
+        return (uint32_t)HashBytes(&Welding, sizeof(Welding));
+    }
+    // Paths and contents of files, a missing one hashes differently
+    // from an empty one
+    static uint64_t HashFiles(const vector<string>& paths) {
+        uint64_t hash = HashBytes(nullptr, 0);
+        for (const string& path: paths) {
+            hash = HashBytes(path.data(), path.size(), hash);
+            MappedFile file(path);
+            const bool found = file.IsOpen() || ifstream(path).good();
+            hash = HashBytes(&found, sizeof(found), hash);
+            if (file.IsOpen())
+                hash = HashBytes(file.GetData(), file.GetSize(), hash);
+        }
+        return hash;
+    }
+
+    // Default file access that remembers what was opened or looked for,
+    // found or not, so the mesh cache can depend on it (a missing .mtl
+    // showing up has to invalidate it too)
+    class RecordingIOSystem: public Assimp::DefaultIOSystem {
+        void Record(const char *file) const {
+            if (find(Opened.begin(), Opened.end(), file) == Opened.end())
+                Opened.push_back(file);
+        }
+    public:
+        mutable vector<string> Opened; // Exists is const in assimp's interface
+
+        bool Exists(const char *file) const override {
+            Record(file);
+            return DefaultIOSystem::Exists(file);
+        }
+        Assimp::IOStream *Open(const char *file, const char *mode = "rb") override {
+            Record(file);
+            return DefaultIOSystem::Open(file, mode);
+        }
+    };
+
+    // Mesh records pointing into a mapped cache
+    struct CachedMesh {
+        const MeshCacheEntry *Entry;
+        const vec3 *Positions, *Colors, *Normals, *Tangents, *Bitangents;
+        const vec2 *TexCoords;
+        const GLuint *Elements;
+        const MeshProcessing::Meshlet *Meshlets;
+        const MeshLOD *LODs;
+        const CompactVertex *Compacted;
+    };
+
+public:
+    // What Prepare() hands to the constructor. Either the freshly imported
+    // Meshes, or CachedMeshes pointing into CacheFile.
+    struct Prepared {
+        string Path;
+        chrono::steady_clock::time_point Start;
+        vector<MaterialPaths> Paths;
+        vector<string> Dependencies; // Files besides Path the importer read
+        vector<MeshStreams> Meshes;
+        shared_ptr<MappedFile> CacheFile;
+        vector<CachedMesh> CachedMeshes;
+    };
+
+private:
+    bool TableTried = false;
+
+    // Textures start loading in the background, the materials serve
+    // their defaults until they're in
+    void MakeMaterials(const vector<MaterialPaths>& paths) {
+        for (const MaterialPaths& matPaths: paths)
+            Materials.push_back(MakeMaterial(matPaths));
+    }
+    static Material MakeMaterial(const MaterialPaths& paths) {
+        Material mat;
+        array<TextureHandle*, MaterialSlotCount> slots = mat.GetSlots();
+        for (int slot=0; slot<MaterialSlotCount; ++slot) {
+            if (paths[slot].empty())
+                continue;
+            // Diffuse maps make the biggest difference, get them in first
+            int priority = slot == DiffuseSlot ? NormalPriority : LowPriority;
+            *slots[slot] = TheResources->Load<Texture>(paths[slot], slots[slot]->Get(), priority);
+        }
+        return mat;
+    }
+
+    static bool LoadFromCache(string cachePath, uint64_t sourceHash, uint32_t importFlags,
+        Prepared& data
+    ) {
+        auto file = make_shared<MappedFile>(cachePath);
+        if (!file->IsOpen())
+            return false;
+        CacheReader reader = {file->GetData(), file->GetData() + file->GetSize()};
+        const MeshCacheHeader *header = reader.Take<MeshCacheHeader>(1);
+        if (!header
+            || memcmp(header->Magic, MESH_CACHE_MAGIC, sizeof(header->Magic)) != 0
+            || header->Version != MESH_CACHE_VERSION
+            || header->ImportFlags != importFlags
+            || header->SourceHash != sourceHash
+            || header->ProcessingHash != ProcessingHash()) {
+            cerr << "Mesh cache " << cachePath << " is stale" << endl;
+            return false;
+        }
+        vector<string> dependencies(header->DependencyCount);
+        for (string& dependency: dependencies) {
+            const uint32_t *length = reader.Take<uint32_t>(1);
+            const char *chars = length ? reader.Take<char>(*length) : nullptr;
+            if (!chars)
+                return false;
+            dependency.assign(chars, *length);
+        }
+        if (HashFiles(dependencies) != header->DependencyHash) {
+            cerr << "Mesh cache " << cachePath << " is stale (material library changed)" << endl;
+            return false;
+        }
+
+        // Validate everything here, so a truncated cache can't leave us
+        // with half a model
+        vector<CachedMesh> records(header->MeshCount);
+        vector<MaterialPaths> paths(header->MeshCount);
+        for (int i=0; i<records.size(); ++i) {
+            CachedMesh& r = records[i];
+            r.Entry = reader.Take<MeshCacheEntry>(1);
+            if (!r.Entry)
+                return false;
+            const size_t n = r.Entry->VertexCount;
+            r.Positions = reader.Take<vec3>(n);
+            r.Colors = reader.Take<vec3>(n);
+            r.TexCoords = reader.Take<vec2>(n);
+            r.Normals = reader.Take<vec3>(n);
+            r.Tangents = reader.Take<vec3>(n);
+            r.Bitangents = reader.Take<vec3>(n);
+            r.Elements = reader.Take<GLuint>(r.Entry->ElementCount);
+            r.Meshlets = reader.Take<MeshProcessing::Meshlet>(r.Entry->MeshletCount);
+            r.LODs = reader.Take<MeshLOD>(r.Entry->LODCount);
+            r.Compacted = reader.Take<CompactVertex>(n);
+            if (!r.Positions || !r.Colors || !r.TexCoords || !r.Normals || !r.Tangents
+                || !r.Bitangents || !r.Elements || !r.Meshlets || !r.LODs || !r.Compacted)
+                return false;
+            for (int slot=0; slot<MaterialSlotCount; ++slot) {
+                const char *chars = reader.Take<char>(r.Entry->PathLengths[slot]);
+                if (!chars)
+                    return false;
+                paths[i][slot].assign(chars, r.Entry->PathLengths[slot]);
+            }
+        }
+        data.CacheFile = file;
+        data.CachedMeshes = move(records);
+        data.Paths = move(paths);
+        return true;
+    }
+
+    static void SaveToCache(string cachePath, uint64_t sourceHash, uint32_t importFlags,
+        const Prepared& data
+    ) {
+        // Write to a temporary first so an interrupted run never leaves
+        // a broken cache behind
+        string tmpPath = cachePath + ".tmp";
+        ofstream out(tmpPath, ios::binary | ios::trunc);
+        if (!out) {
+            cerr << "Couldn't write mesh cache " << cachePath << endl;
+            return;
+        }
+        auto write = [&](const void *data, size_t size) {
+            static const char PADDING[4] = {0};
+            out.write((const char*)data, size);
+            out.write(PADDING, Align4(size) - size);
+        };
+
+        MeshCacheHeader header = {};
+        memcpy(header.Magic, MESH_CACHE_MAGIC, sizeof(header.Magic));
+        header.Version = MESH_CACHE_VERSION;
+        header.ImportFlags = importFlags;
+        header.SourceHash = sourceHash;
+        header.MeshCount = data.Meshes.size();
+        header.ProcessingHash = ProcessingHash();
+        header.DependencyHash = HashFiles(data.Dependencies);
+        header.DependencyCount = data.Dependencies.size();
+        write(&header, sizeof(header));
+        for (const string& dependency: data.Dependencies) {
+            const uint32_t length = dependency.size();
+            write(&length, sizeof(length));
+            write(dependency.data(), length);
+        }
+
+        for (int i=0; i<data.Meshes.size(); ++i) {
+            const MeshStreams& m = data.Meshes[i];
+            const MaterialPaths& paths = data.Paths[i];
+            MeshCacheEntry entry = {};
+            entry.VertexCount = m.Positions.size();
+            entry.ElementCount = m.Elements.size();
+            entry.MeshletCount = m.Meshlets.size();
+            entry.LODCount = m.LODs.size();
+            for (int slot=0; slot<MaterialSlotCount; ++slot)
+                entry.PathLengths[slot] = paths[slot].size();
+            memcpy(entry.BoundsMin, value_ptr(m.BoundsMin), sizeof(entry.BoundsMin));
+            memcpy(entry.BoundsMax, value_ptr(m.BoundsMax), sizeof(entry.BoundsMax));
+            entry.UVDensity = m.UVDensity;
+            write(&entry, sizeof(entry));
+            write(m.Positions.data(), m.Positions.size() * sizeof(vec3));
+            write(m.Colors.data(), m.Colors.size() * sizeof(vec3));
+            write(m.TexCoords.data(), m.TexCoords.size() * sizeof(vec2));
+            write(m.Normals.data(), m.Normals.size() * sizeof(vec3));
+            write(m.Tangents.data(), m.Tangents.size() * sizeof(vec3));
+            write(m.Bitangents.data(), m.Bitangents.size() * sizeof(vec3));
+            write(m.Elements.data(), m.Elements.size() * sizeof(GLuint));
+            write(m.Meshlets.data(), m.Meshlets.size() * sizeof(MeshProcessing::Meshlet));
+            write(m.LODs.data(), m.LODs.size() * sizeof(MeshLOD));
+            write(m.Compacted.data(), m.Compacted.size() * sizeof(CompactVertex));
+            for (int slot=0; slot<MaterialSlotCount; ++slot)
+                write(paths[slot].data(), paths[slot].size());
+        }
+        out.close();
+        remove(cachePath.c_str());
+        if (!out || rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+            cerr << "Couldn't write mesh cache " << cachePath << endl;
+            remove(tmpPath.c_str());
+        }
+    }
+
+    // Per mesh results of Import, gathered after the parallel part
+    struct ImportStats {
+        size_t Triangles = 0, VerticesBefore = 0, VerticesAfter = 0, SavedBytes = 0;
+        MeshProcessing::CacheStats Before, After;
+        string Log;
+    };
+
+    // Everything one mesh goes through, runs on any thread. m and paths
+    // are preallocated slots, so meshes don't touch each other.
+    static void ConvertMesh(const aiScene *scene, int i, MeshStreams& m, MaterialPaths& matPaths,
+        ImportStats& stats
+    ) {
+        TRACE_SCOPE("Convert mesh " + to_string(i));
+        const aiMesh *mesh = scene->mMeshes[i];
+
+        assert(mesh->HasNormals());
+        assert(mesh->HasPositions());
+        assert(mesh->HasTextureCoords(0));
+        assert(mesh->HasTangentsAndBitangents());
+
+        const size_t n = mesh->mNumVertices;
+        m.Positions.resize(n);
+        m.Colors.assign(n, vec3(1,1,1));
+        m.TexCoords.resize(n);
+        m.Normals.resize(n);
+        m.Tangents.resize(n);
+        m.Bitangents.resize(n);
+        m.Elements.resize(mesh->mNumFaces * 3);
+
+        // Same layout, so the 3D streams are straight copies
+        static_assert(sizeof(aiVector3D) == sizeof(vec3), "aiVector3D must be three floats like vec3");
+        memcpy((void*)m.Positions.data(), mesh->mVertices, n * sizeof(vec3));
+        memcpy((void*)m.Normals.data(), mesh->mNormals, n * sizeof(vec3));
+        memcpy((void*)m.Tangents.data(), mesh->mTangents, n * sizeof(vec3));
+        memcpy((void*)m.Bitangents.data(), mesh->mBitangents, n * sizeof(vec3));
+        const aiVector3D *uvs = mesh->mTextureCoords[0];
+        for (size_t j=0; j<n; ++j)
+            m.TexCoords[j] = vec2(uvs[j].x, uvs[j].y);
+        GLuint *elements = m.Elements.data();
+        for (size_t j=0; j<mesh->mNumFaces; ++j) {
+            const unsigned *face = mesh->mFaces[j].mIndices;
+            elements[j*3] = face[0];
+            elements[j*3 + 1] = face[1];
+            elements[j*3 + 2] = face[2];
+        }
+
+        if (!m.Positions.empty()) {
+            stats.VerticesBefore = m.Positions.size();
+            stats.SavedBytes = m.Weld(Welding);
+            stats.VerticesAfter = m.Positions.size();
+            tie(stats.Before, stats.After) = m.Optimize();
+            stats.Triangles = m.Elements.size() / 3;
+            m.BuildLODs();
+            m.BuildMeshlets();
+            ostringstream log;
+            log << "Mesh " << i << " (" << stats.Triangles << " triangles, "
+                << n << " -> " << m.Positions.size() << " vertices, "
+                << m.Meshlets.size() << " meshlets): ACMR "
+                << stats.Before.ACMR << " -> " << stats.After.ACMR << ", ATVR "
+                << stats.Before.ATVR << " -> " << stats.After.ATVR << endl;
+            for (int lod=1; lod<m.LODs.size(); ++lod) {
+                log << "  LOD " << lod << ": " << m.LODs[lod].ElementCount / 3
+                    << " triangles, error " << m.LODs[lod].Error << endl;
+            }
+            stats.Log = log.str();
+        }
+        m.ComputeBounds();
+        // Whatever the vertex format, so the mesh cache doesn't depend on it
+        m.Quantize();
+
+        aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
+        aiString diffuseMapPath, specularMapPath, normalMapPath, bumpMapPath, translucencyMapPath;
+        material->GetTexture(aiTextureType_DIFFUSE, 0, &diffuseMapPath);
+        material->GetTexture(aiTextureType_SPECULAR, 0, &specularMapPath);
+        material->GetTexture(aiTextureType_NORMALS, 0, &normalMapPath);
+        material->GetTexture(aiTextureType_HEIGHT, 0, &bumpMapPath);
+        material->GetTexture(aiTextureType_OPACITY, 0, &translucencyMapPath);
+        matPaths[DiffuseSlot] = diffuseMapPath.C_Str();
+        matPaths[SpecularSlot] = specularMapPath.C_Str();
+        matPaths[NormalSlot] = normalMapPath.C_Str();
+        matPaths[BumpSlot] = bumpMapPath.C_Str();
+        matPaths[TranslucencySlot] = translucencyMapPath.C_Str();
+    }
+
+    static void Import(string path, unsigned flags, Prepared& data) {
+        Assimp::Importer importer;
+        RecordingIOSystem *io = new RecordingIOSystem(); // The importer owns it
+        importer.SetIOHandler(io);
+        const aiScene *scene;
+        {
+            TRACE_SCOPE("Assimp ReadFile " + path);
+            scene = importer.ReadFile(path.c_str(), flags);
+        }
+        {
+            TRACE_SCOPE("Assimp post-processing " + path);
+            scene = importer.ApplyPostProcessing(PostProcessFlags());
+        }
         if (!scene) {
             cerr << "Couldn't load " << path << endl;
             abort();
         }
-        for (int i=0; i<scene->mNumMeshes; ++i) {
-            aiMesh *mesh = scene->mMeshes[i];
-
-            assert(mesh->HasNormals());
-            assert(mesh->HasPositions());
-            assert(mesh->HasTextureCoords(0));
-            assert(mesh->HasTangentsAndBitangents());
-
-            MeshPtr meshp = make_shared<Mesh>();
-            meshp->Positions.resize(mesh->mNumVertices);
-            meshp->Colors.resize(mesh->mNumVertices);
-            meshp->TexCoords.resize(mesh->mNumVertices);
-            meshp->Normals.resize(mesh->mNumVertices);
-            meshp->Tangents.resize(mesh->mNumVertices);
-            meshp->Bitangents.resize(mesh->mNumVertices);
-
-            meshp->Elements.reserve(mesh->mNumFaces * 3);
-            for (int j=0; j<mesh->mNumVertices; ++j) {
-                meshp->Positions[j] = vec3(mesh->mVertices[j].x, mesh->mVertices[j].y, mesh->mVertices[j].z);
-                meshp->Colors[j] = vec3(1,1,1);
-                meshp->TexCoords[j] = vec2(mesh->mTextureCoords[0][j].x, mesh->mTextureCoords[0][j].y);
-                meshp->Normals[j] = vec3(mesh->mNormals[j].x, mesh->mNormals[j].y, mesh->mNormals[j].z);
-                meshp->Tangents[j] = vec3(mesh->mTangents[j].x, mesh->mTangents[j].y, mesh->mTangents[j].z);
-                meshp->Bitangents[j] = vec3(mesh->mBitangents[j].x, mesh->mBitangents[j].y, mesh->mBitangents[j].z);
+        for (const string& opened: io->Opened)
+            if (opened != path)
+                data.Dependencies.push_back(opened);
+
+        // Meshes are independent, convert them on all threads. Import
+        // already runs on a worker, ParallelFor has it pitch in too.
+        const size_t meshCount = scene->mNumMeshes;
+        auto start = chrono::steady_clock::now();
+        data.Meshes.resize(meshCount);
+        data.Paths.resize(meshCount);
+        vector<ImportStats> stats(meshCount);
+        auto convert = [&](size_t i) {
+            ConvertMesh(scene, i, data.Meshes[i], data.Paths[i], stats[i]);
+        };
+        unsigned threadCount = 1;
+        if (TheThreadPool) {
+            TheThreadPool->ParallelFor(meshCount, convert);
+            threadCount += TheThreadPool->GetThreadCount();
+        } else {
+            for (size_t i=0; i<meshCount; ++i)
+                convert(i);
+        }
+        double convertMs = MillisecondsSince(start);
+
+        double missesBefore = 0, missesAfter = 0;
+        size_t triangleCount = 0, meshletCount = 0, verticesBefore = 0, verticesAfter = 0, savedBytes = 0;
+        for (size_t i=0; i<meshCount; ++i) {
+            cerr << stats[i].Log;
+            missesBefore += stats[i].Before.ACMR * stats[i].Triangles;
+            missesAfter += stats[i].After.ACMR * stats[i].Triangles;
+            triangleCount += stats[i].Triangles;
+            meshletCount += data.Meshes[i].Meshlets.size();
+            verticesBefore += stats[i].VerticesBefore;
+            verticesAfter += stats[i].VerticesAfter;
+            savedBytes += stats[i].SavedBytes;
+        }
+        cerr << path << ": converted " << meshCount << " meshes on up to " << threadCount
+             << " threads in " << convertMs << " ms" << endl;
+        if (triangleCount) {
+            cerr << path << ": welded " << verticesBefore << " -> " << verticesAfter
+                 << " vertices, saving " << savedBytes / 1048576.0 << " MiB of vertex data" << endl;
+            cerr << path << ": ACMR " << missesBefore / triangleCount << " -> "
+                 << missesAfter / triangleCount << " over " << triangleCount << " triangles in "
+                 << meshletCount << " meshlets" << endl;
+            // Meshes with fewer levels count with their coarsest, as they're drawn
+            int lodCount = 1;
+            for (const MeshStreams& m: data.Meshes)
+                lodCount = std::max(lodCount, (int)m.LODs.size());
+            for (int lod=1; lod<lodCount; ++lod) {
+                size_t lodTriangles = 0;
+                for (const MeshStreams& m: data.Meshes) {
+                    lodTriangles += m.LODs.empty() ? m.Elements.size() / 3
+                        : m.LODs[std::min(lod, (int)m.LODs.size()-1)].ElementCount / 3;
+                }
+                cerr << path << ": LOD " << lod << " " << lodTriangles << " triangles" << endl;
             }
-            for (int j=0; j<mesh->mNumFaces; ++j) {
-                meshp->Elements.push_back(mesh->mFaces[j].mIndices[0]);
-                meshp->Elements.push_back(mesh->mFaces[j].mIndices[1]);
-                meshp->Elements.push_back(mesh->mFaces[j].mIndices[2]);
+        }
+    }
+
+public:
+    vector<MeshPtr> Meshes;
+    vector<Material> Materials;
+    MaterialTablePtr Table; // Null until every texture is in, or if packing failed
+    MergedGeometryPtr Merged; // Null unless MergedGeometry::Enabled
+    // Each mesh's bounding box, for frustum culling. Model space, which
+    // is the scene's world space, as assimp pre-transforms the vertices.
+    Culling::BoxSet Bounds;
+
+    // Applied to every imported mesh, part of the mesh cache key
+    static WeldTolerances Welding;
+
+    // Everything that doesn't need GL: reading the mesh cache, or importing
+    // with assimp and writing a new cache. Runs on a worker (see TheResources).
+    static Prepared Prepare(string path) {
+        Prepared data;
+        data.Path = path;
+        data.Start = chrono::steady_clock::now();
+        const unsigned flags = ImportFlags() | PostProcessFlags();
+        const string cachePath = path + ".meshcache";
+
+        uint64_t sourceHash = 0;
+        {
+            TRACE_SCOPE("Hash " + path);
+            MappedFile source(path);
+            if (source.IsOpen())
+                sourceHash = HashBytes(source.GetData(), source.GetSize());
+        }
+
+        {
+            TRACE_SCOPE("Read mesh cache " + cachePath);
+            if (LoadFromCache(cachePath, sourceHash, flags, data))
+                return data;
+        }
+        Import(path, ImportFlags(), data);
+        TRACE_SCOPE("Write mesh cache " + cachePath);
+        SaveToCache(cachePath, sourceHash, flags, data);
+        return data;
+    }
+
+    // Packs the material textures once they've all loaded. Call every
+    // frame, it's cheap after that. Render thread only.
+    void UpdateMaterialTable() {
+        if (TableTried || !MaterialTable::Enabled || Materials.empty())
+            return;
+        for (Material& mat: Materials)
+            if (!mat.IsLoaded())
+                return;
+        TableTried = true;
+        Table = make_shared<MaterialTable>(Materials);
+        if (!Table->IsValid())
+            Table = nullptr;
+    }
+
+    // Empty, what a loading model shows
+    Model() {}
+    Model(string path): Model(Prepare(path)) {}
+    Model(Prepared&& data) {
+        TRACE_SCOPE("Upload " + data.Path);
+        // Merged meshes skip their own buffers
+        const bool merge = MergedGeometry::Enabled && Mesh::ModelVertexFormat == CompactVertices;
+        vector<MergedGeometry::MeshData> merging;
+        for (const CachedMesh& r: data.CachedMeshes) {
+            MeshPtr meshp = make_shared<Mesh>(Mesh::ModelVertexFormat);
+            meshp->BoundsMin = make_vec3(r.Entry->BoundsMin);
+            meshp->BoundsMax = make_vec3(r.Entry->BoundsMax);
+            meshp->UVDensity = r.Entry->UVDensity;
+            meshp->Meshlets.assign(r.Meshlets, r.Meshlets + r.Entry->MeshletCount);
+            meshp->LODs.assign(r.LODs, r.LODs + r.Entry->LODCount);
+            if (merge) {
+                merging.push_back({r.Compacted, r.Entry->VertexCount, r.Elements, r.Entry->ElementCount});
+            } else {
+                meshp->UploadToGPU(r.Entry->VertexCount,
+                    r.Positions, r.Colors, r.TexCoords,
+                    r.Normals, r.Tangents, r.Bitangents,
+                    r.Entry->ElementCount, r.Elements, r.Compacted);
             }
-            meshp->UploadToGPU();
             Meshes.push_back(meshp);
-
-            aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
-            aiString diffuseMapPath, specularMapPath, normalMapPath, bumpMapPath, translucencyMapPath;
-            material->GetTexture(aiTextureType_DIFFUSE, 0, &diffuseMapPath);
-            material->GetTexture(aiTextureType_SPECULAR, 0, &specularMapPath);
-            material->GetTexture(aiTextureType_NORMALS, 0, &normalMapPath);
-            material->GetTexture(aiTextureType_HEIGHT, 0, &bumpMapPath);
-            material->GetTexture(aiTextureType_OPACITY, 0, &translucencyMapPath);
-            Material mat;
-            if (diffuseMapPath.length!=0) mat.DiffuseMap = Load<Texture>(diffuseMapPath.C_Str());
-            if (specularMapPath.length!=0) mat.SpecularMap = Load<Texture>(specularMapPath.C_Str());
-            if (normalMapPath.length!=0) mat.NormalMap = Load<Texture>(normalMapPath.C_Str());
-            if (bumpMapPath.length!=0) mat.BumpMap = Load<Texture>(bumpMapPath.C_Str());
-            if (translucencyMapPath.length!=0) mat.TranslucencyMap = Load<Texture>(translucencyMapPath.C_Str());
-            Materials.push_back(mat);
-        }        
+        }
+        for (MeshStreams& streams: data.Meshes) {
+            MeshPtr meshp = make_shared<Mesh>(Mesh::ModelVertexFormat);
+            static_cast<MeshStreams&>(*meshp) = move(streams);
+            if (merge)
+                merging.push_back({meshp->Compacted.data(), meshp->Compacted.size(),
+                    meshp->Elements.data(), meshp->Elements.size()});
+            else
+                meshp->UploadToGPU();
+            Meshes.push_back(meshp);
+        }
+        for (const MeshPtr& mesh: Meshes)
+            Bounds.Add(value_ptr(mesh->BoundsMin), value_ptr(mesh->BoundsMax));
+        if (merge && !Meshes.empty())
+            Merged = make_shared<MergedGeometry>(Meshes, merging);
+        for (const MeshPtr& mesh: Meshes)
+            vector<CompactVertex>().swap(mesh->Compacted); // On the GPU now
+        MakeMaterials(data.Paths);
+        cerr << (data.CacheFile ? "Loaded " : "Imported ") << data.Path
+             << (data.CacheFile ? " from mesh cache (warm start) in " : " with assimp (cold start) in ")
+             << MillisecondsSince(data.Start) << " ms, textures follow" << endl;
     }
 };
 
+WeldTolerances Model::Welding;
+
 float RandomFloat() {
     return rand() / (float)RAND_MAX;
 }
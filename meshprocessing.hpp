@@ -0,0 +1,780 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <queue>
+
+// Import time index/vertex processing
+// * WeldVertices: merges vertices whose attributes all match within
+//   per-attribute tolerances
+// * OptimizeVertexCache: triangle order for the post-transform cache
+//   (Forsyth, "Linear-Speed Vertex Cache Optimisation")
+// * OptimizeOverdraw: splits that order into clusters where the cache
+//   restarts anyway, and draws outward facing clusters first
+//   (Sander et al., "Fast Triangle Reordering for Vertex Locality and
+//   Reduced Overdraw")
+// * OptimizeVertexFetch: vertex order by first use, for fetch locality
+// * Simplify: quadric error edge collapse for LODs (Garland & Heckbert,
+//   "Surface Simplification Using Quadric Error Metrics")
+// * BuildMeshlets: cuts the final triangle order into small clusters with
+//   bounds for culling them one by one
+// * Pure CPU, doesn't touch GL
+// ---
+namespace MeshProcessing {
+
+// Average cache miss ratio (misses per triangle, 0.5 at best, 3 at worst)
+// and average transform to vertex ratio (misses per vertex, 1 at best)
+struct CacheStats {
+    float ACMR = 0;
+    float ATVR = 0;
+};
+
+// FIFO cache of roughly what GPUs have
+static const unsigned ANALYSIS_CACHE_SIZE = 16;
+
+inline CacheStats AnalyzeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount,
+    unsigned cacheSize = ANALYSIS_CACHE_SIZE
+) {
+    std::vector<uint32_t> timestamps(vertexCount, 0);
+    std::vector<bool> used(vertexCount, false);
+    uint32_t time = cacheSize + 1;
+    size_t misses = 0, usedCount = 0;
+    for (uint32_t index: indices) {
+        if (time - timestamps[index] > cacheSize) {
+            timestamps[index] = time++;
+            ++misses;
+        }
+        if (!used[index]) {
+            used[index] = true;
+            ++usedCount;
+        }
+    }
+    CacheStats stats;
+    if (indices.size() >= 3)
+        stats.ACMR = float(misses) / (indices.size() / 3);
+    if (usedCount)
+        stats.ATVR = float(misses) / usedCount;
+    return stats;
+}
+
+namespace Detail {
+
+static const int FORSYTH_CACHE_SIZE = 32;
+
+inline float VertexScore(int cachePosition, uint32_t liveTriangles) {
+    if (liveTriangles == 0)
+        return -1;
+    float score = 0;
+    if (cachePosition >= 0) {
+        // The last triangle's vertices get a fixed score, so the
+        // next one doesn't just reuse its edge every time
+        if (cachePosition < 3)
+            score = 0.75f;
+        else
+            score = powf(1.0f - float(cachePosition - 3) / (FORSYTH_CACHE_SIZE - 3), 1.5f);
+    }
+    // Finish off vertices with few triangles left
+    score += 2.0f / sqrtf((float)liveTriangles);
+    return score;
+}
+
+// Per-vertex lists of the triangles using it
+struct Adjacency {
+    std::vector<uint32_t> Offsets;
+    std::vector<uint32_t> Counts;
+    std::vector<uint32_t> Triangles;
+
+    Adjacency(const std::vector<uint32_t>& indices, size_t vertexCount) {
+        Counts.assign(vertexCount, 0);
+        for (uint32_t index: indices)
+            ++Counts[index];
+        Offsets.assign(vertexCount + 1, 0);
+        for (size_t v=0; v<vertexCount; ++v)
+            Offsets[v+1] = Offsets[v] + Counts[v];
+        Triangles.resize(indices.size());
+        std::vector<uint32_t> fill(Offsets.begin(), Offsets.end() - 1);
+        for (size_t i=0; i<indices.size(); ++i)
+            Triangles[fill[indices[i]]++] = i / 3;
+    }
+    void Remove(uint32_t vertex, uint32_t triangle) {
+        uint32_t *list = &Triangles[Offsets[vertex]];
+        uint32_t &count = Counts[vertex];
+        for (uint32_t i=0; i<count; ++i) {
+            if (list[i] == triangle) {
+                list[i] = list[--count];
+                return;
+            }
+        }
+    }
+};
+
+} // namespace Detail
+
+inline void OptimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount) {
+    using namespace Detail;
+    const size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0)
+        return;
+
+    Adjacency adjacency(indices, vertexCount);
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScores(vertexCount);
+    for (size_t v=0; v<vertexCount; ++v)
+        vertexScores[v] = VertexScore(-1, adjacency.Counts[v]);
+    std::vector<float> triangleScores(triangleCount);
+    for (size_t t=0; t<triangleCount; ++t) {
+        triangleScores[t] = vertexScores[indices[t*3]] + vertexScores[indices[t*3+1]]
+            + vertexScores[indices[t*3+2]];
+    }
+    std::vector<bool> emitted(triangleCount, false);
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    std::vector<uint32_t> cache, newCache;
+    size_t cursor = 0; // For when nothing in the cache has triangles left
+
+    long best = std::max_element(triangleScores.begin(), triangleScores.end()) - triangleScores.begin();
+    while (result.size() < indices.size()) {
+        if (best < 0) {
+            while (emitted[cursor])
+                ++cursor;
+            best = cursor;
+        }
+        const uint32_t *tri = &indices[best*3];
+        result.insert(result.end(), tri, tri + 3);
+        emitted[best] = true;
+        for (int k=0; k<3; ++k)
+            adjacency.Remove(tri[k], best);
+
+        // The triangle's vertices go to the front, everything else shifts back
+        newCache.assign(tri, tri + 3);
+        for (uint32_t v: cache)
+            if (v != tri[0] && v != tri[1] && v != tri[2])
+                newCache.push_back(v);
+        for (size_t i=FORSYTH_CACHE_SIZE; i<newCache.size(); ++i)
+            cachePosition[newCache[i]] = -1;
+        if (newCache.size() > FORSYTH_CACHE_SIZE) {
+            // Evicted vertices still need their scores updated
+            for (size_t i=FORSYTH_CACHE_SIZE; i<newCache.size(); ++i) {
+                uint32_t v = newCache[i];
+                float score = VertexScore(-1, adjacency.Counts[v]);
+                float delta = score - vertexScores[v];
+                vertexScores[v] = score;
+                for (uint32_t j=0; j<adjacency.Counts[v]; ++j)
+                    triangleScores[adjacency.Triangles[adjacency.Offsets[v] + j]] += delta;
+            }
+            newCache.resize(FORSYTH_CACHE_SIZE);
+        }
+        cache.swap(newCache);
+
+        best = -1;
+        float bestScore = -1;
+        for (size_t i=0; i<cache.size(); ++i) {
+            uint32_t v = cache[i];
+            cachePosition[v] = i;
+            float score = VertexScore(i, adjacency.Counts[v]);
+            float delta = score - vertexScores[v];
+            vertexScores[v] = score;
+            for (uint32_t j=0; j<adjacency.Counts[v]; ++j) {
+                uint32_t t = adjacency.Triangles[adjacency.Offsets[v] + j];
+                triangleScores[t] += delta;
+            }
+        }
+        for (uint32_t v: cache) {
+            for (uint32_t j=0; j<adjacency.Counts[v]; ++j) {
+                uint32_t t = adjacency.Triangles[adjacency.Offsets[v] + j];
+                if (triangleScores[t] > bestScore) {
+                    bestScore = triangleScores[t];
+                    best = t;
+                }
+            }
+        }
+    }
+    indices.swap(result);
+}
+
+// Expects cache optimized input. threshold is how much worse than that
+// the ACMR may get in exchange for less overdraw.
+inline void OptimizeOverdraw(std::vector<uint32_t>& indices, const float *positions,
+    size_t vertexCount, float threshold = 1.05f
+) {
+    const size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0)
+        return;
+
+    // FIFO cache simulation, same as AnalyzeVertexCache
+    const unsigned cacheSize = ANALYSIS_CACHE_SIZE;
+    std::vector<uint32_t> timestamps(vertexCount, 0);
+    uint32_t time = cacheSize + 1;
+    auto misses = [&](size_t t) {
+        int m = 0;
+        for (int k=0; k<3; ++k) {
+            uint32_t v = indices[t*3 + k];
+            if (time - timestamps[v] > cacheSize) {
+                timestamps[v] = time++;
+                ++m;
+            }
+        }
+        return m;
+    };
+    auto flush = [&]() { time += cacheSize + 1; };
+
+    // Hard boundaries: triangles that miss on all three vertices start
+    // over anyway, reordering there costs nothing. The first triangle
+    // always starts a cluster, even if it's degenerate and misses less.
+    std::vector<size_t> hard = {0};
+    for (size_t t=0; t<triangleCount; ++t)
+        if (misses(t) == 3 && t > 0)
+            hard.push_back(t);
+    hard.push_back(triangleCount);
+
+    // Soft boundaries: split hard clusters further wherever the running
+    // ACMR is already within threshold of the cluster's
+    std::vector<size_t> clusters;
+    for (size_t h=0; h+1<hard.size(); ++h) {
+        size_t start = hard[h], end = hard[h+1];
+        flush();
+        size_t clusterMisses = 0;
+        for (size_t t=start; t<end; ++t)
+            clusterMisses += misses(t);
+        float limit = threshold * clusterMisses / (end - start);
+
+        flush();
+        size_t runningMisses = 0, clusterStart = start;
+        clusters.push_back(start);
+        for (size_t t=start; t<end; ++t) {
+            runningMisses += misses(t);
+            if (t+1 < end && float(runningMisses) / (t+1 - clusterStart) <= limit) {
+                clusters.push_back(t+1);
+                clusterStart = t+1;
+                runningMisses = 0;
+                flush();
+            }
+        }
+    }
+    clusters.push_back(triangleCount);
+
+    // Outward facing clusters first, they're likely to hide the rest
+    double center[3] = {0, 0, 0};
+    for (size_t v=0; v<vertexCount; ++v)
+        for (int c=0; c<3; ++c)
+            center[c] += positions[v*3 + c];
+    for (int c=0; c<3; ++c)
+        center[c] /= std::max<size_t>(vertexCount, 1);
+
+    const size_t clusterCount = clusters.size() - 1;
+    std::vector<float> keys(clusterCount);
+    for (size_t c=0; c<clusterCount; ++c) {
+        double centroid[3] = {0, 0, 0}, normal[3] = {0, 0, 0}, area = 0;
+        for (size_t t=clusters[c]; t<clusters[c+1]; ++t) {
+            const float *p0 = &positions[indices[t*3] * 3];
+            const float *p1 = &positions[indices[t*3+1] * 3];
+            const float *p2 = &positions[indices[t*3+2] * 3];
+            double e1[3] = {p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2]};
+            double e2[3] = {p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2]};
+            double n[3] = {e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0]};
+            double a = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]) / 2;
+            for (int k=0; k<3; ++k) {
+                centroid[k] += a * (p0[k] + p1[k] + p2[k]) / 3;
+                normal[k] += n[k];
+            }
+            area += a;
+        }
+        double key = 0, normalLength = sqrt(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+        if (area > 0 && normalLength > 0) {
+            for (int k=0; k<3; ++k)
+                key += (centroid[k] / area - center[k]) * normal[k] / normalLength;
+        }
+        keys[c] = key;
+    }
+    std::vector<size_t> order(clusterCount);
+    for (size_t c=0; c<clusterCount; ++c)
+        order[c] = c;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return keys[a] > keys[b];
+    });
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    for (size_t c: order)
+        result.insert(result.end(), indices.begin() + clusters[c]*3, indices.begin() + clusters[c+1]*3);
+    indices.swap(result);
+}
+
+// Renumbers vertices in order of first use, rewriting indices. Returns
+// remap[old] = new, unused vertices go to the end.
+inline std::vector<uint32_t> OptimizeVertexFetch(std::vector<uint32_t>& indices, size_t vertexCount) {
+    const uint32_t UNUSED = ~0u;
+    std::vector<uint32_t> remap(vertexCount, UNUSED);
+    uint32_t next = 0;
+    for (uint32_t& index: indices) {
+        if (remap[index] == UNUSED)
+            remap[index] = next++;
+        index = remap[index];
+    }
+    for (uint32_t& r: remap)
+        if (r == UNUSED)
+            r = next++;
+    return remap;
+}
+
+// One attribute stream for WeldVertices. Components closer than
+// Tolerance count as equal (0 = bitwise equal).
+struct WeldStream {
+    const float *Data;
+    int Components;
+    float Tolerance;
+};
+
+// Returns remap[old] = new, new vertices numbered in order of first
+// appearance (see CompactStream). Vertices are hashed on their attributes
+// snapped to a grid of Tolerance sized cells, then compared exactly
+// against the candidates in their cell. Near-equal values that land on
+// different sides of a cell border aren't merged, which only costs a
+// little compaction.
+inline std::vector<uint32_t> WeldVertices(const std::vector<WeldStream>& streams,
+    size_t vertexCount, size_t& uniqueCount
+) {
+    auto cell = [](float value, float tolerance) -> uint64_t {
+        if (tolerance <= 0) {
+            uint32_t bits;
+            memcpy(&bits, &value, 4);
+            return bits;
+        }
+        return (uint64_t)(int64_t)floorf(value / tolerance);
+    };
+    auto hashVertex = [&](size_t v) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (const WeldStream& stream: streams) {
+            for (int c=0; c<stream.Components; ++c) {
+                hash ^= cell(stream.Data[v*stream.Components + c], stream.Tolerance);
+                hash *= 0x100000001b3ull;
+            }
+        }
+        return hash;
+    };
+    auto matches = [&](size_t a, size_t b) {
+        for (const WeldStream& stream: streams) {
+            for (int c=0; c<stream.Components; ++c) {
+                float va = stream.Data[a*stream.Components + c];
+                float vb = stream.Data[b*stream.Components + c];
+                if (fabsf(va - vb) > stream.Tolerance)
+                    return false;
+            }
+        }
+        return true;
+    };
+
+    std::vector<uint32_t> remap(vertexCount);
+    std::vector<uint32_t> representatives; // Old index of each new vertex
+    std::unordered_multimap<uint64_t, uint32_t> buckets; // Hash -> new index
+    buckets.reserve(vertexCount);
+    for (size_t v=0; v<vertexCount; ++v) {
+        uint64_t hash = hashVertex(v);
+        auto range = buckets.equal_range(hash);
+        bool merged = false;
+        for (auto it=range.first; it!=range.second; ++it) {
+            if (matches(representatives[it->second], v)) {
+                remap[v] = it->second;
+                merged = true;
+                break;
+            }
+        }
+        if (!merged) {
+            remap[v] = representatives.size();
+            buckets.emplace(hash, (uint32_t)representatives.size());
+            representatives.push_back(v);
+        }
+    }
+    uniqueCount = representatives.size();
+    return remap;
+}
+
+// Applies a many to one remap from WeldVertices to a stream,
+// keeping the first of each merged group
+template<class T>
+void CompactStream(std::vector<T>& stream, const std::vector<uint32_t>& remap, size_t uniqueCount) {
+    if (stream.empty())
+        return;
+    std::vector<T> result(uniqueCount);
+    std::vector<bool> written(uniqueCount, false);
+    for (size_t i=0; i<stream.size(); ++i) {
+        if (!written[remap[i]]) {
+            result[remap[i]] = stream[i];
+            written[remap[i]] = true;
+        }
+    }
+    stream.swap(result);
+}
+
+inline void RemapIndices(std::vector<uint32_t>& indices, const std::vector<uint32_t>& remap) {
+    for (uint32_t& index: indices)
+        index = remap[index];
+}
+
+// Drops triangles that use a vertex twice (welding can make them),
+// returns how many
+inline size_t RemoveDegenerateTriangles(std::vector<uint32_t>& indices) {
+    size_t kept = 0;
+    for (size_t t=0; t+2<indices.size(); t+=3) {
+        const uint32_t a = indices[t], b = indices[t+1], c = indices[t+2];
+        if (a == b || b == c || a == c)
+            continue;
+        indices[kept++] = a;
+        indices[kept++] = b;
+        indices[kept++] = c;
+    }
+    const size_t removed = indices.size() / 3 - kept / 3;
+    indices.resize(kept);
+    return removed;
+}
+
+// Applies a remap from OptimizeVertexFetch to one vertex stream
+template<class T>
+void RemapStream(std::vector<T>& stream, const std::vector<uint32_t>& remap) {
+    if (stream.empty())
+        return;
+    std::vector<T> result(stream.size());
+    for (size_t i=0; i<stream.size(); ++i)
+        result[remap[i]] = stream[i];
+    stream.swap(result);
+}
+
+namespace Detail {
+
+// Sum of squared distances to a set of planes, as the symmetric 4x4
+// matrix sum(p p^T), p = (a, b, c, d)
+struct Quadric {
+    double XX = 0, XY = 0, XZ = 0, XW = 0, YY = 0, YZ = 0, YW = 0, ZZ = 0, ZW = 0, WW = 0;
+    double Weight = 0;
+
+    void AddPlane(double a, double b, double c, double d, double weight) {
+        XX += weight*a*a; XY += weight*a*b; XZ += weight*a*c; XW += weight*a*d;
+        YY += weight*b*b; YZ += weight*b*c; YW += weight*b*d;
+        ZZ += weight*c*c; ZW += weight*c*d;
+        WW += weight*d*d;
+        Weight += weight;
+    }
+    void Add(const Quadric& q) {
+        XX += q.XX; XY += q.XY; XZ += q.XZ; XW += q.XW;
+        YY += q.YY; YZ += q.YZ; YW += q.YW;
+        ZZ += q.ZZ; ZW += q.ZW;
+        WW += q.WW;
+        Weight += q.Weight;
+    }
+    double Evaluate(const float *p) const {
+        double x = p[0], y = p[1], z = p[2];
+        double e = XX*x*x + YY*y*y + ZZ*z*z + WW
+            + 2 * (XY*x*y + XZ*x*z + YZ*y*z + XW*x + YW*y + ZW*z);
+        return e > 0 ? e : 0;
+    }
+};
+
+inline void TriangleNormal(const float *a, const float *b, const float *c, double n[3]) {
+    double e0[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+    double e1[3] = {c[0]-a[0], c[1]-a[1], c[2]-a[2]};
+    n[0] = e0[1]*e1[2] - e0[2]*e1[1];
+    n[1] = e0[2]*e1[0] - e0[0]*e1[2];
+    n[2] = e0[0]*e1[1] - e0[1]*e1[0];
+}
+
+} // namespace Detail
+
+// Collapses edges, cheapest first, until at most targetTriangles are left
+// (or nothing more can go). Vertices only ever move onto other vertices,
+// so the result indexes the same vertex buffer. Vertices on attribute
+// seams (a position shared by several vertices: UV or normal splits) and
+// on open borders are locked, which keeps textures and silhouettes from
+// tearing. error gets the largest distance, in model units, a collapse
+// moved the surface by (as estimated by the quadrics).
+inline std::vector<uint32_t> Simplify(const std::vector<uint32_t>& indices,
+    const float *positions, size_t vertexCount, size_t targetTriangles, float& error
+) {
+    using namespace Detail;
+    error = 0;
+    std::vector<uint32_t> triangles(indices.begin(), indices.end() - indices.size() % 3);
+    size_t triangleCount = triangles.size() / 3;
+    if (triangleCount <= targetTriangles)
+        return triangles;
+
+    // Seams: welding on position alone merges the split vertices
+    std::vector<uint32_t> positionIds;
+    {
+        size_t uniquePositions;
+        std::vector<WeldStream> streams = {{positions, 3, 0}};
+        positionIds = WeldVertices(streams, vertexCount, uniquePositions);
+    }
+    std::vector<uint32_t> idUses(vertexCount, 0);
+    for (size_t v=0; v<vertexCount; ++v)
+        ++idUses[positionIds[v]];
+    std::vector<bool> locked(vertexCount, false);
+    for (size_t v=0; v<vertexCount; ++v)
+        locked[v] = idUses[positionIds[v]] > 1;
+
+    // Borders: edges (between positions) used by only one triangle
+    std::unordered_map<uint64_t, uint32_t> edgeUses;
+    edgeUses.reserve(triangles.size());
+    auto edgeKey = [&](uint32_t a, uint32_t b) {
+        uint64_t pa = positionIds[a], pb = positionIds[b];
+        return pa < pb ? (pa << 32 | pb) : (pb << 32 | pa);
+    };
+    for (size_t i=0; i<triangles.size(); i+=3)
+        for (int k=0; k<3; ++k)
+            ++edgeUses[edgeKey(triangles[i+k], triangles[i+(k+1)%3])];
+    for (size_t i=0; i<triangles.size(); i+=3) {
+        for (int k=0; k<3; ++k) {
+            uint32_t a = triangles[i+k], b = triangles[i+(k+1)%3];
+            if (edgeUses[edgeKey(a, b)] == 1)
+                locked[a] = locked[b] = true;
+        }
+    }
+
+    // Area weighted plane quadrics, and the triangles around each vertex
+    std::vector<Quadric> quadrics(vertexCount);
+    std::vector<std::vector<uint32_t>> vertexTriangles(vertexCount);
+    for (size_t t=0; t<triangleCount; ++t) {
+        const uint32_t *tri = &triangles[t*3];
+        const float *a = positions + tri[0]*3;
+        double n[3];
+        TriangleNormal(a, positions + tri[1]*3, positions + tri[2]*3, n);
+        double length = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+        if (length > 0) {
+            for (double& c: n)
+                c /= length;
+            double d = -(n[0]*a[0] + n[1]*a[1] + n[2]*a[2]);
+            for (int k=0; k<3; ++k)
+                quadrics[tri[k]].AddPlane(n[0], n[1], n[2], d, length / 2);
+        }
+        for (int k=0; k<3; ++k)
+            vertexTriangles[tri[k]].push_back(t);
+    }
+
+    struct Collapse {
+        double Cost;
+        uint32_t From, To;
+        uint32_t FromVersion, ToVersion;
+        bool operator<(const Collapse& other) const { return Cost > other.Cost; } // Cheapest on top
+    };
+    std::priority_queue<Collapse> queue;
+    std::vector<uint32_t> version(vertexCount, 0);
+    std::vector<bool> removed(vertexCount, false);
+    std::vector<bool> triangleAlive(triangleCount, true);
+    auto push = [&](uint32_t from, uint32_t to) {
+        if (locked[from] || from == to)
+            return;
+        queue.push({quadrics[from].Evaluate(positions + to*3), from, to, version[from], version[to]});
+    };
+    for (size_t i=0; i<triangles.size(); i+=3) {
+        for (int k=0; k<3; ++k) {
+            push(triangles[i+k], triangles[i+(k+1)%3]);
+            push(triangles[i+(k+1)%3], triangles[i+k]);
+        }
+    }
+
+    while (triangleCount > targetTriangles && !queue.empty()) {
+        Collapse c = queue.top();
+        queue.pop();
+        if (removed[c.From] || removed[c.To]
+            || version[c.From] != c.FromVersion || version[c.To] != c.ToVersion)
+            continue;
+
+        // Moving From onto To must not flip any triangle that survives
+        bool flips = false;
+        for (uint32_t t: vertexTriangles[c.From]) {
+            if (!triangleAlive[t])
+                continue;
+            const uint32_t *tri = &triangles[t*3];
+            if (tri[0] == c.To || tri[1] == c.To || tri[2] == c.To)
+                continue;
+            const float *p[3], *moved[3];
+            for (int k=0; k<3; ++k) {
+                p[k] = positions + tri[k]*3;
+                moved[k] = tri[k] == c.From ? positions + c.To*3 : p[k];
+            }
+            double before[3], after[3];
+            TriangleNormal(p[0], p[1], p[2], before);
+            TriangleNormal(moved[0], moved[1], moved[2], after);
+            if (before[0]*after[0] + before[1]*after[1] + before[2]*after[2] <= 0) {
+                flips = true;
+                break;
+            }
+        }
+        if (flips)
+            continue;
+
+        for (uint32_t t: vertexTriangles[c.From]) {
+            if (!triangleAlive[t])
+                continue;
+            uint32_t *tri = &triangles[t*3];
+            if (tri[0] == c.To || tri[1] == c.To || tri[2] == c.To) {
+                triangleAlive[t] = false;
+                --triangleCount;
+                continue;
+            }
+            for (int k=0; k<3; ++k)
+                if (tri[k] == c.From)
+                    tri[k] = c.To;
+            vertexTriangles[c.To].push_back(t);
+        }
+        const Quadric& q = quadrics[c.From];
+        if (q.Weight > 0)
+            error = std::max(error, (float)sqrt(c.Cost / q.Weight));
+        quadrics[c.To].Add(q);
+        removed[c.From] = true;
+        vertexTriangles[c.From].clear();
+        ++version[c.To];
+
+        // Prune the dead and re-queue To's edges with its new quadric
+        std::vector<uint32_t>& around = vertexTriangles[c.To];
+        around.erase(std::remove_if(around.begin(), around.end(),
+            [&](uint32_t t) { return !triangleAlive[t]; }), around.end());
+        std::sort(around.begin(), around.end());
+        around.erase(std::unique(around.begin(), around.end()), around.end());
+        for (uint32_t t: around) {
+            for (int k=0; k<3; ++k) {
+                push(c.To, triangles[t*3 + k]);
+                push(triangles[t*3 + k], c.To);
+            }
+        }
+    }
+
+    std::vector<uint32_t> result;
+    result.reserve(triangleCount * 3);
+    for (size_t t=0; t<triangleAlive.size(); ++t)
+        if (triangleAlive[t])
+            result.insert(result.end(), &triangles[t*3], &triangles[t*3] + 3);
+    return result;
+}
+
+// A run of triangles in the index buffer small enough to cull on its own.
+// Stored as is in the mesh cache.
+struct Meshlet {
+    uint32_t ElementOffset; // First index
+    uint32_t ElementCount;
+    float Center[3]; // Bounding sphere
+    float Radius;
+    // Normal cone, all triangles face within it. ConeCutoff is the sine
+    // of its half angle, 1 when the cone is too wide to ever cull.
+    float ConeAxis[3];
+    float ConeCutoff;
+};
+
+static const size_t MESHLET_MAX_VERTICES = 64;
+static const size_t MESHLET_MAX_TRIANGLES = 124;
+
+// Walks the (cache optimized) triangle order and starts a new meshlet
+// whenever the next triangle would bring in more than maxVertices unique
+// vertices or maxTriangles triangles. Triangles stay where they are, so
+// a meshlet is just a range of indices, and the vertex cache order
+// survives.
+inline std::vector<Meshlet> BuildMeshlets(const std::vector<uint32_t>& indices,
+    const float *positions, size_t vertexCount,
+    size_t maxVertices = MESHLET_MAX_VERTICES, size_t maxTriangles = MESHLET_MAX_TRIANGLES
+) {
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> stamp(vertexCount, 0); // Meshlet number + 1 a vertex was last seen in
+    std::vector<uint32_t> vertices;
+
+    auto finish = [&](size_t begin, size_t end) {
+        Meshlet m = {};
+        m.ElementOffset = begin;
+        m.ElementCount = end - begin;
+
+        // Sphere around the box center, good enough for culling
+        float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+        for (uint32_t v: vertices) {
+            for (int c=0; c<3; ++c) {
+                lo[c] = std::min(lo[c], positions[v*3 + c]);
+                hi[c] = std::max(hi[c], positions[v*3 + c]);
+            }
+        }
+        float radius2 = 0;
+        for (int c=0; c<3; ++c)
+            m.Center[c] = (lo[c] + hi[c]) / 2;
+        for (uint32_t v: vertices) {
+            float d2 = 0;
+            for (int c=0; c<3; ++c) {
+                float d = positions[v*3 + c] - m.Center[c];
+                d2 += d * d;
+            }
+            radius2 = std::max(radius2, d2);
+        }
+        m.Radius = sqrtf(radius2);
+
+        // Cone around the average face normal, degenerate triangles don't count
+        std::vector<float> normals;
+        normals.reserve(m.ElementCount);
+        float axis[3] = {0, 0, 0};
+        for (size_t i=begin; i<end; i+=3) {
+            const float *a = positions + indices[i]*3;
+            const float *b = positions + indices[i+1]*3;
+            const float *c = positions + indices[i+2]*3;
+            float e0[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+            float e1[3] = {c[0]-a[0], c[1]-a[1], c[2]-a[2]};
+            float n[3] = {
+                e0[1]*e1[2] - e0[2]*e1[1],
+                e0[2]*e1[0] - e0[0]*e1[2],
+                e0[0]*e1[1] - e0[1]*e1[0],
+            };
+            float length = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            if (length == 0)
+                continue;
+            for (int k=0; k<3; ++k) {
+                normals.push_back(n[k] / length);
+                axis[k] += n[k] / length;
+            }
+        }
+        float axisLength = sqrtf(axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2]);
+        float minDot = axisLength > 0 ? 1 : -1;
+        for (int k=0; k<3; ++k)
+            m.ConeAxis[k] = axisLength > 0 ? axis[k] / axisLength : 0;
+        for (size_t i=0; i<normals.size(); i+=3) {
+            float d = normals[i]*m.ConeAxis[0] + normals[i+1]*m.ConeAxis[1] + normals[i+2]*m.ConeAxis[2];
+            minDot = std::min(minDot, d);
+        }
+        // Backfacing from everywhere within the cone widened by 90 degrees,
+        // whose half angle has a cosine of -sin(spread)
+        m.ConeCutoff = minDot <= 0 ? 1 : sqrtf(1 - minDot * minDot);
+        meshlets.push_back(m);
+        vertices.clear();
+    };
+
+    size_t begin = 0;
+    for (size_t i=0; i+2<indices.size(); i+=3) {
+        const uint32_t current = meshlets.size() + 1;
+        size_t newVertices = 0;
+        for (int k=0; k<3; ++k)
+            newVertices += stamp[indices[i+k]] != current;
+        // a, a, b triangles would count a twice, but that only ends a meshlet early
+        if (vertices.size() + newVertices > maxVertices || (i - begin) / 3 + 1 > maxTriangles) {
+            finish(begin, i);
+            begin = i;
+        }
+        const uint32_t now = meshlets.size() + 1;
+        for (int k=0; k<3; ++k) {
+            uint32_t v = indices[i+k];
+            if (stamp[v] != now) {
+                stamp[v] = now;
+                vertices.push_back(v);
+            }
+        }
+    }
+    const size_t end = indices.size() - indices.size() % 3;
+    if (begin < end)
+        finish(begin, end);
+    return meshlets;
+}
+
+// Whether every triangle of the meshlet faces away from eye (in the
+// meshlet's space). Only valid with back face culling on.
+inline bool IsBackfacing(const Meshlet& m, const float eye[3]) {
+    float d[3] = {m.Center[0]-eye[0], m.Center[1]-eye[1], m.Center[2]-eye[2]};
+    float distance = sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+    float along = d[0]*m.ConeAxis[0] + d[1]*m.ConeAxis[1] + d[2]*m.ConeAxis[2];
+    return along >= m.ConeCutoff * distance + m.Radius;
+}
+
+} // namespace MeshProcessing
@@ -0,0 +1,49 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Draws in state change order
+// * Draws are submitted with a 64-bit key and an index into wherever the
+//   caller keeps them, Sort() orders them by key
+// * MakeKey packs the state from most to least expensive to switch, so
+//   draws sharing it end up next to each other:
+//     pass (4) | alpha clipped (1) | program (11) | 48 bits of order
+//   Opaque draws order by depth, then material: front to back, for
+//   early-Z. Alpha clipped ones (last, they can't use early-Z anyway)
+//   by material, then depth.
+// * Doesn't touch GL
+// ---
+class RenderQueue {
+public:
+    struct Entry {
+        uint64_t Key;
+        uint32_t Item;
+
+        bool operator<(const Entry& o) const {
+            return Key != o.Key ? Key < o.Key : Item < o.Item; // Stable
+        }
+    };
+
+    // depth in [0, 1], 0 = nearest
+    static uint64_t MakeKey(unsigned pass, bool alphaClip, unsigned program, uint32_t material,
+        float depth
+    ) {
+        const uint64_t bucket = (uint64_t)(std::min(std::max(depth, 0.0f), 1.0f) * 0xFFFF);
+        const uint64_t order = alphaClip ? (uint64_t)material << 16 | bucket
+                                         : bucket << 32 | material;
+        return (uint64_t)(pass & 0xF) << 60 | (uint64_t)alphaClip << 59
+            | (uint64_t)(program & 0x7FF) << 48 | order;
+    }
+
+    void Clear() { Entries.clear(); }
+    void Submit(uint64_t key, uint32_t item) { Entries.push_back({key, item}); }
+    void Sort() { std::sort(Entries.begin(), Entries.end()); }
+
+    const std::vector<Entry>& GetEntries() const { return Entries; }
+    size_t Size() const { return Entries.size(); }
+
+private:
+    std::vector<Entry> Entries;
+};
@@ -0,0 +1,285 @@
+#pragma once
+#include "threadpool.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <typeindex>
+#include <utility>
+
+// Asynchronous, thread-safe resource cache
+// * Load() returns a Handle right away. Until the resource is ready the
+//   handle serves a placeholder (e.g. Material's white.png), so the
+//   renderer never has to wait or check.
+// * Loading happens in two steps, a resource type provides both:
+//     typedef ... Prepared;
+//     static Prepared Prepare(string path); // CPU work (IO, decoding, importing),
+//                                           // runs on the ThreadPool
+//     Resource(Prepared&& prepared);        // GL work, runs on the render
+//                                           // thread from Update()/Wait()
+// * Resources nobody holds a handle to anymore are evicted by
+//   CollectGarbage()
+// * Doesn't touch GL itself
+// ---
+
+// Load priorities, higher ones are prepared first
+enum LoadPriority {
+    LowPriority = 0,
+    NormalPriority = 1,
+    HighPriority = 2,
+};
+
+template<class Resource>
+struct ResourceState {
+    std::string Path;
+    std::shared_ptr<Resource> Loaded; // Render thread only
+    std::shared_ptr<Resource> Placeholder;
+    std::atomic<bool> Ready{false};
+    std::atomic<bool> Cancelled{false};
+};
+
+template<class Resource>
+class Handle {
+    std::shared_ptr<ResourceState<Resource>> State;
+
+public:
+    Handle() {}
+    explicit Handle(std::shared_ptr<ResourceState<Resource>> state): State(std::move(state)) {}
+
+    bool IsReady() const { return State && State->Ready; }
+    bool IsCancelled() const { return State && State->Cancelled && !State->Ready; }
+    const std::string& GetPath() const { return State->Path; }
+
+    // The resource, or the placeholder while it's still loading.
+    // Render thread only.
+    std::shared_ptr<Resource> Get() const {
+        if (!State)
+            return nullptr;
+        return State->Ready ? State->Loaded : State->Placeholder;
+    }
+    Resource *operator->() const { return Get().get(); }
+    explicit operator bool() const { return Get() != nullptr; }
+
+    // Drops the load (for everyone sharing it) unless it's already done,
+    // the handle keeps serving the placeholder. Loading the same path
+    // again starts over.
+    void Cancel() {
+        if (State)
+            State->Cancelled = true;
+    }
+};
+
+class ResourceManager {
+    ThreadPool& Workers;
+
+    // Keyed on (type, path), values are ResourceState<type>
+    std::mutex CacheMutex;
+    std::map<std::pair<std::type_index, std::string>, std::shared_ptr<void>> Cache;
+
+    // GL side of finished loads, waiting for the render thread
+    std::mutex FinalizeMutex;
+    std::condition_variable FinalizeAvailable;
+    std::deque<std::function<void()>> Finalizers;
+
+    // Loads in flight, and stats for the current burst of them
+    // (all under CacheMutex)
+    int PendingCount = 0;
+    int BurstLoads = 0;
+    double BurstPrepareMs = 0;
+    std::chrono::steady_clock::time_point BurstStart;
+
+    static const int COLLECT_INTERVAL = 120; // Updates
+    int UpdatesSinceCollect = 0;
+
+    static double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Finds the cache entry for path, or makes a new one (created=true).
+    // A cancelled, unfinished entry is replaced.
+    template<class Resource>
+    std::shared_ptr<ResourceState<Resource>> Acquire(const std::string& path,
+        std::shared_ptr<Resource> placeholder, bool& created
+    ) {
+        typedef ResourceState<Resource> State;
+        std::lock_guard<std::mutex> lock(CacheMutex);
+        auto key = std::make_pair(std::type_index(typeid(Resource)), path);
+        auto it = Cache.find(key);
+        if (it != Cache.end()) {
+            auto state = std::static_pointer_cast<State>(it->second);
+            if (state->Ready || !state->Cancelled) {
+                created = false;
+                return state;
+            }
+        }
+        auto state = std::make_shared<State>();
+        state->Path = path;
+        state->Placeholder = placeholder;
+        Cache[key] = state;
+        created = true;
+        return state;
+    }
+
+    void PushFinalizer(std::function<void()> finalizer) {
+        {
+            std::lock_guard<std::mutex> lock(FinalizeMutex);
+            Finalizers.push_back(std::move(finalizer));
+        }
+        FinalizeAvailable.notify_one();
+    }
+    bool RunFinalizer(bool wait) {
+        std::function<void()> finalizer;
+        {
+            std::unique_lock<std::mutex> lock(FinalizeMutex);
+            if (wait)
+                FinalizeAvailable.wait(lock, [this]{ return !Finalizers.empty(); });
+            if (Finalizers.empty())
+                return false;
+            finalizer = std::move(Finalizers.front());
+            Finalizers.pop_front();
+        }
+        finalizer();
+        return true;
+    }
+
+    void StartLoad() {
+        std::lock_guard<std::mutex> lock(CacheMutex);
+        if (PendingCount++ == 0) {
+            BurstStart = std::chrono::steady_clock::now();
+            BurstLoads = 0;
+            BurstPrepareMs = 0;
+        }
+    }
+    void FinishLoad(double prepareMs) {
+        std::lock_guard<std::mutex> lock(CacheMutex);
+        ++BurstLoads;
+        BurstPrepareMs += prepareMs;
+        if (--PendingCount == 0) {
+            Trace::Instant("Pending loads done", "load");
+            double wallMs = MillisecondsSince(BurstStart);
+            std::cerr << "Loaded " << BurstLoads << " resources on "
+                      << Workers.GetThreadCount() << " threads in " << wallMs
+                      << " ms (preparing them one by one would take " << BurstPrepareMs << " ms, "
+                      << BurstPrepareMs / std::max(wallMs, 0.001) << "x)" << std::endl;
+        }
+    }
+
+    template<class Resource>
+    void Start(std::shared_ptr<ResourceState<Resource>> state, int priority) {
+        typedef typename Resource::Prepared Prepared;
+        StartLoad();
+        Workers.Submit([this, state] {
+            if (state->Cancelled) {
+                PushFinalizer([this] { FinishLoad(0); });
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            std::shared_ptr<Prepared> prepared;
+            {
+                TRACE_SCOPE("Prepare " + state->Path, "load");
+                prepared = std::make_shared<Prepared>(Resource::Prepare(state->Path));
+            }
+            double prepareMs = MillisecondsSince(start);
+            PushFinalizer([this, state, prepared, prepareMs] {
+                if (!state->Cancelled) {
+                    TRACE_SCOPE("Finalize " + state->Path, "load");
+                    state->Loaded = std::make_shared<Resource>(std::move(*prepared));
+                    state->Ready = true;
+                }
+                FinishLoad(prepareMs);
+            });
+        }, priority);
+    }
+
+public:
+    explicit ResourceManager(ThreadPool& workers): Workers(workers) {}
+    ResourceManager(const ResourceManager&) = delete;
+    ResourceManager& operator=(const ResourceManager&) = delete;
+
+    // Starts loading path in the background, unless it's already loaded
+    // or on its way. Safe to call from any thread.
+    template<class Resource>
+    Handle<Resource> Load(const std::string& path,
+        std::shared_ptr<Resource> placeholder = nullptr, int priority = NormalPriority
+    ) {
+        bool created;
+        auto state = Acquire<Resource>(path, placeholder, created);
+        if (created)
+            Start(state, priority);
+        return Handle<Resource>(state);
+    }
+
+    // Blocking load, for things we can't do without (shaders, the
+    // placeholders themselves). Render thread only.
+    template<class Resource>
+    Handle<Resource> LoadNow(const std::string& path) {
+        bool created;
+        auto state = Acquire<Resource>(path, std::shared_ptr<Resource>(), created);
+        Handle<Resource> handle(state);
+        if (created) {
+            TRACE_SCOPE("Load now " + path, "load");
+            // Skip the round trip through the pool
+            auto prepared = Resource::Prepare(path);
+            state->Loaded = std::make_shared<Resource>(std::move(prepared));
+            state->Ready = true;
+        } else {
+            Wait(handle);
+        }
+        return handle;
+    }
+
+    // Finalizes loads until handle is ready (or cancelled). Render thread only.
+    template<class Resource>
+    void Wait(const Handle<Resource>& handle) {
+        while (!handle.IsReady() && !handle.IsCancelled())
+            RunFinalizer(true);
+    }
+
+    // Call once per frame on the render thread. Finalizes finished loads
+    // for up to budgetMs (at least one, so loading always progresses).
+    void Update(double budgetMs) {
+        auto start = std::chrono::steady_clock::now();
+        while (RunFinalizer(false) && MillisecondsSince(start) < budgetMs)
+            ;
+        if (++UpdatesSinceCollect >= COLLECT_INTERVAL)
+            CollectGarbage();
+    }
+
+    // Evicts everything only the cache still references. Releasing one
+    // resource can orphan others (a Model's textures), so go until nothing
+    // changes. Render thread only, resources free their GL objects.
+    size_t CollectGarbage() {
+        UpdatesSinceCollect = 0;
+        size_t evicted = 0;
+        for (;;) {
+            std::vector<std::shared_ptr<void>> garbage;
+            {
+                std::lock_guard<std::mutex> lock(CacheMutex);
+                for (auto it=Cache.begin(); it!=Cache.end();) {
+                    if (it->second.use_count() == 1) {
+                        garbage.push_back(std::move(it->second));
+                        it = Cache.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            if (garbage.empty())
+                break;
+            evicted += garbage.size();
+            // Destroyed here, outside the lock
+        }
+        if (evicted)
+            std::cerr << "Evicted " << evicted << " unused resources" << std::endl;
+        return evicted;
+    }
+
+    int GetPendingCount() {
+        std::lock_guard<std::mutex> lock(CacheMutex);
+        return PendingCount;
+    }
+};
@@ -0,0 +1,454 @@
+// Offline texture cooker
+// * Builds a gamma correct mip chain on the CPU
+// * Compresses every level to BC1/BC3/BC4/BC5 on all cores
+// * Writes foo.ktx2 next to foo.png, Texture picks it up when present
+//
+// Usage: ./TextureCooker [--force] [files or folders...]   (default: Data/textures)
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "ktx2.hpp"
+#include "threadpool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+namespace fs = std::filesystem;
+
+// Must match the default Gamma the geometry stage linearizes diffuse maps with
+const float GAMMA = 2.2f;
+
+enum TextureKind {
+    ColorTexture,   // Gamma encoded (diffuse maps)
+    LinearTexture,  // Specular/bump/mask data
+    NormalTexture,  // Tangent space normals
+};
+
+struct Pixel { float r, g, b, a; };
+
+// Linear float image, one per mip level
+struct FloatImage {
+    int Width = 0;
+    int Height = 0;
+    vector<Pixel> Pixels;
+
+    Pixel& At(int x, int y) { return Pixels[y * Width + x]; }
+    const Pixel& At(int x, int y) const {
+        x = std::min(x, Width-1);
+        y = std::min(y, Height-1);
+        return Pixels[y * Width + x];
+    }
+};
+
+// By the usual name suffixes, in any case (cube_norm.jpg, wall_NRM.png)
+TextureKind ClassifyTexture(const string& path) {
+    string name = fs::path(path).filename().string();
+    transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return tolower(c); });
+    auto has = [&](const char *s) { return name.find(s) != string::npos; };
+    if (has("_ddn") || has("_nrm") || has("_norm") || has("normal"))
+        return NormalTexture;
+    if (has("_bump") || has("_spec") || has("_mask"))
+        return LinearTexture;
+    return ColorTexture;
+}
+
+float ToLinear(uint8_t v, TextureKind kind) {
+    float f = v / 255.0f;
+    switch (kind) {
+        case ColorTexture: return pow(f, GAMMA);
+        case NormalTexture: return f * 2 - 1;
+        default: return f;
+    }
+}
+uint8_t FromLinear(float f, TextureKind kind) {
+    switch (kind) {
+        case ColorTexture: f = pow(std::max(f, 0.0f), 1 / GAMMA); break;
+        case NormalTexture: f = (f + 1) / 2; break;
+        default: break;
+    }
+    return (uint8_t)std::min(std::max(f * 255.0f + 0.5f, 0.0f), 255.0f);
+}
+
+// 2x2 box filter in linear space
+FloatImage Downsample(const FloatImage& src, TextureKind kind) {
+    FloatImage dst;
+    dst.Width = std::max(1, src.Width / 2);
+    dst.Height = std::max(1, src.Height / 2);
+    dst.Pixels.resize(dst.Width * dst.Height);
+    for (int y=0; y<dst.Height; ++y) {
+        for (int x=0; x<dst.Width; ++x) {
+            const Pixel *taps[4] = {
+                &src.At(2*x, 2*y), &src.At(2*x+1, 2*y),
+                &src.At(2*x, 2*y+1), &src.At(2*x+1, 2*y+1)
+            };
+            Pixel sum = {0, 0, 0, 0};
+            for (const Pixel *p: taps) {
+                sum.r += p->r; sum.g += p->g; sum.b += p->b; sum.a += p->a;
+            }
+            Pixel& out = dst.At(x, y);
+            out = {sum.r / 4, sum.g / 4, sum.b / 4, sum.a / 4};
+            if (kind == NormalTexture) {
+                float len = sqrt(out.r*out.r + out.g*out.g + out.b*out.b);
+                if (len > 1e-6f) {
+                    out.r /= len; out.g /= len; out.b /= len;
+                }
+            }
+        }
+    }
+    return dst;
+}
+
+// Block compression
+// -----------------
+typedef uint8_t Block[16][4]; // 4x4 RGBA8 texels
+
+uint16_t PackRGB565(const float c[3]) {
+    int r = (int)std::min(std::max(c[0] * 31 / 255 + 0.5f, 0.0f), 31.0f);
+    int g = (int)std::min(std::max(c[1] * 63 / 255 + 0.5f, 0.0f), 63.0f);
+    int b = (int)std::min(std::max(c[2] * 31 / 255 + 0.5f, 0.0f), 31.0f);
+    return (r << 11) | (g << 5) | b;
+}
+void UnpackRGB565(uint16_t c, float out[3]) {
+    out[0] = ((c >> 11) & 31) * 255.0f / 31;
+    out[1] = ((c >> 5) & 63) * 255.0f / 63;
+    out[2] = (c & 31) * 255.0f / 31;
+}
+
+// Picks the nearest of the 4 palette colors for each texel
+uint32_t FitBC1Indices(const Block& block, uint16_t c0, uint16_t c1, float *error) {
+    float palette[4][3];
+    UnpackRGB565(c0, palette[0]);
+    UnpackRGB565(c1, palette[1]);
+    for (int i=0; i<3; ++i) {
+        palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+        palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+    }
+    uint32_t indices = 0;
+    *error = 0;
+    for (int t=0; t<16; ++t) {
+        int best = 0;
+        float bestDist = 1e30f;
+        for (int p=0; p<4; ++p) {
+            float dr = block[t][0] - palette[p][0];
+            float dg = block[t][1] - palette[p][1];
+            float db = block[t][2] - palette[p][2];
+            float dist = dr*dr + dg*dg + db*db;
+            if (dist < bestDist) {
+                bestDist = dist;
+                best = p;
+            }
+        }
+        indices |= best << (2 * t);
+        *error += bestDist;
+    }
+    return indices;
+}
+
+// Always emits the 4 color mode (c0 > c1), which is also what BC3 expects
+void EncodeBC1(const Block& block, uint8_t *out) {
+    // Principal axis of the block colors
+    float mean[3] = {0, 0, 0};
+    for (int t=0; t<16; ++t)
+        for (int i=0; i<3; ++i)
+            mean[i] += block[t][i] / 16.0f;
+    float cov[6] = {0, 0, 0, 0, 0, 0};
+    for (int t=0; t<16; ++t) {
+        float d[3] = {block[t][0] - mean[0], block[t][1] - mean[1], block[t][2] - mean[2]};
+        cov[0] += d[0]*d[0]; cov[1] += d[0]*d[1]; cov[2] += d[0]*d[2];
+        cov[3] += d[1]*d[1]; cov[4] += d[1]*d[2]; cov[5] += d[2]*d[2];
+    }
+    float axis[3] = {1, 1, 1};
+    for (int iter=0; iter<8; ++iter) {
+        float v[3] = {
+            cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2],
+            cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2],
+            cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2],
+        };
+        float len = std::max(std::max(fabs(v[0]), fabs(v[1])), fabs(v[2]));
+        if (len < 1e-6f)
+            break;
+        for (int i=0; i<3; ++i)
+            axis[i] = v[i] / len;
+    }
+    float axisLen2 = axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2];
+    float minT = 1e30f, maxT = -1e30f;
+    for (int t=0; t<16; ++t) {
+        float proj = ((block[t][0] - mean[0]) * axis[0]
+            + (block[t][1] - mean[1]) * axis[1]
+            + (block[t][2] - mean[2]) * axis[2]) / axisLen2;
+        minT = std::min(minT, proj);
+        maxT = std::max(maxT, proj);
+    }
+    float hi[3], lo[3];
+    for (int i=0; i<3; ++i) {
+        hi[i] = mean[i] + axis[i] * maxT;
+        lo[i] = mean[i] + axis[i] * minT;
+    }
+
+    uint16_t c0 = PackRGB565(hi), c1 = PackRGB565(lo);
+    if (c0 < c1)
+        swap(c0, c1);
+    float error = 0;
+    uint32_t indices = c0 == c1 ? 0 : FitBC1Indices(block, c0, c1, &error);
+
+    // One least squares refinement of the endpoints for the chosen indices
+    if (c0 != c1) {
+        const float WEIGHTS[4] = {1, 0, 2.0f/3, 1.0f/3};
+        float aa = 0, bb = 0, ab = 0, ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0};
+        for (int t=0; t<16; ++t) {
+            float a = WEIGHTS[(indices >> (2*t)) & 3], b = 1 - a;
+            aa += a*a; bb += b*b; ab += a*b;
+            for (int i=0; i<3; ++i) {
+                ax[i] += a * block[t][i];
+                bx[i] += b * block[t][i];
+            }
+        }
+        float det = aa*bb - ab*ab;
+        if (fabs(det) > 1e-6f) {
+            float e0[3], e1[3];
+            for (int i=0; i<3; ++i) {
+                e0[i] = (ax[i]*bb - bx[i]*ab) / det;
+                e1[i] = (bx[i]*aa - ax[i]*ab) / det;
+            }
+            uint16_t r0 = PackRGB565(e0), r1 = PackRGB565(e1);
+            if (r0 < r1)
+                swap(r0, r1);
+            if (r0 != r1) {
+                float refinedError;
+                uint32_t refined = FitBC1Indices(block, r0, r1, &refinedError);
+                if (refinedError < error) {
+                    c0 = r0; c1 = r1; indices = refined;
+                }
+            }
+        }
+    }
+    memcpy(out, &c0, 2);
+    memcpy(out + 2, &c1, 2);
+    memcpy(out + 4, &indices, 4);
+}
+
+// Single channel block, 8 value mode
+void EncodeBC4(const uint8_t values[16], uint8_t *out) {
+    uint8_t lo = 255, hi = 0;
+    for (int t=0; t<16; ++t) {
+        lo = std::min(lo, values[t]);
+        hi = std::max(hi, values[t]);
+    }
+    out[0] = hi;
+    out[1] = lo;
+    uint64_t indices = 0;
+    if (hi != lo) {
+        float palette[8] = {(float)hi, (float)lo};
+        for (int i=2; i<8; ++i)
+            palette[i] = ((8 - i) * hi + (i - 1) * lo) / 7.0f;
+        for (int t=0; t<16; ++t) {
+            int best = 0;
+            float bestDist = 1e30f;
+            for (int p=0; p<8; ++p) {
+                float dist = fabs(values[t] - palette[p]);
+                if (dist < bestDist) {
+                    bestDist = dist;
+                    best = p;
+                }
+            }
+            indices |= (uint64_t)best << (3 * t);
+        }
+    }
+    for (int i=0; i<6; ++i)
+        out[2 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+void EncodeBlock(uint32_t format, const Block& block, uint8_t *out) {
+    uint8_t channel[16];
+    auto extract = [&](int c) {
+        for (int t=0; t<16; ++t)
+            channel[t] = block[t][c];
+    };
+    switch (format) {
+        case Ktx2::BC1_RGB_SRGB: case Ktx2::BC1_RGB_UNORM:
+            EncodeBC1(block, out);
+            break;
+        case Ktx2::BC3_SRGB: case Ktx2::BC3_UNORM:
+            extract(3);
+            EncodeBC4(channel, out);
+            EncodeBC1(block, out + 8);
+            break;
+        case Ktx2::BC4_UNORM:
+            extract(0);
+            EncodeBC4(channel, out);
+            break;
+        case Ktx2::BC5_UNORM:
+            extract(0);
+            EncodeBC4(channel, out);
+            extract(1);
+            EncodeBC4(channel, out + 8);
+            break;
+    }
+}
+
+// Compresses one mip level, block rows spread over the pool
+vector<uint8_t> CompressLevel(ThreadPool& pool, const FloatImage& image,
+    TextureKind kind, uint32_t format
+) {
+    const int blocksX = (image.Width + 3) / 4;
+    const int blocksY = (image.Height + 3) / 4;
+    const uint32_t blockBytes = Ktx2::BlockBytes(format);
+    vector<uint8_t> out(size_t(blocksX) * blocksY * blockBytes);
+
+    mutex doneMutex;
+    condition_variable doneCond;
+    int rowsLeft = blocksY;
+    for (int by=0; by<blocksY; ++by) {
+        pool.Submit([&, by]{
+            for (int bx=0; bx<blocksX; ++bx) {
+                Block block;
+                for (int t=0; t<16; ++t) {
+                    // Edge texels are repeated for levels smaller than a block
+                    const Pixel& p = image.At(bx*4 + t%4, by*4 + t/4);
+                    block[t][0] = FromLinear(p.r, kind);
+                    block[t][1] = FromLinear(p.g, kind);
+                    block[t][2] = FromLinear(p.b, kind);
+                    block[t][3] = FromLinear(p.a, LinearTexture);
+                }
+                EncodeBlock(format, block, &out[(size_t(by) * blocksX + bx) * blockBytes]);
+            }
+            lock_guard<mutex> lock(doneMutex);
+            if (--rowsLeft == 0)
+                doneCond.notify_one();
+        });
+    }
+    unique_lock<mutex> lock(doneMutex);
+    doneCond.wait(lock, [&]{ return rowsLeft == 0; });
+    return out;
+}
+
+bool Cook(ThreadPool& pool, const string& path) {
+    auto start = chrono::steady_clock::now();
+    int w, h, channels;
+    stbi_uc *pixels = stbi_load(path.c_str(), &w, &h, &channels, 4);
+    if (!pixels) {
+        cerr << "Couldn't load " << path << endl;
+        return false;
+    }
+
+    TextureKind kind = ClassifyTexture(path);
+    uint32_t format;
+    if (kind == NormalTexture)
+        format = Ktx2::BC5_UNORM; // Z is reconstructed in the shader
+    else if (channels == 1)
+        format = Ktx2::BC4_UNORM; // Swizzled back to gray on load
+    else if (channels == 2 || channels == 4)
+        format = kind == ColorTexture ? Ktx2::BC3_SRGB : Ktx2::BC3_UNORM;
+    else
+        format = kind == ColorTexture ? Ktx2::BC1_RGB_SRGB : Ktx2::BC1_RGB_UNORM;
+
+    FloatImage level;
+    level.Width = w;
+    level.Height = h;
+    level.Pixels.resize(size_t(w) * h);
+    for (size_t i=0; i<level.Pixels.size(); ++i) {
+        const stbi_uc *p = &pixels[i * 4];
+        level.Pixels[i] = {ToLinear(p[0], kind), ToLinear(p[1], kind),
+            ToLinear(p[2], kind), ToLinear(p[3], LinearTexture)};
+    }
+    stbi_image_free(pixels);
+
+    // Full chain, down to 1x1
+    vector<vector<uint8_t>> levels;
+    for (;;) {
+        levels.push_back(CompressLevel(pool, level, kind, format));
+        if (level.Width == 1 && level.Height == 1)
+            break;
+        level = Downsample(level, kind);
+    }
+
+    string outPath = Ktx2::PathFor(path);
+    vector<uint8_t> file = Ktx2::Write(format, w, h, levels, {
+        {"KTXwriter", "RG-Projekat TextureCooker"},
+        {Ktx2::SOURCE_CHANNELS_KEY, to_string(channels)},
+    });
+    ofstream out(outPath, ios::binary | ios::trunc);
+    out.write((const char*)file.data(), file.size());
+    if (!out) {
+        cerr << "Couldn't write " << outPath << endl;
+        return false;
+    }
+
+    const char *formatName =
+        format == Ktx2::BC5_UNORM ? "BC5" :
+        format == Ktx2::BC4_UNORM ? "BC4" :
+        Ktx2::BlockBytes(format) == 16 ? "BC3" : "BC1";
+    double rgbaMiB = w * h * 4 * 4.0 / 3 / (1 << 20); // RGBA8 with mips
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << path << " -> " << outPath << " (" << formatName << ", "
+         << w << "x" << h << ", " << levels.size() << " levels, "
+         << rgbaMiB << " MiB -> " << file.size() / double(1 << 20) << " MiB) in "
+         << ms << " ms" << endl;
+    return true;
+}
+
+bool IsSourceImage(const fs::path& path) {
+    string ext = path.extension().string();
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".png" || ext == ".jpg" || ext == ".jpeg" || ext == ".tga" || ext == ".bmp";
+}
+
+bool IsUpToDate(const fs::path& source) {
+    fs::path cooked = Ktx2::PathFor(source.string());
+    error_code ec;
+    return fs::exists(cooked, ec)
+        && fs::last_write_time(cooked, ec) >= fs::last_write_time(source, ec);
+}
+
+int main(int argc, char** argv) {
+    bool force = false;
+    vector<string> inputs;
+    for (int i=1; i<argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--force")
+            force = true;
+        else
+            inputs.push_back(arg);
+    }
+    if (inputs.empty())
+        inputs.push_back("Data/textures");
+
+    vector<string> sources;
+    for (const string& input: inputs) {
+        if (fs::is_directory(input)) {
+            for (const auto& entry: fs::directory_iterator(input))
+                if (entry.is_regular_file() && IsSourceImage(entry.path()))
+                    sources.push_back(entry.path().string());
+        } else {
+            sources.push_back(input);
+        }
+    }
+    sort(sources.begin(), sources.end());
+
+    ThreadPool pool(thread::hardware_concurrency());
+    auto start = chrono::steady_clock::now();
+    int cooked = 0, skipped = 0, failed = 0;
+    for (const string& source: sources) {
+        if (!force && IsUpToDate(source)) {
+            ++skipped;
+            continue;
+        }
+        if (Cook(pool, source))
+            ++cooked;
+        else
+            ++failed;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Cooked " << cooked << " textures (" << skipped << " up to date, "
+         << failed << " failed) on " << pool.GetThreadCount() << " threads in "
+         << seconds << " s" << endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+#include "trace.hpp"
+
+// Fixed size pool of worker threads
+// * Higher priority jobs run first, equal priorities in submission order
+// * Jobs still queued when the pool is destroyed are dropped, running
+//   ones are waited for
+// * Doesn't touch GL, anything GL related has to be handed back
+//   to the main thread (see BlockingQueue)
+// ---
+class ThreadPool {
+    struct Job {
+        int Priority;
+        uint64_t Sequence;
+        std::function<void()> Run;
+
+        bool operator<(const Job& other) const {
+            if (Priority != other.Priority)
+                return Priority < other.Priority;
+            return Sequence > other.Sequence;
+        }
+    };
+    std::vector<std::thread> Workers;
+    std::priority_queue<Job> Jobs;
+    uint64_t NextSequence = 0;
+    std::mutex Mutex;
+    std::condition_variable JobAvailable;
+    bool Quit = false;
+
+    void WorkerLoop(unsigned index) {
+        Trace::SetThreadName("Worker " + std::to_string(index));
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(Mutex);
+                JobAvailable.wait(lock, [this]{ return Quit || !Jobs.empty(); });
+                if (Quit)
+                    return;
+                job = std::move(const_cast<Job&>(Jobs.top()).Run);
+                Jobs.pop();
+            }
+            job();
+        }
+    }
+
+public:
+    // threadCount==0 picks one worker per core, leaving one for the main thread
+    ThreadPool(unsigned threadCount = 0) {
+        if (threadCount == 0) {
+            unsigned cores = std::thread::hardware_concurrency();
+            threadCount = cores > 1 ? cores - 1 : 1;
+        }
+        for (unsigned i=0; i<threadCount; ++i)
+            Workers.emplace_back([this, i]{ WorkerLoop(i); });
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(Mutex);
+            Quit = true;
+        }
+        JobAvailable.notify_all();
+        for (std::thread& worker: Workers)
+            worker.join();
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void Submit(std::function<void()> job, int priority = 0) {
+        {
+            std::lock_guard<std::mutex> lock(Mutex);
+            Jobs.push({priority, NextSequence++, std::move(job)});
+        }
+        JobAvailable.notify_one();
+    }
+    unsigned GetThreadCount() const { return Workers.size(); }
+
+    // Runs body(i) for every i in [0, count) across the workers and
+    // returns once all are done. The calling thread takes items too, so
+    // this is fine to call from inside a job (say a resource Prepare)
+    // even when every worker is busy, it just runs serially then.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& body, int priority = 0) {
+        struct Progress {
+            std::atomic<size_t> Next{0};
+            std::atomic<size_t> Done{0};
+            std::mutex Mutex;
+            std::condition_variable Finished;
+        };
+        // Helpers that only get to run after we return find nothing
+        // left to take, and never touch body
+        auto progress = std::make_shared<Progress>();
+        const std::function<void(size_t)> *bodyp = &body;
+        auto work = [progress, bodyp, count] {
+            size_t i;
+            while ((i = progress->Next++) < count) {
+                (*bodyp)(i);
+                if (++progress->Done == count) {
+                    std::lock_guard<std::mutex> lock(progress->Mutex);
+                    progress->Finished.notify_all();
+                }
+            }
+        };
+        size_t helpers = std::min<size_t>(Workers.size(), count > 0 ? count - 1 : 0);
+        for (size_t i=0; i<helpers; ++i)
+            Submit(work, priority);
+        work();
+        std::unique_lock<std::mutex> lock(progress->Mutex);
+        progress->Finished.wait(lock, [&]{ return progress->Done == count; });
+    }
+};
+
+// Hands results from the workers to a consumer thread, in completion order
+// ---
+template<class T>
+class BlockingQueue {
+    std::deque<T> Items;
+    std::mutex Mutex;
+    std::condition_variable ItemAvailable;
+
+public:
+    void Push(T item) {
+        {
+            std::lock_guard<std::mutex> lock(Mutex);
+            Items.push_back(std::move(item));
+        }
+        ItemAvailable.notify_one();
+    }
+    T Pop() {
+        std::unique_lock<std::mutex> lock(Mutex);
+        ItemAvailable.wait(lock, [this]{ return !Items.empty(); });
+        T item = std::move(Items.front());
+        Items.pop_front();
+        return item;
+    }
+};
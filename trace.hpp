@@ -0,0 +1,172 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Timeline of what the program spends its time on, mostly at startup
+// * TRACE_SCOPE("name") records a span from there to the end of the
+//   scope, Trace::Instant marks a point in time
+// * Timestamps in nanoseconds since the first trace call, events keep
+//   the (small, sequential) id of the thread they happened on
+// * Trace::Write dumps a Chrome trace event JSON file, open it in
+//   chrome://tracing or https://ui.perfetto.dev
+// * Thread-safe, doesn't touch GL
+// ---
+namespace Trace {
+
+struct Event {
+    std::string Name;
+    const char *Category;
+    char Phase; // 'X' = span, 'i' = instant
+    uint64_t StartNs;
+    uint64_t DurationNs;
+    uint32_t Thread;
+};
+
+namespace Detail {
+
+struct Log {
+    std::mutex Mutex;
+    std::vector<Event> Events;
+    std::vector<std::pair<uint32_t, std::string>> ThreadNames;
+    std::atomic<uint32_t> NextThread{0};
+    std::atomic<bool> Enabled{true};
+    const std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+};
+inline Log& TheLog() {
+    static Log log;
+    return log;
+}
+
+inline void Record(Event event) {
+    Log& log = TheLog();
+    std::lock_guard<std::mutex> lock(log.Mutex);
+    log.Events.push_back(std::move(event));
+}
+
+inline void AppendEscaped(std::string& out, const std::string& text) {
+    for (char c: text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char code[8];
+                    snprintf(code, sizeof(code), "\\u%04x", c);
+                    out += code;
+                } else {
+                    out += c;
+                }
+        }
+    }
+}
+
+} // namespace Detail
+
+inline uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - Detail::TheLog().Start).count();
+}
+
+inline uint32_t ThreadId() {
+    thread_local uint32_t id = Detail::TheLog().NextThread++;
+    return id;
+}
+
+// Shows up as the name of the calling thread's track
+inline void SetThreadName(const std::string& name) {
+    Detail::Log& log = Detail::TheLog();
+    uint32_t thread = ThreadId();
+    std::lock_guard<std::mutex> lock(log.Mutex);
+    log.ThreadNames.push_back({thread, name});
+}
+
+inline void SetEnabled(bool enabled) { Detail::TheLog().Enabled = enabled; }
+inline bool IsEnabled() { return Detail::TheLog().Enabled; }
+
+inline void Instant(std::string name, const char *category = "startup") {
+    if (IsEnabled())
+        Detail::Record({std::move(name), category, 'i', NowNs(), 0, ThreadId()});
+}
+
+// Records its own lifetime
+class Scope {
+    std::string Name;
+    const char *Category;
+    uint64_t StartNs;
+    bool Active;
+
+public:
+    explicit Scope(std::string name, const char *category = "startup")
+        : Name(std::move(name)), Category(category), StartNs(0), Active(IsEnabled()) {
+        if (Active)
+            StartNs = NowNs();
+    }
+    ~Scope() {
+        if (Active)
+            Detail::Record({std::move(Name), Category, 'X', StartNs, NowNs() - StartNs, ThreadId()});
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+};
+
+// Everything recorded so far as a Chrome trace event file
+inline bool Write(const std::string& path) {
+    Detail::Log& log = Detail::TheLog();
+    std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    {
+        std::lock_guard<std::mutex> lock(log.Mutex);
+        bool first = true;
+        char number[64];
+        for (auto& thread: log.ThreadNames) {
+            json += first ? "" : ",\n";
+            first = false;
+            json += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":";
+            json += std::to_string(thread.first);
+            json += ",\"args\":{\"name\":\"";
+            Detail::AppendEscaped(json, thread.second);
+            json += "\"}}";
+        }
+        for (const Event& event: log.Events) {
+            json += first ? "" : ",\n";
+            first = false;
+            json += "{\"ph\":\"";
+            json += event.Phase;
+            json += "\",\"cat\":\"";
+            json += event.Category;
+            json += "\",\"name\":\"";
+            Detail::AppendEscaped(json, event.Name);
+            // Chrome wants microseconds, keep the nanoseconds as decimals
+            snprintf(number, sizeof(number), "\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+                event.Thread, event.StartNs / 1000.0);
+            json += number;
+            if (event.Phase == 'X') {
+                snprintf(number, sizeof(number), ",\"dur\":%.3f", event.DurationNs / 1000.0);
+                json += number;
+            } else {
+                json += ",\"s\":\"g\"";
+            }
+            json += "}";
+        }
+    }
+    json += "\n]}\n";
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+    return fclose(file) == 0 && ok;
+}
+
+} // namespace Trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(...) Trace::Scope TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)